@@ -0,0 +1,86 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __MICRO_H
+#define __MICRO_H
+
+/*
+ * Shared helpers for the microbenchmarks in this directory.  Every
+ * benchmark draws its inputs from a fixed-seed generator, so that runs
+ * before and after a change see exactly the same data.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MICRO_SEED	0x6d6b73756d73ULL
+#define MICRO_RUNS	5
+
+static uint64_t micro_rng_state = MICRO_SEED;
+
+static inline uint64_t micro_rand(void)
+{
+	uint64_t z;
+
+	z = (micro_rng_state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return z ^ (z >> 31);
+}
+
+static inline uint64_t micro_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Runs fn() MICRO_RUNS times and reports the fastest run, normalised
+ * to nanoseconds per operation.
+ */
+static inline void micro_run(const char *name, void (*fn)(void *cookie),
+			     void *cookie, uint64_t ops)
+{
+	uint64_t best;
+	int i;
+
+	best = UINT64_MAX;
+	for (i = 0; i < MICRO_RUNS; i++) {
+		uint64_t start;
+		uint64_t t;
+
+		start = micro_now();
+		fn(cookie);
+		t = micro_now() - start;
+
+		if (t < best)
+			best = t;
+	}
+
+	printf("%-32s %12llu ops %10.3f ms %10.2f ns/op\n", name,
+	       (unsigned long long)ops, best / 1e6, (double)best / ops);
+}
+
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Measures extent_tree_diff() on heavily fragmented files: two files
+ * sharing every extent, but with the extent boundaries of the second
+ * split differently, so that the walk has to advance through both
+ * trees independently.
+ */
+
+#include "../extents.c"
+#include "micro.h"
+
+#define NUM_EXTENTS	65536
+#define PASSES		16
+
+static struct iv_avl_tree a;
+static struct iv_avl_tree b;
+static uint64_t length;
+static volatile int sink;
+
+static void add_extent(struct iv_avl_tree *tree, uint64_t logical,
+		       uint64_t physical, uint64_t len)
+{
+	struct extent *e;
+
+	e = malloc(sizeof(*e));
+	if (e == NULL)
+		abort();
+
+	e->fe_logical = logical;
+	e->fe_physical = physical;
+	e->fe_length = len;
+	e->fe_flags = FIEMAP_EXTENT_SHARED;
+	iv_avl_tree_insert(tree, &e->an);
+}
+
+static void bench_diff(void *cookie)
+{
+	int i;
+
+	for (i = 0; i < PASSES; i++) {
+		sink += extent_tree_diff(&a, 0, &b, 0, length);
+		if (sink)
+			abort();
+	}
+}
+
+int main(void)
+{
+	uint64_t physical;
+	int i;
+
+	INIT_IV_AVL_TREE(&a, compare_extents);
+	INIT_IV_AVL_TREE(&b, compare_extents);
+
+	length = 0;
+	physical = 1ULL << 30;
+	for (i = 0; i < NUM_EXTENTS; i++) {
+		uint64_t len;
+		uint64_t split;
+
+		len = 4096 * (2 + micro_rand() % 64);
+		split = 4096 * (1 + micro_rand() % (len / 4096 - 1));
+
+		add_extent(&a, length, physical, len);
+		add_extent(&b, length, physical, split);
+		add_extent(&b, length + split, physical + split, len - split);
+
+		length += len;
+		physical += len + 4096 * (1 + micro_rand() % 16);
+	}
+
+	micro_run("extent_tree_diff", bench_diff, NULL,
+		  (uint64_t)PASSES * NUM_EXTENTS);
+
+	extent_tree_free(&a);
+	extent_tree_free(&b);
+
+	return 0;
+}
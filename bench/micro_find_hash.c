@@ -0,0 +1,163 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Measures find_hash() lookups in the AVL tree that read_sum_files()
+ * builds, against a sorted array searched with bsearch() and an open
+ * addressing hash table, for a mix of hits and misses.
+ */
+
+#include "../read_sum_files.c"
+#include "micro.h"
+
+#define NUM_HASHES	(1 << 20)
+#define NUM_LOOKUPS	(1 << 21)
+
+static struct hash *entries;
+static struct iv_avl_tree tree;
+static struct hash **sorted;
+static struct hash **table;
+static uint64_t table_mask;
+static uint8_t (*keys)[64];
+static volatile uintptr_t sink;
+
+static uint64_t hash_key(const uint8_t *hash)
+{
+	uint64_t k;
+
+	memcpy(&k, hash, sizeof(k));
+
+	return k;
+}
+
+static void bench_avl(void *cookie)
+{
+	int i;
+
+	for (i = 0; i < NUM_LOOKUPS; i++)
+		sink += (uintptr_t)find_hash(&tree, keys[i]);
+}
+
+static int compare_sorted(const void *_a, const void *_b)
+{
+	const struct hash *a = *((struct hash **)_a);
+	const struct hash *b = *((struct hash **)_b);
+
+	return memcmp(a->hash, b->hash, sizeof(a->hash));
+}
+
+static int compare_key(const void *key, const void *_b)
+{
+	const struct hash *b = *((struct hash **)_b);
+
+	return memcmp(key, b->hash, sizeof(b->hash));
+}
+
+static void bench_bsearch(void *cookie)
+{
+	int i;
+
+	for (i = 0; i < NUM_LOOKUPS; i++) {
+		sink += (uintptr_t)bsearch(keys[i], sorted, NUM_HASHES,
+					   sizeof(*sorted), compare_key);
+	}
+}
+
+static struct hash *table_lookup(const uint8_t *hash)
+{
+	uint64_t slot;
+
+	slot = hash_key(hash) & table_mask;
+	while (table[slot] != NULL) {
+		if (!memcmp(table[slot]->hash, hash, 64))
+			return table[slot];
+		slot = (slot + 1) & table_mask;
+	}
+
+	return NULL;
+}
+
+static void bench_table(void *cookie)
+{
+	int i;
+
+	for (i = 0; i < NUM_LOOKUPS; i++)
+		sink += (uintptr_t)table_lookup(keys[i]);
+}
+
+static void random_hash(uint8_t *hash)
+{
+	int i;
+
+	for (i = 0; i < 64; i += 8) {
+		uint64_t r = micro_rand();
+
+		memcpy(hash + i, &r, 8);
+	}
+}
+
+int main(void)
+{
+	int i;
+
+	entries = malloc(NUM_HASHES * sizeof(*entries));
+	sorted = malloc(NUM_HASHES * sizeof(*sorted));
+	table = calloc(2 * NUM_HASHES, sizeof(*table));
+	keys = malloc(NUM_LOOKUPS * sizeof(*keys));
+	if (entries == NULL || sorted == NULL || table == NULL || keys == NULL)
+		abort();
+
+	INIT_IV_AVL_TREE(&tree, compare_hash);
+	table_mask = 2 * NUM_HASHES - 1;
+
+	for (i = 0; i < NUM_HASHES; i++) {
+		struct hash *h = entries + i;
+		uint64_t slot;
+
+		random_hash(h->hash);
+		iv_avl_tree_insert(&tree, &h->an);
+
+		sorted[i] = h;
+
+		slot = hash_key(h->hash) & table_mask;
+		while (table[slot] != NULL)
+			slot = (slot + 1) & table_mask;
+		table[slot] = h;
+	}
+
+	qsort(sorted, NUM_HASHES, sizeof(*sorted), compare_sorted);
+
+	for (i = 0; i < NUM_LOOKUPS; i++) {
+		if (micro_rand() & 1)
+			memcpy(keys[i], entries[micro_rand() % NUM_HASHES].hash, 64);
+		else
+			random_hash(keys[i]);
+	}
+
+	micro_run("find_hash_avl", bench_avl, NULL, NUM_LOOKUPS);
+	micro_run("find_hash_bsearch", bench_bsearch, NULL, NUM_LOOKUPS);
+	micro_run("find_hash_table", bench_table, NULL, NUM_LOOKUPS);
+
+	free(keys);
+	free(table);
+	free(sorted);
+	free(entries);
+
+	return 0;
+}
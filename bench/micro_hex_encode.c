@@ -0,0 +1,109 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Measures hex encoding of digests as done when mksums prints its
+ * output lines (one printf("%.2x") per byte), against a table-driven
+ * encoder writing whole lines with fwrite().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "micro.h"
+
+#define NUM_HASHES	65536
+
+static uint8_t (*hashes)[64];
+static FILE *out;
+
+static void bench_printf(void *cookie)
+{
+	int i;
+
+	for (i = 0; i < NUM_HASHES; i++) {
+		int j;
+
+		for (j = 0; j < 64; j++)
+			fprintf(out, "%.2x", hashes[i][j]);
+		fprintf(out, "  ");
+		fprintf(out, "some/dir/path");
+		fprintf(out, "/%s\n", "file_name.dat");
+	}
+	fflush(out);
+}
+
+static void bench_table(void *cookie)
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < NUM_HASHES; i++) {
+		char line[130];
+		int j;
+
+		for (j = 0; j < 64; j++) {
+			line[2 * j] = digits[hashes[i][j] >> 4];
+			line[2 * j + 1] = digits[hashes[i][j] & 15];
+		}
+		line[128] = ' ';
+		line[129] = ' ';
+
+		fwrite(line, 1, sizeof(line), out);
+		fputs("some/dir/path", out);
+		fprintf(out, "/%s\n", "file_name.dat");
+	}
+	fflush(out);
+}
+
+int main(void)
+{
+	static char buf[1048576];
+	int i;
+
+	hashes = malloc(NUM_HASHES * sizeof(*hashes));
+	if (hashes == NULL)
+		abort();
+
+	for (i = 0; i < NUM_HASHES; i++) {
+		int j;
+
+		for (j = 0; j < 64; j += 8) {
+			uint64_t r = micro_rand();
+
+			memcpy(hashes[i] + j, &r, 8);
+		}
+	}
+
+	out = fopen("/dev/null", "w");
+	if (out == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	setbuffer(out, buf, sizeof(buf));
+
+	micro_run("hex_encode_printf", bench_printf, NULL, NUM_HASHES);
+	micro_run("hex_encode_table", bench_table, NULL, NUM_HASHES);
+
+	fclose(out);
+	free(hashes);
+
+	return 0;
+}
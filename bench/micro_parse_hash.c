@@ -0,0 +1,79 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Measures sumfile_parse_hex() decoding of the hex digest at the start of each
+ * sum file line.
+ */
+
+#include "../read_sum_files.c"
+#include "micro.h"
+
+#define NUM_LINES	65536
+#define PASSES		16
+
+static char (*lines)[129];
+static volatile uint8_t sink;
+
+static void bench_parse_hash(void *cookie)
+{
+	int pass;
+	int i;
+
+	for (pass = 0; pass < PASSES; pass++) {
+		for (i = 0; i < NUM_LINES; i++) {
+			uint8_t hash[64];
+
+			if (sumfile_parse_hex(hash, lines[i]))
+				abort();
+			sink ^= hash[i & 63];
+		}
+	}
+}
+
+int main(void)
+{
+	static const char digits[] = "0123456789abcdef0123456789ABCDEF";
+	int upper;
+	int i;
+
+	lines = malloc(NUM_LINES * sizeof(*lines));
+	if (lines == NULL)
+		abort();
+
+	/*
+	 * mksums emits lowercase, but sha512sum-style files from other
+	 * tools may not, so mix in some uppercase lines.
+	 */
+	for (i = 0; i < NUM_LINES; i++) {
+		int j;
+
+		upper = (micro_rand() % 8) == 0 ? 16 : 0;
+		for (j = 0; j < 128; j++)
+			lines[i][j] = digits[upper + (micro_rand() & 15)];
+		lines[i][128] = 0;
+	}
+
+	micro_run("parse_hash", bench_parse_hash, NULL,
+		  (uint64_t)NUM_LINES * PASSES);
+
+	free(lines);
+
+	return 0;
+}
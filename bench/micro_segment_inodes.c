@@ -0,0 +1,128 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Measures segment_inodes() on large groups of inodes that share a
+ * hash but fall into many equivalence classes, which is the case that
+ * makes its leader selection loop expensive.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <unistd.h>
+#include "../hlsums_common.h"
+#include "micro.h"
+
+#define NUM_INODES	8192
+#define NUM_CLASSES	64
+
+static struct inode *inodes;
+static struct iv_avl_tree tree;
+static int pairs;
+
+static int compare_inodes(const struct iv_avl_node *_a,
+			  const struct iv_avl_node *_b)
+{
+	const struct inode *a = iv_container_of(_a, struct inode, an);
+	const struct inode *b = iv_container_of(_b, struct inode, an);
+
+	if (a->st_ino < b->st_ino)
+		return -1;
+	if (a->st_ino > b->st_ino)
+		return 1;
+
+	return 0;
+}
+
+static int inodes_equiv(const struct inode *a, const struct inode *b)
+{
+	return a->st_uid == b->st_uid && a->st_mode == b->st_mode;
+}
+
+static int better_leader(const struct inode *a, const struct inode *b)
+{
+	return a->st_nlink > b->st_nlink;
+}
+
+static void found_equiv(struct inode *leader, struct inode *ino)
+{
+	pairs++;
+}
+
+static void bench_segment(void *cookie)
+{
+	int need_nl;
+
+	need_nl = 0;
+	pairs = 0;
+	segment_inodes(&tree, &need_nl, "bench", inodes_equiv,
+		       better_leader, NULL, found_equiv);
+
+	if (pairs != NUM_INODES - NUM_CLASSES)
+		abort();
+}
+
+int main(void)
+{
+	int null_fd;
+	int saved_fd;
+	int i;
+
+	inodes = calloc(NUM_INODES, sizeof(*inodes));
+	if (inodes == NULL)
+		abort();
+
+	INIT_IV_AVL_TREE(&tree, compare_inodes);
+
+	for (i = 0; i < NUM_INODES; i++) {
+		struct inode *ino = inodes + i;
+
+		ino->st_ino = micro_rand();
+		ino->st_uid = i % NUM_CLASSES;
+		ino->st_mode = 0100644;
+		ino->st_nlink = 1 + micro_rand() % 4;
+		ino->st_size = 4096;
+		INIT_IV_LIST_HEAD(&ino->dentries);
+		iv_avl_tree_insert(&tree, &ino->an);
+	}
+
+	/*
+	 * segment_inodes() reports every group it finds on stderr.
+	 */
+	fflush(stderr);
+	saved_fd = dup(2);
+	null_fd = open("/dev/null", O_WRONLY);
+	if (saved_fd < 0 || null_fd < 0) {
+		perror("open");
+		return 1;
+	}
+	dup2(null_fd, 2);
+
+	micro_run("segment_inodes", bench_segment, NULL, NUM_INODES);
+
+	fflush(stderr);
+	dup2(saved_fd, 2);
+
+	free(inodes);
+
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Measures sorting of directory entries the way scan_one_dir() does it
+ * (AVL insertion with compare_temp_dir_entries() followed by an in-order
+ * walk), against qsort() on an array of the same entries.
+ */
+
+#include "../scan_tree.c"
+#include "micro.h"
+
+#define NUM_ENTRIES	4096
+#define NUM_DIRS	64
+
+static struct temp_dir_entry (*dirs)[NUM_ENTRIES];
+static struct temp_dir_entry *sorted[NUM_ENTRIES];
+static volatile uintptr_t sink;
+
+static void bench_avl(void *cookie)
+{
+	int d;
+
+	for (d = 0; d < NUM_DIRS; d++) {
+		struct iv_avl_tree tree;
+		struct iv_avl_node *an;
+		int i;
+
+		INIT_IV_AVL_TREE(&tree, compare_temp_dir_entries);
+		for (i = 0; i < NUM_ENTRIES; i++)
+			iv_avl_tree_insert(&tree, &dirs[d][i].an);
+
+		iv_avl_tree_for_each (an, &tree)
+			sink += (uintptr_t)an;
+	}
+}
+
+static int compare_array(const void *_a, const void *_b)
+{
+	const struct temp_dir_entry *a = *((struct temp_dir_entry **)_a);
+	const struct temp_dir_entry *b = *((struct temp_dir_entry **)_b);
+
+	return strcmp(a->d_name, b->d_name);
+}
+
+static void bench_qsort(void *cookie)
+{
+	int d;
+
+	for (d = 0; d < NUM_DIRS; d++) {
+		int i;
+
+		for (i = 0; i < NUM_ENTRIES; i++)
+			sorted[i] = &dirs[d][i];
+
+		qsort(sorted, NUM_ENTRIES, sizeof(*sorted), compare_array);
+
+		for (i = 0; i < NUM_ENTRIES; i++)
+			sink += (uintptr_t)sorted[i];
+	}
+}
+
+int main(void)
+{
+	static const char *prefixes[] = {
+		"IMG_", "DSC", "file", "part-", "",
+	};
+	int d;
+
+	dirs = malloc(NUM_DIRS * sizeof(*dirs));
+	if (dirs == NULL)
+		abort();
+
+	/*
+	 * Names share common prefixes and come in hash (readdir) order,
+	 * like they would on most filesystems.
+	 */
+	for (d = 0; d < NUM_DIRS; d++) {
+		int i;
+
+		for (i = 0; i < NUM_ENTRIES; i++) {
+			struct temp_dir_entry *e = &dirs[d][i];
+			char name[64];
+
+			snprintf(name, sizeof(name), "%s%.5d.%s",
+				 prefixes[micro_rand() % 5],
+				 (int)(micro_rand() % 100000),
+				 (micro_rand() & 1) ? "jpg" : "dat");
+
+			e->d_name = strdup(name);
+			if (e->d_name == NULL)
+				abort();
+			e->d_type = DT_REG;
+		}
+	}
+
+	micro_run("sort_dirents_avl", bench_avl, NULL,
+		  (uint64_t)NUM_DIRS * NUM_ENTRIES);
+	micro_run("sort_dirents_qsort", bench_qsort, NULL,
+		  (uint64_t)NUM_DIRS * NUM_ENTRIES);
+
+	return 0;
+}
@@ -0,0 +1,445 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Generates a synthetic directory tree for benchmarking mksums and
+ * hlsums.  The tree is fully determined by the command line (including
+ * --seed), so runs against the same parameters are comparable.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/fs.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+enum file_kind {
+	KIND_UNIQUE,
+	KIND_HARDLINK,
+	KIND_DUPLICATE,
+	KIND_REFLINK,
+	KIND_SPARSE,
+	KIND_MAX,
+};
+
+static const char *kind_names[KIND_MAX] = {
+	[KIND_UNIQUE]		= "unique",
+	[KIND_HARDLINK]		= "hardlink",
+	[KIND_DUPLICATE]	= "duplicate",
+	[KIND_REFLINK]		= "reflink",
+	[KIND_SPARSE]		= "sparse",
+};
+
+struct file_info
+{
+	uint64_t	seed;
+	off_t		size;
+	int		sparse;
+};
+
+static char *root;
+static int num_files = 10000;
+static int fanout = 32;
+static char *size_dist = "exp:65536";
+static double hardlink_ratio;
+static double dup_ratio;
+static double reflink_ratio;
+static double sparse_ratio;
+static uint64_t seed = 1;
+
+static int depth;
+static struct file_info *files;
+static int kind_count[KIND_MAX];
+static int reflink_fallbacks;
+static uint64_t total_bytes;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void)
+{
+	uint64_t z;
+
+	z = (rng_state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return z ^ (z >> 31);
+}
+
+static double rng_double(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static off_t pick_size(void)
+{
+	long long a;
+	long long b;
+
+	if (sscanf(size_dist, "fixed:%lld", &a) == 1)
+		return a;
+
+	if (sscanf(size_dist, "uniform:%lld:%lld", &a, &b) == 2)
+		return a + (b > a ? rng_next() % (b - a + 1) : 0);
+
+	if (sscanf(size_dist, "exp:%lld", &a) == 1)
+		return -log(1.0 - rng_double()) * a;
+
+	fprintf(stderr, "invalid size distribution: %s\n", size_dist);
+	exit(1);
+}
+
+static void file_path(char *buf, size_t len, int i)
+{
+	int dir;
+	int d;
+	int n;
+
+	dir = i / fanout;
+
+	n = snprintf(buf, len, "%s", root);
+	for (d = depth - 1; d >= 0; d--) {
+		int div;
+		int k;
+
+		div = 1;
+		for (k = 0; k < d; k++)
+			div *= fanout;
+
+		n += snprintf(buf + n, len - n, "/d%d", (dir / div) % fanout);
+	}
+
+	snprintf(buf + n, len - n, "/f%d", i);
+}
+
+static void make_dirs(char *path)
+{
+	char *p;
+
+	for (p = path + strlen(root) + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+
+		*p = 0;
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			perror("mkdir");
+			exit(1);
+		}
+		*p = '/';
+	}
+}
+
+static void fill(uint8_t *buf, size_t len, uint64_t *state)
+{
+	size_t i;
+
+	for (i = 0; i < len; i += 8) {
+		uint64_t z;
+
+		z = (*state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= z >> 31;
+
+		memcpy(buf + i, &z, len - i < 8 ? len - i : 8);
+	}
+}
+
+static void write_range(int fd, uint64_t *state, off_t off, off_t len)
+{
+	static uint8_t buf[1048576];
+
+	while (len) {
+		size_t chunk;
+
+		chunk = sizeof(buf);
+		if (chunk > len)
+			chunk = len;
+
+		fill(buf, chunk, state);
+		if (pwrite(fd, buf, chunk, off) != chunk) {
+			perror("pwrite");
+			exit(1);
+		}
+
+		off += chunk;
+		len -= chunk;
+	}
+}
+
+static int create_file(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	return fd;
+}
+
+static void make_sparse(const char *path, struct file_info *fi)
+{
+	uint64_t state;
+	off_t chunk;
+	off_t off;
+	int fd;
+
+	fd = create_file(path);
+
+	if (ftruncate(fd, fi->size) < 0) {
+		perror("ftruncate");
+		exit(1);
+	}
+
+	/*
+	 * Write every fourth 64 KiB chunk, leaving holes in between.
+	 */
+	state = fi->seed;
+	chunk = 65536;
+	for (off = 0; off < fi->size; off += 4 * chunk) {
+		write_range(fd, &state, off,
+			    fi->size - off < chunk ? fi->size - off : chunk);
+	}
+
+	close(fd);
+}
+
+static void make_contents(const char *path, struct file_info *fi)
+{
+	uint64_t state;
+	int fd;
+
+	if (fi->sparse) {
+		make_sparse(path, fi);
+		return;
+	}
+
+	fd = create_file(path);
+
+	state = fi->seed;
+	write_range(fd, &state, 0, fi->size);
+
+	close(fd);
+}
+
+static void make_reflink(const char *path, const char *src_path,
+			 struct file_info *fi)
+{
+	int src;
+	int fd;
+
+	src = open(src_path, O_RDONLY);
+	if (src < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	fd = create_file(path);
+
+	if (ioctl(fd, FICLONE, src) < 0) {
+		reflink_fallbacks++;
+		close(fd);
+		make_contents(path, fi);
+	} else {
+		close(fd);
+	}
+
+	close(src);
+}
+
+static void make_file(int i)
+{
+	struct file_info *fi = &files[i];
+	char path[4096];
+	char src_path[4096];
+	enum file_kind kind;
+	double r;
+	int src;
+
+	file_path(path, sizeof(path), i);
+	make_dirs(path);
+
+	fi->seed = rng_next();
+	fi->size = pick_size();
+	fi->sparse = 0;
+
+	kind = KIND_UNIQUE;
+	src = i ? rng_next() % i : 0;
+
+	r = rng_double();
+	if (i && (r -= hardlink_ratio) < 0)
+		kind = KIND_HARDLINK;
+	else if (i && (r -= dup_ratio) < 0)
+		kind = KIND_DUPLICATE;
+	else if (i && (r -= reflink_ratio) < 0)
+		kind = KIND_REFLINK;
+	else if ((r -= sparse_ratio) < 0)
+		kind = KIND_SPARSE;
+
+	if (kind != KIND_UNIQUE && kind != KIND_SPARSE) {
+		*fi = files[src];
+		file_path(src_path, sizeof(src_path), src);
+	}
+
+	switch (kind) {
+	case KIND_HARDLINK:
+		if (link(src_path, path) < 0) {
+			perror("link");
+			exit(1);
+		}
+		break;
+
+	case KIND_REFLINK:
+		make_reflink(path, src_path, fi);
+		break;
+
+	case KIND_SPARSE:
+		fi->sparse = 1;
+		make_sparse(path, fi);
+		break;
+
+	default:
+		make_contents(path, fi);
+		break;
+	}
+
+	kind_count[kind]++;
+	if (kind != KIND_HARDLINK)
+		total_bytes += fi->size;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "%s: [--files=N] [--fanout=N] "
+			"[--size=fixed:N|uniform:MIN:MAX|exp:MEAN] "
+			"[--hardlinks=RATIO] [--duplicates=RATIO] "
+			"[--reflinks=RATIO] [--sparse=RATIO] [--seed=N] "
+			"dir\n", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{ "duplicates", required_argument, 0, 'd', },
+		{ "fanout", required_argument, 0, 'F', },
+		{ "files", required_argument, 0, 'f', },
+		{ "hardlinks", required_argument, 0, 'l', },
+		{ "reflinks", required_argument, 0, 'r', },
+		{ "seed", required_argument, 0, 'S', },
+		{ "size", required_argument, 0, 'z', },
+		{ "sparse", required_argument, 0, 's', },
+		{ 0, 0, 0, 0, },
+	};
+	int ndirs;
+	int i;
+
+	while (1) {
+		int c;
+
+		c = getopt_long(argc, argv, "", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			dup_ratio = atof(optarg);
+			break;
+
+		case 'F':
+			fanout = atoi(optarg);
+			break;
+
+		case 'f':
+			num_files = atoi(optarg);
+			break;
+
+		case 'l':
+			hardlink_ratio = atof(optarg);
+			break;
+
+		case 'r':
+			reflink_ratio = atof(optarg);
+			break;
+
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+
+		case 's':
+			sparse_ratio = atof(optarg);
+			break;
+
+		case 'z':
+			size_dist = optarg;
+			break;
+
+		case '?':
+			return 1;
+
+		default:
+			abort();
+		}
+	}
+
+	if (argc != optind + 1 || num_files < 0 || fanout < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	root = argv[optind];
+	if (mkdir(root, 0755) < 0) {
+		perror("mkdir");
+		return 1;
+	}
+
+	ndirs = (num_files + fanout - 1) / fanout;
+	depth = 1;
+	for (i = fanout; i < ndirs; i *= fanout)
+		depth++;
+
+	files = calloc(num_files ? num_files : 1, sizeof(*files));
+	if (files == NULL)
+		abort();
+
+	rng_state = seed;
+	for (i = 0; i < num_files; i++)
+		make_file(i);
+
+	printf("{ \"files\": %d, \"fanout\": %d, \"depth\": %d, "
+	       "\"size\": \"%s\", \"seed\": %llu, \"bytes\": %llu",
+	       num_files, fanout, depth, size_dist,
+	       (unsigned long long)seed, (unsigned long long)total_bytes);
+	for (i = 0; i < KIND_MAX; i++)
+		printf(", \"%s\": %d", kind_names[i], kind_count[i]);
+	printf(", \"reflink_fallbacks\": %d }\n", reflink_fallbacks);
+
+	return 0;
+}
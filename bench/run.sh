@@ -0,0 +1,125 @@
+#!/bin/sh
+#
+# Runs the mksums/hlsums benchmark suite and writes a JSON report.
+#
+# All knobs are environment variables, so that "make bench" can be
+# parameterised from the command line:
+#
+#   BENCH_FILES       number of files to generate (default 20000)
+#   BENCH_FANOUT      entries per directory (default 32)
+#   BENCH_SIZE        fixed:N, uniform:MIN:MAX or exp:MEAN (default exp:65536)
+#   BENCH_HARDLINKS   fraction of files that are hard links (default 0.05)
+#   BENCH_DUPLICATES  fraction of files that are duplicates (default 0.2)
+#   BENCH_REFLINKS    fraction of files that are reflinked copies (default 0)
+#   BENCH_SPARSE      fraction of files that are sparse (default 0.05)
+#   BENCH_SEED        generator seed (default 1)
+#   BENCH_DIR         directory to build trees in (default /dev/shm)
+#   BENCH_IMAGE_FS    if set (e.g. btrfs, xfs), build the trees on a
+#                     loop-mounted image of this type instead (needs root)
+#   BENCH_IMAGE_SIZE  size of that image (default 4G)
+#   BENCH_OUT         report file (default: standard output)
+#
+# Cold-cache runs drop the page cache first, which needs root; the
+# report records whether that actually happened.
+
+set -e
+
+BENCH_FILES=${BENCH_FILES:-20000}
+BENCH_FANOUT=${BENCH_FANOUT:-32}
+BENCH_SIZE=${BENCH_SIZE:-exp:65536}
+BENCH_HARDLINKS=${BENCH_HARDLINKS:-0.05}
+BENCH_DUPLICATES=${BENCH_DUPLICATES:-0.2}
+BENCH_REFLINKS=${BENCH_REFLINKS:-0}
+BENCH_SPARSE=${BENCH_SPARSE:-0.05}
+BENCH_SEED=${BENCH_SEED:-1}
+BENCH_DIR=${BENCH_DIR:-/dev/shm}
+BENCH_IMAGE_SIZE=${BENCH_IMAGE_SIZE:-4G}
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d "$BENCH_DIR/mksums-bench.XXXXXX")
+mnt=
+
+cleanup()
+{
+	if [ -n "$mnt" ]; then
+		umount "$mnt" || true
+	fi
+	rm -rf "$work"
+}
+trap cleanup EXIT
+
+if [ -n "$BENCH_IMAGE_FS" ]; then
+	truncate -s "$BENCH_IMAGE_SIZE" "$work/image"
+	"mkfs.$BENCH_IMAGE_FS" -q "$work/image" >/dev/null 2>&1 ||
+		"mkfs.$BENCH_IMAGE_FS" "$work/image" >/dev/null
+	mkdir "$work/mnt"
+	mount -o loop "$work/image" "$work/mnt"
+	mnt="$work/mnt"
+	tree="$mnt/tree"
+else
+	tree="$work/tree"
+fi
+
+make_tree()
+{
+	rm -rf "$tree"
+	"$top/bench/mktree" --files="$BENCH_FILES" --fanout="$BENCH_FANOUT" \
+		--size="$BENCH_SIZE" --hardlinks="$BENCH_HARDLINKS" \
+		--duplicates="$BENCH_DUPLICATES" --reflinks="$BENCH_REFLINKS" \
+		--sparse="$BENCH_SPARSE" --seed="$BENCH_SEED" "$tree"
+}
+
+drop_caches()
+{
+	sync
+	if echo 3 2>/dev/null >/proc/sys/vm/drop_caches; then
+		echo true
+	else
+		echo false
+	fi
+}
+
+# run NAME COLD PROGRAM ARGS...
+run()
+{
+	name=$1
+	cold=$2
+	shift 2
+
+	echo "bench: $name" >&2
+	"$@" --stats-json="$work/$name.json" >"$work/$name.out" 2>/dev/null
+	runs="$runs$sep\"$name\": { \"cold_cache\": $cold, \"stats\": $(cat "$work/$name.json") }"
+	sep=", "
+}
+
+runs=
+sep=
+
+treeinfo=$(make_tree)
+
+run mksums_cold "$(drop_caches)" "$top/mksums" "$tree"
+run mksums_warm false "$top/mksums" "$tree"
+run mksums_xattr_populate false "$top/mksums" --xattr-cache-hash "$tree"
+run mksums_xattr_cold "$(drop_caches)" "$top/mksums" --xattr-cache-hash "$tree"
+run mksums_xattr_warm false "$top/mksums" --xattr-cache-hash "$tree"
+
+# hlsums creates its temporary link in the current directory, which
+# has to be on the same filesystem as the tree.
+sums="$work/mksums_warm.out"
+
+cd "$tree"
+run hlsums_link false "$top/hlsums" --link "$sums"
+
+cd "$work"
+make_tree >/dev/null
+cd "$tree"
+run hlsums_dedup false "$top/hlsums" --dedup "$sums"
+cd "$work"
+
+report="{ \"tree\": $treeinfo, \"filesystem\": \"${BENCH_IMAGE_FS:-$(stat -f -c %T "$work")}\", \"runs\": { $runs } }"
+
+if [ -n "$BENCH_OUT" ]; then
+	echo "$report" >"$BENCH_OUT"
+else
+	echo "$report"
+fi
@@ -0,0 +1,679 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compress.h"
+#include "stats.h"
+
+int decompress_is_zstd(const void *_buf, size_t len)
+{
+	const unsigned char *buf = _buf;
+
+	return len >= 4 && buf[0] == 0x28 && buf[1] == 0xb5 &&
+	       buf[2] == 0x2f && buf[3] == 0xfd;
+}
+
+#ifdef HAVE_ZSTD
+struct compress_cookie
+{
+	FILE			*dst;
+	ZSTD_CCtx		*cctx;
+	size_t			out_size;
+	void			*out;
+};
+
+static int compress_run(struct compress_cookie *cc, const char *buf,
+			size_t size, ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer in = { buf, size, 0 };
+
+	while (1) {
+		ZSTD_outBuffer out = { cc->out, cc->out_size, 0 };
+		size_t ret;
+
+		ret = ZSTD_compressStream2(cc->cctx, &out, &in, mode);
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(ret));
+			return 1;
+		}
+
+		if (out.pos && fwrite(cc->out, 1, out.pos, cc->dst) != out.pos)
+			return 1;
+
+		if (mode == ZSTD_e_end ? ret == 0 : in.pos == in.size)
+			break;
+	}
+
+	return 0;
+}
+
+static ssize_t compress_write(void *cookie, const char *buf, size_t size)
+{
+	struct compress_cookie *cc = cookie;
+
+	if (compress_run(cc, buf, size, ZSTD_e_continue)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return size;
+}
+
+static int compress_close(void *cookie)
+{
+	struct compress_cookie *cc = cookie;
+	int ret;
+
+	ret = 0;
+	if (compress_run(cc, NULL, 0, ZSTD_e_end) || fflush(cc->dst))
+		ret = EOF;
+
+	ZSTD_freeCCtx(cc->cctx);
+	free(cc->out);
+	free(cc);
+
+	return ret;
+}
+
+FILE *compress_open(FILE *dst, int level, int threads)
+{
+	static cookie_io_functions_t funcs = {
+		.write = compress_write,
+		.close = compress_close,
+	};
+	struct compress_cookie *cc;
+	FILE *fp;
+
+	cc = malloc(sizeof(*cc));
+	if (cc == NULL)
+		abort();
+
+	cc->dst = dst;
+
+	cc->cctx = ZSTD_createCCtx();
+	if (cc->cctx == NULL)
+		abort();
+
+	ZSTD_CCtx_setParameter(cc->cctx, ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(cc->cctx, ZSTD_c_checksumFlag, 1);
+	if (threads > 1 &&
+	    ZSTD_isError(ZSTD_CCtx_setParameter(cc->cctx,
+						ZSTD_c_nbWorkers, threads))) {
+		fprintf(stderr, "zstd: multithreading not supported by "
+				"libzstd, compressing single threaded\n");
+	}
+
+	cc->out_size = ZSTD_CStreamOutSize();
+	cc->out = malloc(cc->out_size);
+	if (cc->out == NULL)
+		abort();
+
+	fp = fopencookie(cc, "w", funcs);
+	if (fp == NULL) {
+		perror("fopencookie");
+		ZSTD_freeCCtx(cc->cctx);
+		free(cc->out);
+		free(cc);
+		return NULL;
+	}
+
+	/*
+	 * zstd has its own input buffering, so a large stdio buffer
+	 * only serves to reduce the number of compressStream calls.
+	 */
+	setvbuf(fp, NULL, _IOFBF, 1048576);
+
+	return fp;
+}
+
+/*
+ * Each compressed input file is decompressed by its own thread, so
+ * that several inputs decompress in parallel while the caller parses
+ * them in order.  Once the first chunk of output is in, the caller's
+ * keep() decides what to do with the rest: either the whole output is
+ * collected in memory, or it is handed over chunk by chunk as the
+ * caller reads it, with at most DECOMPRESS_READ_AHEAD chunks queued.
+ */
+#define DECOMPRESS_READ_AHEAD	8
+
+struct decompress_chunk
+{
+	struct decompress_chunk	*next;
+	size_t			len;
+	size_t			pos;
+	char			data[0];
+};
+
+struct decompress_job
+{
+	const char		*file;
+	int			fd;
+	int			(*keep)(const void *buf, size_t len);
+	pthread_t		thread;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int			decided;
+	int			whole;
+	int			done;
+	int			closed;
+	struct decompress_chunk	*head;
+	struct decompress_chunk	**tail;
+	int			queued;
+	struct decompress_chunk	*cur;
+
+	void			*buf;
+	size_t			len;
+	size_t			size;
+	int			ret;
+};
+
+static struct decompress_chunk *alloc_chunk(void)
+{
+	struct decompress_chunk *c;
+
+	c = malloc(sizeof(*c) + ZSTD_DStreamOutSize());
+	if (c == NULL)
+		abort();
+
+	c->next = NULL;
+	c->len = 0;
+	c->pos = 0;
+
+	return c;
+}
+
+static void append_whole(struct decompress_job *job,
+			 struct decompress_chunk *c)
+{
+	if (job->size - job->len < c->len) {
+		if (job->size == 0)
+			job->size = 1048576;
+		while (job->size - job->len < c->len)
+			job->size *= 2;
+
+		job->buf = realloc(job->buf, job->size);
+		if (job->buf == NULL)
+			abort();
+	}
+
+	memcpy((char *)job->buf + job->len, c->data, c->len);
+	job->len += c->len;
+}
+
+/*
+ * Hands a full (or final) chunk of output to the consumer.  Returns
+ * the chunk to decompress into next, or NULL if the consumer has gone
+ * away.
+ */
+static struct decompress_chunk *emit_chunk(struct decompress_job *job,
+					   struct decompress_chunk *c)
+{
+	pthread_mutex_lock(&job->lock);
+
+	if (!job->decided) {
+		job->decided = 1;
+		job->whole = job->keep == NULL || job->keep(c->data, c->len);
+		pthread_cond_broadcast(&job->cond);
+	}
+
+	if (job->whole) {
+		pthread_mutex_unlock(&job->lock);
+		append_whole(job, c);
+		c->len = 0;
+		return c;
+	}
+
+	while (job->queued >= DECOMPRESS_READ_AHEAD && !job->closed)
+		pthread_cond_wait(&job->cond, &job->lock);
+
+	if (job->closed) {
+		pthread_mutex_unlock(&job->lock);
+		free(c);
+		return NULL;
+	}
+
+	*job->tail = c;
+	job->tail = &c->next;
+	job->queued++;
+	pthread_cond_broadcast(&job->cond);
+
+	pthread_mutex_unlock(&job->lock);
+
+	return alloc_chunk();
+}
+
+static void *decompress_thread(void *cookie)
+{
+	struct decompress_job *job = cookie;
+	ZSTD_DCtx *dctx;
+	size_t in_size;
+	void *in_buf;
+	struct decompress_chunk *c;
+	size_t out_size;
+	size_t ret;
+
+	dctx = ZSTD_createDCtx();
+	if (dctx == NULL)
+		abort();
+
+	in_size = ZSTD_DStreamInSize();
+	in_buf = malloc(in_size);
+	if (in_buf == NULL)
+		abort();
+
+	c = alloc_chunk();
+	out_size = ZSTD_DStreamOutSize();
+
+	ret = 0;
+	while (1) {
+		ZSTD_inBuffer in;
+		ssize_t n;
+
+		stats_count(STATS_SYS_READ, 1);
+		n = read(job->fd, in_buf, in_size);
+		if (n < 0) {
+			perror("read");
+			job->ret = 1;
+			break;
+		}
+
+		if (n == 0) {
+			if (ret != 0) {
+				fprintf(stderr, "%s: truncated zstd stream\n",
+					job->file);
+				job->ret = 1;
+			}
+			break;
+		}
+
+		stats_count(STATS_BYTES_READ, n);
+
+		in.src = in_buf;
+		in.size = n;
+		in.pos = 0;
+
+		while (in.pos < in.size) {
+			ZSTD_outBuffer out;
+
+			out.dst = c->data + c->len;
+			out.size = out_size - c->len;
+			out.pos = 0;
+
+			ret = ZSTD_decompressStream(dctx, &out, &in);
+			if (ZSTD_isError(ret)) {
+				fprintf(stderr, "%s: zstd: %s\n", job->file,
+					ZSTD_getErrorName(ret));
+				job->ret = 1;
+				goto out;
+			}
+
+			c->len += out.pos;
+			if (c->len == out_size) {
+				c = emit_chunk(job, c);
+				if (c == NULL)
+					goto out;
+			}
+		}
+	}
+
+	if (!job->ret && (c->len || !job->decided))
+		c = emit_chunk(job, c);
+
+out:
+	free(c);
+	ZSTD_freeDCtx(dctx);
+	free(in_buf);
+	close(job->fd);
+
+	pthread_mutex_lock(&job->lock);
+	job->done = 1;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+
+	return NULL;
+}
+
+struct decompress_job *decompress_start(const char *file, int fd,
+					int (*keep)(const void *buf,
+						    size_t len))
+{
+	struct decompress_job *job;
+	int ret;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL)
+		abort();
+
+	job->file = file;
+	job->fd = fd;
+	job->keep = keep;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+	job->tail = &job->head;
+
+	ret = pthread_create(&job->thread, NULL, decompress_thread, job);
+	if (ret) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		exit(1);
+	}
+
+	return job;
+}
+
+static void free_job(struct decompress_job *job)
+{
+	struct decompress_chunk *c;
+
+	while (job->head != NULL) {
+		c = job->head;
+		job->head = c->next;
+		free(c);
+	}
+	free(job->cur);
+	free(job->buf);
+
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->cond);
+	free(job);
+}
+
+static ssize_t job_read(void *cookie, char *buf, size_t size)
+{
+	struct decompress_job *job = cookie;
+	struct decompress_chunk *c;
+	size_t len;
+
+	c = job->cur;
+	if (c == NULL || c->pos == c->len) {
+		free(c);
+		job->cur = NULL;
+
+		pthread_mutex_lock(&job->lock);
+
+		while (job->head == NULL && !job->done)
+			pthread_cond_wait(&job->cond, &job->lock);
+
+		c = job->head;
+		if (c != NULL) {
+			job->head = c->next;
+			if (job->head == NULL)
+				job->tail = &job->head;
+			job->queued--;
+			pthread_cond_broadcast(&job->cond);
+		}
+
+		pthread_mutex_unlock(&job->lock);
+
+		if (c == NULL) {
+			if (job->ret) {
+				errno = EIO;
+				return -1;
+			}
+			return 0;
+		}
+
+		job->cur = c;
+	}
+
+	len = c->len - c->pos;
+	if (len > size)
+		len = size;
+
+	memcpy(buf, c->data + c->pos, len);
+	c->pos += len;
+
+	return len;
+}
+
+static int job_close(void *cookie)
+{
+	struct decompress_job *job = cookie;
+	int ret;
+
+	pthread_mutex_lock(&job->lock);
+	job->closed = 1;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+
+	pthread_join(job->thread, NULL);
+
+	ret = job->ret;
+
+	free_job(job);
+
+	return ret ? EOF : 0;
+}
+
+int decompress_finish(struct decompress_job *job, FILE **fp,
+		      void **buf, size_t *len)
+{
+	static cookie_io_functions_t funcs = {
+		.read = job_read,
+		.close = job_close,
+	};
+	int ret;
+
+	*fp = NULL;
+	*buf = NULL;
+	*len = 0;
+
+	pthread_mutex_lock(&job->lock);
+	while (!job->decided && !job->done)
+		pthread_cond_wait(&job->cond, &job->lock);
+	pthread_mutex_unlock(&job->lock);
+
+	if (job->decided && !job->whole) {
+		*fp = fopencookie(job, "r", funcs);
+		if (*fp == NULL) {
+			perror("fopencookie");
+			job_close(job);
+			return 1;
+		}
+		return 0;
+	}
+
+	pthread_join(job->thread, NULL);
+
+	ret = job->ret;
+	if (!ret) {
+		*buf = job->buf;
+		*len = job->len;
+		job->buf = NULL;
+	}
+
+	free_job(job);
+
+	return ret;
+}
+
+struct decompress_cookie
+{
+	FILE			*src;
+	const char		*file;
+	ZSTD_DCtx		*dctx;
+	void			*in_buf;
+	size_t			in_size;
+	ZSTD_inBuffer		in;
+	size_t			ret;
+	int			error;
+};
+
+static ssize_t decompress_read(void *cookie, char *buf, size_t size)
+{
+	struct decompress_cookie *dc = cookie;
+	ZSTD_outBuffer out = { buf, size, 0 };
+
+	/*
+	 * stdio retries failed reads, so remember errors to only
+	 * report them once.
+	 */
+	if (dc->error) {
+		errno = EIO;
+		return -1;
+	}
+
+	while (out.pos == 0) {
+		size_t ret;
+
+		if (dc->in.pos == dc->in.size) {
+			size_t n;
+
+			n = fread(dc->in_buf, 1, dc->in_size, dc->src);
+			if (n == 0) {
+				if (ferror(dc->src)) {
+					errno = EIO;
+					return -1;
+				}
+
+				if (dc->ret != 0) {
+					fprintf(stderr, "%s: truncated zstd "
+							"stream\n", dc->file);
+					dc->error = 1;
+					errno = EIO;
+					return -1;
+				}
+
+				return 0;
+			}
+
+			stats_count(STATS_BYTES_READ, n);
+
+			dc->in.src = dc->in_buf;
+			dc->in.size = n;
+			dc->in.pos = 0;
+		}
+
+		ret = ZSTD_decompressStream(dc->dctx, &out, &dc->in);
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "%s: zstd: %s\n", dc->file,
+				ZSTD_getErrorName(ret));
+			dc->error = 1;
+			errno = EIO;
+			return -1;
+		}
+
+		dc->ret = ret;
+	}
+
+	return out.pos;
+}
+
+static int decompress_close(void *cookie)
+{
+	struct decompress_cookie *dc = cookie;
+
+	fclose(dc->src);
+	ZSTD_freeDCtx(dc->dctx);
+	free(dc->in_buf);
+	free(dc);
+
+	return 0;
+}
+
+FILE *decompress_open(FILE *src, const char *file,
+		      const void *head, size_t head_len)
+{
+	static cookie_io_functions_t funcs = {
+		.read = decompress_read,
+		.close = decompress_close,
+	};
+	struct decompress_cookie *dc;
+	FILE *fp;
+
+	dc = malloc(sizeof(*dc));
+	if (dc == NULL)
+		abort();
+
+	dc->src = src;
+	dc->file = file;
+
+	dc->dctx = ZSTD_createDCtx();
+	if (dc->dctx == NULL)
+		abort();
+
+	dc->in_size = ZSTD_DStreamInSize();
+	if (dc->in_size < head_len)
+		dc->in_size = head_len;
+	dc->in_buf = malloc(dc->in_size);
+	if (dc->in_buf == NULL)
+		abort();
+
+	memcpy(dc->in_buf, head, head_len);
+	dc->in.src = dc->in_buf;
+	dc->in.size = head_len;
+	dc->in.pos = 0;
+	dc->ret = 0;
+	dc->error = 0;
+
+	fp = fopencookie(dc, "r", funcs);
+	if (fp == NULL) {
+		perror("fopencookie");
+		fclose(src);
+		ZSTD_freeDCtx(dc->dctx);
+		free(dc->in_buf);
+		free(dc);
+		return NULL;
+	}
+
+	return fp;
+}
+#else
+FILE *compress_open(FILE *dst, int level, int threads)
+{
+	fprintf(stderr, "zstd support not compiled in\n");
+	return NULL;
+}
+
+struct decompress_job *decompress_start(const char *file, int fd,
+					int (*keep)(const void *buf,
+						    size_t len))
+{
+	fprintf(stderr, "%s: zstd support not compiled in\n", file);
+	close(fd);
+	return NULL;
+}
+
+int decompress_finish(struct decompress_job *job, FILE **fp,
+		      void **buf, size_t *len)
+{
+	*fp = NULL;
+	*buf = NULL;
+	*len = 0;
+	return 1;
+}
+
+FILE *decompress_open(FILE *src, const char *file,
+		      const void *head, size_t head_len)
+{
+	fprintf(stderr, "%s: zstd support not compiled in\n", file);
+	fclose(src);
+	return NULL;
+}
+#endif
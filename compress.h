@@ -0,0 +1,61 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Streaming zstd compression of sum files.  When built without
+ * libzstd, compress_open() and decompress_start() fail with an error
+ * message, and compressed input is still detected so that it can be
+ * rejected cleanly instead of being parsed as garbage.
+ */
+FILE *compress_open(FILE *dst, int level, int threads);
+
+int decompress_is_zstd(const void *buf, size_t len);
+
+/*
+ * Decompression of a whole file in a background thread.  keep() is
+ * shown the first chunk of output and says whether the whole output
+ * should be collected in memory (a NULL keep() always does).  If so,
+ * decompress_finish() waits for it and returns it in *buf and *len.
+ * If not, decompress_finish() returns a stream in *fp that reads the
+ * output while it is being decompressed, with bounded read-ahead.
+ */
+struct decompress_job;
+struct decompress_job *decompress_start(const char *file, int fd,
+					int (*keep)(const void *buf,
+						    size_t len));
+int decompress_finish(struct decompress_job *job, FILE **fp,
+		      void **buf, size_t *len);
+
+/*
+ * Streaming decompression, for inputs that are too large to
+ * decompress into memory.  head/head_len are bytes that the caller
+ * already read from src to sniff the format.  src is closed when
+ * the returned stream is, or right away if this fails.
+ */
+FILE *decompress_open(FILE *src, const char *file,
+		      const void *head, size_t head_len);
+
+
+#endif
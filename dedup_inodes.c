@@ -32,6 +32,8 @@
 #include <unistd.h>
 #include "hlsums_common.h"
 #include "extents.h"
+#include "probes.h"
+#include "stats.h"
 
 #ifndef FIDEDUPERANGE
 #define FIDEDUPERANGE	_IOWR(0x94, 54, struct file_dedupe_range)
@@ -79,10 +81,12 @@ static void try_open_inodes(struct iv_avl_tree *inodes)
 
 			d = iv_container_of(lh, struct dentry, list);
 
+			stats_count(STATS_SYS_OPEN, 1);
 			fd = open(d->name, O_RDWR);
 			if (fd < 0 && errno == EACCES && !opened_readonly) {
 				opened_readonly = 1;
 				ino->readonly = 1;
+				stats_count(STATS_SYS_OPEN, 1);
 				fd = open(d->name, O_RDONLY);
 			}
 
@@ -95,7 +99,7 @@ static void try_open_inodes(struct iv_avl_tree *inodes)
 				continue;
 			}
 
-			if (extent_tree_build(&ino->extents, fd)) {
+			if (extent_tree_build(&ino->extents, fd, 0)) {
 				extent_tree_free(&ino->extents);
 				close(fd);
 				continue;
@@ -155,6 +159,7 @@ static void do_dedup_inodes(struct inode *leader, struct inode *ino)
 			struct file_dedupe_range r;
 			struct file_dedupe_range_info ri;
 		} x;
+		uint64_t start;
 
 		x.r.src_offset = off;
 		x.r.src_length = leader->st_size - off;
@@ -167,10 +172,14 @@ static void do_dedup_inodes(struct inode *leader, struct inode *ino)
 		x.ri.status = 0;
 		x.ri.reserved = 0;
 
+		start = PROBE_START(dedupe_range);
+		stats_count(STATS_SYS_IOCTL, 1);
 		if (ioctl(leader->fd, FIDEDUPERANGE, &x) < 0) {
 			perror("ioctl");
 			break;
 		}
+		PROBE4(dedupe_range, leader->st_ino, ino->st_ino,
+		       x.ri.bytes_deduped, PROBE_LATENCY(start));
 
 		if (x.ri.status == FILE_DEDUPE_RANGE_DIFFERS) {
 			fprintf(stderr, "welp, data differs\n");
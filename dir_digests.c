@@ -0,0 +1,321 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <obstack.h>
+#include <openssl/sha.h>
+#include <string.h>
+#include "mksums_common.h"
+
+/*
+ * Per-directory Merkle digests.  A directory's digest is the SHA-512
+ * of its children sorted by name (in strcmp() order), where each child
+ * contributes:
+ *
+ *	1	type, 'f' for a regular file or 'd' for a directory
+ *	n	name, including the terminating NUL
+ *	64	the child's SHA-512 file or directory digest
+ *
+ * Like the sums themselves, this only covers regular files, so
+ * directories without any regular files below them have no digest
+ * and aren't part of their parent's.  Directories with a file that
+ * couldn't be hashed somewhere below them don't get a digest either.
+ *
+ * The digests are written in the same format as file sums, sorted by
+ * path, so parents come before their children.
+ */
+struct child
+{
+	int			type;
+	const char		*name;
+	const uint8_t		*digest;
+};
+
+struct dir_node
+{
+	struct iv_avl_node	an;
+	struct dir		*dir;
+	struct dir_node		*parent;
+	int			depth;
+	int			incomplete;
+	int			num_children;
+	int			max_children;
+	struct child		*children;
+	char			*path;
+	uint8_t			digest[64];
+};
+
+static int
+compare_dir_nodes(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
+{
+	const struct dir_node *a = iv_container_of(_a, struct dir_node, an);
+	const struct dir_node *b = iv_container_of(_b, struct dir_node, an);
+
+	if (a->dir < b->dir)
+		return -1;
+	if (a->dir > b->dir)
+		return 1;
+	return 0;
+}
+
+static struct dir_node *find_dir_node(struct iv_avl_tree *tree,
+				      struct dir *dir)
+{
+	struct iv_avl_node *an;
+
+	an = tree->root;
+	while (an != NULL) {
+		struct dir_node *dn;
+
+		dn = iv_container_of(an, struct dir_node, an);
+		if (dir == dn->dir)
+			return dn;
+
+		if (dir < dn->dir)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+#define obstack_chunk_alloc	malloc
+#define obstack_chunk_free	free
+
+struct digest_state
+{
+	struct iv_avl_tree	nodes;
+	struct obstack		pool;
+	struct dir_node		**all;
+	int			num_nodes;
+	int			max_nodes;
+};
+
+static void add_child(struct dir_node *dn, int type, const char *name,
+		      const uint8_t *digest)
+{
+	struct child *c;
+
+	if (dn->num_children == dn->max_children) {
+		dn->max_children = dn->max_children ?
+					2 * dn->max_children : 16;
+		dn->children = realloc(dn->children, dn->max_children *
+						     sizeof(*dn->children));
+		if (dn->children == NULL)
+			abort();
+	}
+
+	c = &dn->children[dn->num_children++];
+	c->type = type;
+	c->name = name;
+	c->digest = digest;
+}
+
+static struct dir_node *get_dir_node(struct digest_state *ds,
+				     struct dir *dir)
+{
+	struct dir_node *dn;
+
+	dn = find_dir_node(&ds->nodes, dir);
+	if (dn != NULL)
+		return dn;
+
+	dn = obstack_alloc(&ds->pool, sizeof(*dn));
+	if (dn == NULL)
+		abort();
+
+	dn->dir = dir;
+	dn->parent = NULL;
+	dn->depth = 0;
+	dn->incomplete = 0;
+	dn->num_children = 0;
+	dn->max_children = 0;
+	dn->children = NULL;
+	dn->path = NULL;
+	iv_avl_tree_insert(&ds->nodes, &dn->an);
+
+	if (dir->parent != NULL) {
+		dn->parent = get_dir_node(ds, dir->parent);
+		dn->depth = dn->parent->depth + 1;
+		add_child(dn->parent, 'd', dir->name, dn->digest);
+	}
+
+	if (ds->num_nodes == ds->max_nodes) {
+		ds->max_nodes = ds->max_nodes ? 2 * ds->max_nodes : 1024;
+		ds->all = realloc(ds->all, ds->max_nodes * sizeof(*ds->all));
+		if (ds->all == NULL)
+			abort();
+	}
+	ds->all[ds->num_nodes++] = dn;
+
+	return dn;
+}
+
+static int compare_children(const void *_a, const void *_b)
+{
+	const struct child *a = _a;
+	const struct child *b = _b;
+
+	return strcmp(a->name, b->name);
+}
+
+static int compare_depth(const void *_a, const void *_b)
+{
+	const struct dir_node *a = *(const struct dir_node **)_a;
+	const struct dir_node *b = *(const struct dir_node **)_b;
+
+	return b->depth - a->depth;
+}
+
+static int compare_path(const void *_a, const void *_b)
+{
+	const struct dir_node *a = *(const struct dir_node **)_a;
+	const struct dir_node *b = *(const struct dir_node **)_b;
+
+	return strcmp(a->path, b->path);
+}
+
+static void compute_digest(struct dir_node *dn)
+{
+	SHA512_CTX c;
+	int i;
+
+	qsort(dn->children, dn->num_children, sizeof(*dn->children),
+	      compare_children);
+
+	SHA512_Init(&c);
+	for (i = 0; i < dn->num_children; i++) {
+		struct child *ch = &dn->children[i];
+		uint8_t type = ch->type;
+
+		SHA512_Update(&c, &type, 1);
+		SHA512_Update(&c, ch->name, strlen(ch->name) + 1);
+		SHA512_Update(&c, ch->digest, 64);
+	}
+	SHA512_Final(dn->digest, &c);
+
+	if (dn->incomplete && dn->parent != NULL)
+		dn->parent->incomplete = 1;
+}
+
+static char *dir_path(struct dir *dir)
+{
+	char *path;
+	int len;
+
+	len = format_dir_path(NULL, 0, dir);
+
+	path = malloc(len + 1);
+	if (path == NULL)
+		abort();
+	format_dir_path(path, len + 1, dir);
+
+	return path;
+}
+
+int dir_digests_write(struct iv_list_head *files, const char *file)
+{
+	struct digest_state ds;
+	struct iv_list_head *lh;
+	FILE *fp;
+	int incomplete;
+	int ret;
+	int i;
+
+	fp = fopen(file, "w");
+	if (fp == NULL) {
+		perror("fopen");
+		return 1;
+	}
+
+	INIT_IV_AVL_TREE(&ds.nodes, compare_dir_nodes);
+	obstack_init(&ds.pool);
+	ds.all = NULL;
+	ds.num_nodes = 0;
+	ds.max_nodes = 0;
+
+	iv_list_for_each (lh, files) {
+		struct file_to_hash *fh;
+		struct file_to_hash *fh_hash;
+		struct dir_node *dn;
+
+		fh = iv_container_of(lh, struct file_to_hash, list);
+		dn = get_dir_node(&ds, fh->dir);
+
+		fh_hash = fh;
+		while (fh_hash->state == STATE_BACKREF)
+			fh_hash = fh_hash->backref;
+
+		if (fh_hash->state == STATE_OK)
+			add_child(dn, 'f', fh->d_name, fh_hash->hash);
+		else
+			dn->incomplete = 1;
+	}
+
+	/*
+	 * Children are always deeper than their parents, so going by
+	 * decreasing depth computes every subdirectory's digest before
+	 * it is needed.
+	 */
+	qsort(ds.all, ds.num_nodes, sizeof(*ds.all), compare_depth);
+	for (i = 0; i < ds.num_nodes; i++)
+		compute_digest(ds.all[i]);
+
+	for (i = 0; i < ds.num_nodes; i++)
+		ds.all[i]->path = dir_path(ds.all[i]->dir);
+	qsort(ds.all, ds.num_nodes, sizeof(*ds.all), compare_path);
+
+	incomplete = 0;
+	for (i = 0; i < ds.num_nodes; i++) {
+		struct dir_node *dn = ds.all[i];
+		int j;
+
+		if (dn->incomplete) {
+			incomplete++;
+		} else {
+			for (j = 0; j < sizeof(dn->digest); j++)
+				fprintf(fp, "%.2x", dn->digest[j]);
+			fprintf(fp, "  %s\n", dn->path);
+		}
+
+		free(dn->children);
+		free(dn->path);
+	}
+
+	if (incomplete) {
+		fprintf(stderr, "dir digests: %d directories left out because "
+				"of files that couldn't be hashed\n",
+			incomplete);
+	}
+
+	ret = 0;
+	if (fclose(fp)) {
+		perror("fclose");
+		ret = 1;
+	}
+
+	free(ds.all);
+	obstack_free(&ds.pool, NULL);
+
+	return ret;
+}
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <iv_avl.h>
 #include <iv_list.h>
 #include <linux/fs.h>
@@ -28,6 +29,8 @@
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include "extents.h"
+#include "probes.h"
+#include "stats.h"
 
 #define EXTENTS_BATCH		16384
 
@@ -37,6 +40,7 @@ struct extent
 	uint64_t		fe_logical;
 	uint64_t		fe_physical;
 	uint64_t		fe_length;
+	uint32_t		fe_flags;
 };
 
 static int
@@ -64,41 +68,62 @@ static int can_merge(struct extent *last, struct fiemap_extent *fe)
 	if (last->fe_physical + last->fe_length != fe->fe_physical)
 		return 0;
 
+	if (last->fe_flags != (fe->fe_flags & ~FIEMAP_EXTENT_LAST))
+		return 0;
+
 	return 1;
 }
 
-int extent_tree_build(struct iv_avl_tree *extents, int fd)
+/*
+ * The request is close to a megabyte, which is far too big for the
+ * small stacks of the mksums worker pool, so it lives on the heap.
+ */
+struct fiemap_req
+{
+	struct fiemap		f;
+	struct fiemap_extent	fe[EXTENTS_BATCH];
+};
+
+int extent_tree_build(struct iv_avl_tree *extents, int fd, uint32_t fm_flags)
 {
+	struct fiemap_req *req;
 	uint64_t off;
 	struct extent *last;
 
 	INIT_IV_AVL_TREE(extents, compare_extents);
 
+	req = malloc(sizeof(*req));
+	if (req == NULL)
+		abort();
+
 	off = 0;
 	last = NULL;
 
 	while (off < UINT64_MAX) {
-		struct {
-			struct fiemap f;
-			struct fiemap_extent fe[EXTENTS_BATCH];
-		} req;
+		uint64_t start;
 		int i;
 
-		req.f.fm_start = off;
-		req.f.fm_length = UINT64_MAX;
-		req.f.fm_flags = 0;
-		req.f.fm_extent_count = EXTENTS_BATCH;
-
-		if (ioctl(fd, FS_IOC_FIEMAP, &req) < 0) {
-			perror("ioctl(FS_IOC_FIEMAP)");
+		req->f.fm_start = off;
+		req->f.fm_length = UINT64_MAX;
+		req->f.fm_flags = fm_flags;
+		req->f.fm_extent_count = EXTENTS_BATCH;
+
+		start = PROBE_START(fiemap);
+		stats_count(STATS_SYS_IOCTL, 1);
+		if (ioctl(fd, FS_IOC_FIEMAP, req) < 0) {
+			if (errno != EOPNOTSUPP && errno != ENOTTY)
+				perror("ioctl(FS_IOC_FIEMAP)");
+			free(req);
 			return -1;
 		}
+		PROBE3(fiemap, fd, req->f.fm_mapped_extents,
+		       PROBE_LATENCY(start));
 
-		if (req.f.fm_mapped_extents == 0)
+		if (req->f.fm_mapped_extents == 0)
 			break;
 
-		for (i = 0; i < req.f.fm_mapped_extents; i++) {
-			struct fiemap_extent *fe = req.fe + i;
+		for (i = 0; i < req->f.fm_mapped_extents; i++) {
+			struct fiemap_extent *fe = req->fe + i;
 
 			if (!(fe->fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
 				if (can_merge(last, fe)) {
@@ -111,6 +136,8 @@ int extent_tree_build(struct iv_avl_tree *extents, int fd)
 					last->fe_logical = fe->fe_logical;
 					last->fe_physical = fe->fe_physical;
 					last->fe_length = fe->fe_length;
+					last->fe_flags = fe->fe_flags &
+							~FIEMAP_EXTENT_LAST;
 					iv_avl_tree_insert(extents, &last->an);
 				}
 			}
@@ -124,6 +151,8 @@ int extent_tree_build(struct iv_avl_tree *extents, int fd)
 		}
 	}
 
+	free(req);
+
 	return 0;
 }
 
@@ -213,6 +242,49 @@ int extent_tree_diff(struct iv_avl_tree *a, uint64_t aoff,
 	return 0;
 }
 
+int extent_tree_fingerprint(struct iv_avl_tree *extents, uint64_t *fp)
+{
+	uint64_t h;
+	struct iv_avl_node *an;
+
+	if (extents->root == NULL)
+		return -1;
+
+	h = 0xcbf29ce484222325ULL;
+
+	iv_avl_tree_for_each (an, extents) {
+		struct extent *e;
+		uint64_t v[3];
+		int i;
+
+		e = iv_container_of(an, struct extent, an);
+
+		if (e->fe_flags & (FIEMAP_EXTENT_UNKNOWN |
+				   FIEMAP_EXTENT_DELALLOC |
+				   FIEMAP_EXTENT_ENCODED |
+				   FIEMAP_EXTENT_DATA_ENCRYPTED |
+				   FIEMAP_EXTENT_NOT_ALIGNED |
+				   FIEMAP_EXTENT_DATA_INLINE |
+				   FIEMAP_EXTENT_DATA_TAIL)) {
+			return -1;
+		}
+
+		v[0] = e->fe_logical;
+		v[1] = e->fe_physical;
+		v[2] = e->fe_length;
+
+		for (i = 0; i < 3; i++) {
+			h ^= v[i];
+			h *= 0x100000001b3ULL;
+			h ^= h >> 29;
+		}
+	}
+
+	*fp = h;
+
+	return 0;
+}
+
 static void __free_element(struct iv_avl_node *an)
 {
 	struct extent *e;
@@ -23,9 +23,10 @@
 #include <stdint.h>
 #include <iv_avl.h>
 
-int extent_tree_build(struct iv_avl_tree *extents, int fd);
+int extent_tree_build(struct iv_avl_tree *extents, int fd, uint32_t fm_flags);
 int extent_tree_diff(struct iv_avl_tree *a, uint64_t aoff,
 		     struct iv_avl_tree *b, uint64_t boff, uint64_t length);
+int extent_tree_fingerprint(struct iv_avl_tree *extents, uint64_t *fp);
 void extent_tree_free(struct iv_avl_tree *extents);
 
 
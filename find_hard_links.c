@@ -36,6 +36,11 @@ compare_fh_refs(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
 	const struct fh_ref *a = iv_container_of(_a, struct fh_ref, an);
 	const struct fh_ref *b = iv_container_of(_b, struct fh_ref, an);
 
+	if (a->fh->dir->st_dev < b->fh->dir->st_dev)
+		return -1;
+	if (a->fh->dir->st_dev > b->fh->dir->st_dev)
+		return 1;
+
 	if (a->fh->d_ino < b->fh->d_ino)
 		return -1;
 	if (a->fh->d_ino > b->fh->d_ino)
@@ -43,19 +48,30 @@ compare_fh_refs(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
 	return 0;
 }
 
-static struct fh_ref *find_ref(struct iv_avl_tree *tree, ino_t d_ino)
+/*
+ * Inode numbers are only unique within a filesystem, and the roots
+ * (or the files being verified) can be spread over several.
+ */
+static struct fh_ref *
+find_ref(struct iv_avl_tree *tree, dev_t st_dev, ino_t d_ino)
 {
 	struct iv_avl_node *an;
 
 	an = tree->root;
 	while (an != NULL) {
 		struct fh_ref *ref;
+		dev_t ref_dev;
 
 		ref = iv_container_of(an, struct fh_ref, an);
-		if (d_ino == ref->fh->d_ino)
+		ref_dev = ref->fh->dir->st_dev;
+		if (st_dev == ref_dev && d_ino == ref->fh->d_ino)
 			return ref;
 
-		if (d_ino < ref->fh->d_ino)
+		if (st_dev < ref_dev)
+			an = an->left;
+		else if (st_dev > ref_dev)
+			an = an->right;
+		else if (d_ino < ref->fh->d_ino)
 			an = an->left;
 		else
 			an = an->right;
@@ -84,7 +100,7 @@ void find_hard_links(struct iv_list_head *files)
 
 		fh = iv_container_of(lh, struct file_to_hash, list);
 
-		ref = find_ref(&fh_refs, fh->d_ino);
+		ref = find_ref(&fh_refs, fh->dir->st_dev, fh->d_ino);
 		if (ref == NULL) {
 			ref = obstack_alloc(&pool, sizeof(*ref));
 			if (ref == NULL)
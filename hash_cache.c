@@ -0,0 +1,797 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <time.h>
+#include <unistd.h>
+#include "mksums_common.h"
+
+/*
+ * The cache file is a header page followed by a power-of-two sized
+ * open-addressing table with linear probing.  Slots are bucketed on
+ * (filesystem uuid, inode number) only, so that there is at most one
+ * slot per inode, and an inode whose size or timestamps changed has
+ * its slot overwritten in place.  Slots are never deleted, except by
+ * compaction, which rewrites the whole file.
+ *
+ * Readers (in any process) do not take any locks, and use the per-slot
+ * sequence count to detect concurrent updates.  Writers serialize via
+ * flock() on the cache file.  Growing the table is done by writing a
+ * new file and renaming it over the old one, and writers detect this
+ * after taking the lock by comparing the inode of the path with that
+ * of the file descriptor they hold.
+ *
+ * A writer holding the lock knows that no update is in progress, so
+ * a slot with an odd sequence count was left behind by a writer that
+ * died halfway, and is repaired rather than waited for.
+ *
+ * Inserts are collected and written out HASH_CACHE_BATCH at a time,
+ * so that the lock and the replaced file check are paid per batch
+ * instead of per file.
+ */
+#define HASH_CACHE_MAGIC	"mksumsHC"
+#define HASH_CACHE_VERSION	2
+#define HASH_CACHE_HDR_SIZE	4096
+#define HASH_CACHE_MIN_SLOTS	65536
+#define HASH_CACHE_BATCH	64
+
+struct hash_cache_header
+{
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		slot_size;
+	uint64_t		num_slots;
+	uint64_t		num_used;
+};
+
+struct hash_cache_slot
+{
+	uint32_t		seq;
+	uint32_t		used;
+	uint8_t			uuid[16];
+	uint64_t		ino;
+	uint64_t		size;
+	uint64_t		mtime_ns;
+	uint64_t		ctime_ns;
+	uint8_t			hash[64];
+	uint32_t		day;
+	uint32_t		pad;
+	struct sha512_midstate	midstate;
+	uint8_t			pad2[40];
+};
+
+struct dev_uuid
+{
+	dev_t			dev;
+	uint8_t			uuid[16];
+};
+
+struct hash_cache
+{
+	char			*path;
+	int			readonly;
+
+	pthread_rwlock_t	map_lock;
+	int			fd;
+	void			*map;
+	size_t			map_size;
+	struct hash_cache_header *hdr;
+	struct hash_cache_slot	*slots;
+
+	pthread_mutex_t		dev_lock;
+	int			num_devs;
+	struct dev_uuid		*devs;
+
+	pthread_mutex_t		batch_lock;
+	int			batch_len;
+	struct hash_cache_slot	batch[HASH_CACHE_BATCH];
+};
+
+static uint64_t today(void)
+{
+	return time(NULL) / 86400;
+}
+
+static uint64_t ts_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t bucket(const uint8_t *uuid, uint64_t ino)
+{
+	uint64_t h;
+	int i;
+
+	h = 0xcbf29ce484222325ULL;
+	for (i = 0; i < 16; i++)
+		h = (h ^ uuid[i]) * 0x100000001b3ULL;
+
+	h ^= ino;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static void compute_dev_uuid(uint8_t *uuid, int fd, dev_t dev)
+{
+	struct statfs sfs;
+
+#ifdef FS_IOC_GETFSUUID
+	struct fsuuid2 u;
+
+	if (ioctl(fd, FS_IOC_GETFSUUID, &u) == 0 && u.len &&
+	    u.len <= sizeof(u.uuid)) {
+		memset(uuid, 0, 16);
+		memcpy(uuid, u.uuid, u.len);
+		return;
+	}
+#endif
+
+	memset(uuid, 0, 16);
+
+	if (fstatfs(fd, &sfs) == 0 &&
+	    (sfs.f_fsid.__val[0] || sfs.f_fsid.__val[1])) {
+		uint64_t type = sfs.f_type;
+
+		memcpy(uuid, &sfs.f_fsid, 8);
+		memcpy(uuid + 8, &type, 8);
+		return;
+	}
+
+	memcpy(uuid + 8, &dev, sizeof(dev) < 8 ? sizeof(dev) : 8);
+}
+
+static void get_dev_uuid(struct hash_cache *hc, uint8_t *uuid,
+			 int fd, dev_t dev)
+{
+	int i;
+
+	pthread_mutex_lock(&hc->dev_lock);
+
+	for (i = 0; i < hc->num_devs; i++) {
+		if (hc->devs[i].dev == dev) {
+			memcpy(uuid, hc->devs[i].uuid, 16);
+			pthread_mutex_unlock(&hc->dev_lock);
+			return;
+		}
+	}
+
+	hc->devs = realloc(hc->devs, (hc->num_devs + 1) * sizeof(*hc->devs));
+	if (hc->devs == NULL)
+		abort();
+
+	hc->devs[hc->num_devs].dev = dev;
+	compute_dev_uuid(hc->devs[hc->num_devs].uuid, fd, dev);
+	memcpy(uuid, hc->devs[hc->num_devs].uuid, 16);
+	hc->num_devs++;
+
+	pthread_mutex_unlock(&hc->dev_lock);
+}
+
+static int read_slot(struct hash_cache_slot *s, struct hash_cache_slot *copy)
+{
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		uint32_t seq;
+
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(copy, s, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+
+	return -1;
+}
+
+static void write_slot(struct hash_cache_slot *s,
+		       const struct hash_cache_slot *val)
+{
+	uint32_t seq;
+
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED) | 1;
+	__atomic_store_n(&s->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy((uint8_t *)s + sizeof(s->seq), (uint8_t *)val + sizeof(s->seq),
+	       sizeof(*s) - sizeof(s->seq));
+
+	__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The slot may be anything from its old to its new contents, so it
+ * keeps its key (if it has one, it may be part of probe chains) but
+ * loses everything that a lookup would trust.
+ */
+static void repair_slot(struct hash_cache_slot *s)
+{
+	uint32_t seq;
+
+	seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+
+	if (s->used) {
+		s->used = 1;
+		s->size = 0;
+		s->mtime_ns = 0;
+		s->ctime_ns = 0;
+		memset(s->hash, 0, sizeof(s->hash));
+		memset(&s->midstate, 0, sizeof(s->midstate));
+	} else {
+		memset((uint8_t *)s + sizeof(s->seq), 0,
+		       sizeof(*s) - sizeof(s->seq));
+	}
+
+	__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static int map_cache(struct hash_cache *hc)
+{
+	struct stat buf;
+	struct hash_cache_header *hdr;
+	int prot;
+
+	if (fstat(hc->fd, &buf) < 0) {
+		perror("fstat");
+		return -1;
+	}
+
+	if (buf.st_size < HASH_CACHE_HDR_SIZE) {
+		fprintf(stderr, "%s: truncated hash cache file\n", hc->path);
+		return -1;
+	}
+
+	prot = PROT_READ;
+	if (!hc->readonly)
+		prot |= PROT_WRITE;
+
+	hc->map = mmap(NULL, buf.st_size, prot, MAP_SHARED, hc->fd, 0);
+	if (hc->map == MAP_FAILED) {
+		perror("mmap");
+		hc->map = NULL;
+		return -1;
+	}
+	hc->map_size = buf.st_size;
+
+	hdr = hc->map;
+	if (memcmp(hdr->magic, HASH_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != HASH_CACHE_VERSION ||
+	    hdr->slot_size != sizeof(struct hash_cache_slot) ||
+	    hdr->num_slots == 0 ||
+	    (hdr->num_slots & (hdr->num_slots - 1)) ||
+	    HASH_CACHE_HDR_SIZE + hdr->num_slots *
+		sizeof(struct hash_cache_slot) > hc->map_size) {
+		fprintf(stderr, "%s: not a valid hash cache file\n", hc->path);
+		munmap(hc->map, hc->map_size);
+		hc->map = NULL;
+		return -1;
+	}
+
+	hc->hdr = hdr;
+	hc->slots = (void *)((uint8_t *)hc->map + HASH_CACHE_HDR_SIZE);
+
+	return 0;
+}
+
+/*
+ * If the cache file was replaced and the new one can't be mapped, the
+ * cache stays unmapped for the rest of the run, and every lookup and
+ * insert has to check for that.
+ */
+static void unmap_cache(struct hash_cache *hc)
+{
+	if (hc->map != NULL) {
+		munmap(hc->map, hc->map_size);
+		hc->map = NULL;
+		hc->hdr = NULL;
+		hc->slots = NULL;
+	}
+}
+
+static int write_empty_cache(int fd, uint64_t num_slots)
+{
+	struct hash_cache_header hdr;
+
+	if (ftruncate(fd, HASH_CACHE_HDR_SIZE +
+			  num_slots * sizeof(struct hash_cache_slot)) < 0) {
+		perror("ftruncate");
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HASH_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = HASH_CACHE_VERSION;
+	hdr.slot_size = sizeof(struct hash_cache_slot);
+	hdr.num_slots = num_slots;
+	hdr.num_used = 0;
+
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		perror("pwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int open_cache_file(struct hash_cache *hc)
+{
+	struct stat buf;
+
+	hc->fd = open(hc->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (hc->fd < 0 && (errno == EACCES || errno == EROFS)) {
+		hc->readonly = 1;
+		hc->fd = open(hc->path, O_RDONLY | O_CLOEXEC);
+	}
+
+	if (hc->fd < 0) {
+		fprintf(stderr, "error opening %s: %s\n", hc->path,
+			strerror(errno));
+		return -1;
+	}
+
+	if (!hc->readonly) {
+		if (flock(hc->fd, LOCK_EX) < 0) {
+			perror("flock");
+			close(hc->fd);
+			return -1;
+		}
+
+		if (fstat(hc->fd, &buf) < 0) {
+			perror("fstat");
+			close(hc->fd);
+			return -1;
+		}
+
+		if (buf.st_size == 0 &&
+		    write_empty_cache(hc->fd, HASH_CACHE_MIN_SLOTS) < 0) {
+			close(hc->fd);
+			return -1;
+		}
+
+		flock(hc->fd, LOCK_UN);
+	}
+
+	if (map_cache(hc) < 0) {
+		close(hc->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct hash_cache *hash_cache_open(const char *path)
+{
+	struct hash_cache *hc;
+
+	hc = malloc(sizeof(*hc));
+	if (hc == NULL)
+		abort();
+
+	hc->path = strdup(path);
+	if (hc->path == NULL)
+		abort();
+	hc->readonly = 0;
+	pthread_rwlock_init(&hc->map_lock, NULL);
+	hc->map = NULL;
+	hc->hdr = NULL;
+	hc->slots = NULL;
+	pthread_mutex_init(&hc->dev_lock, NULL);
+	hc->num_devs = 0;
+	hc->devs = NULL;
+	pthread_mutex_init(&hc->batch_lock, NULL);
+	hc->batch_len = 0;
+
+	if (open_cache_file(hc) < 0) {
+		free(hc->path);
+		free(hc);
+		return NULL;
+	}
+
+	return hc;
+}
+
+static void make_key(struct hash_cache *hc, struct hash_cache_slot *key,
+		     int fd, const struct stat *buf)
+{
+	memset(key, 0, sizeof(*key));
+	get_dev_uuid(hc, key->uuid, fd, buf->st_dev);
+	key->ino = buf->st_ino;
+	key->size = buf->st_size;
+	key->mtime_ns = ts_to_ns(&buf->st_mtim);
+	key->ctime_ns = ts_to_ns(&buf->st_ctim);
+}
+
+/*
+ * Writers must hold the lock on the cache file.
+ */
+static struct hash_cache_slot *
+find_slot(struct hash_cache *hc, const struct hash_cache_slot *key,
+	  struct hash_cache_slot *copy, int writer)
+{
+	uint64_t mask;
+	uint64_t idx;
+	uint64_t i;
+
+	mask = hc->hdr->num_slots - 1;
+	idx = bucket(key->uuid, key->ino) & mask;
+
+	for (i = 0; i <= mask; i++) {
+		struct hash_cache_slot *s = hc->slots + idx;
+
+		if (writer && (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) & 1))
+			repair_slot(s);
+
+		if (read_slot(s, copy) < 0)
+			return NULL;
+
+		if (!copy->used || (copy->ino == key->ino &&
+				    !memcmp(copy->uuid, key->uuid, 16))) {
+			return s;
+		}
+
+		idx = (idx + 1) & mask;
+	}
+
+	return NULL;
+}
+
+int hash_cache_lookup(struct hash_cache *hc, int fd, const struct stat *buf,
+		      uint8_t *hash)
+{
+	struct hash_cache_slot key;
+	struct hash_cache_slot copy;
+	struct hash_cache_slot *s;
+	int ret;
+
+	make_key(hc, &key, fd, buf);
+
+	pthread_rwlock_rdlock(&hc->map_lock);
+
+	ret = 1;
+
+	s = (hc->map != NULL) ? find_slot(hc, &key, &copy, 0) : NULL;
+	if (s != NULL && copy.used && copy.size == key.size &&
+	    copy.mtime_ns == key.mtime_ns && copy.ctime_ns == key.ctime_ns) {
+		memcpy(hash, copy.hash, 64);
+
+		if (!hc->readonly && copy.day != today())
+			__atomic_store_n(&s->day, today(), __ATOMIC_RELAXED);
+
+		ret = 0;
+	}
+
+	pthread_rwlock_unlock(&hc->map_lock);
+
+	return ret;
+}
+
+static int lock_current_file(struct hash_cache *hc)
+{
+	while (1) {
+		struct stat buf;
+		struct stat buf2;
+
+		if (flock(hc->fd, LOCK_EX) < 0) {
+			perror("flock");
+			return -1;
+		}
+
+		if (fstat(hc->fd, &buf) < 0) {
+			perror("fstat");
+			flock(hc->fd, LOCK_UN);
+			return -1;
+		}
+
+		if (stat(hc->path, &buf2) == 0 && buf.st_dev == buf2.st_dev &&
+		    buf.st_ino == buf2.st_ino) {
+			return 0;
+		}
+
+		unmap_cache(hc);
+		close(hc->fd);
+
+		hc->fd = open(hc->path, O_RDWR | O_CLOEXEC);
+		if (hc->fd < 0) {
+			fprintf(stderr, "error reopening %s: %s\n", hc->path,
+				strerror(errno));
+			return -1;
+		}
+
+		if (map_cache(hc) < 0) {
+			close(hc->fd);
+			hc->fd = -1;
+			return -1;
+		}
+	}
+}
+
+static int rebuild_cache(struct hash_cache *hc, uint64_t num_slots,
+			 uint32_t min_day)
+{
+	char *tmppath;
+	int fd;
+	void *map;
+	size_t map_size;
+	struct hash_cache_header *hdr;
+	struct hash_cache_slot *slots;
+	uint64_t i;
+
+	if (asprintf(&tmppath, "%s.XXXXXX", hc->path) < 0)
+		abort();
+
+	fd = mkostemp(tmppath, O_CLOEXEC);
+	if (fd < 0) {
+		perror("mkostemp");
+		free(tmppath);
+		return -1;
+	}
+
+	if (fchmod(fd, 0644) < 0 || write_empty_cache(fd, num_slots) < 0)
+		goto err;
+
+	map_size = HASH_CACHE_HDR_SIZE +
+		   num_slots * sizeof(struct hash_cache_slot);
+
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		goto err;
+	}
+
+	hdr = map;
+	slots = (void *)((uint8_t *)map + HASH_CACHE_HDR_SIZE);
+
+	for (i = 0; i < hc->hdr->num_slots; i++) {
+		struct hash_cache_slot copy;
+		uint64_t idx;
+
+		/*
+		 * The caller holds the lock, so an odd sequence count
+		 * is a dead writer's, and the slot is dropped.
+		 */
+		if (__atomic_load_n(&hc->slots[i].seq, __ATOMIC_RELAXED) & 1)
+			continue;
+
+		if (read_slot(hc->slots + i, &copy) < 0 || !copy.used)
+			continue;
+
+		if (copy.day < min_day)
+			continue;
+
+		idx = bucket(copy.uuid, copy.ino) & (num_slots - 1);
+		while (slots[idx].used)
+			idx = (idx + 1) & (num_slots - 1);
+
+		copy.seq = 0;
+		memcpy(slots + idx, &copy, sizeof(copy));
+		hdr->num_used++;
+	}
+
+	if (msync(map, map_size, MS_SYNC) < 0 || fsync(fd) < 0) {
+		perror("msync");
+		munmap(map, map_size);
+		goto err;
+	}
+
+	flock(fd, LOCK_EX);
+
+	if (rename(tmppath, hc->path) < 0) {
+		perror("rename");
+		munmap(map, map_size);
+		goto err;
+	}
+
+	free(tmppath);
+
+	flock(hc->fd, LOCK_UN);
+
+	unmap_cache(hc);
+	close(hc->fd);
+
+	hc->fd = fd;
+	hc->map = map;
+	hc->map_size = map_size;
+	hc->hdr = hdr;
+	hc->slots = slots;
+
+	return 0;
+
+err:
+	unlink(tmppath);
+	free(tmppath);
+	close(fd);
+
+	return -1;
+}
+
+int hash_cache_lookup_midstate(struct hash_cache *hc, int fd,
+			       const struct stat *buf,
+			       struct sha512_midstate *ms)
+{
+	struct hash_cache_slot key;
+	struct hash_cache_slot copy;
+	struct hash_cache_slot *s;
+	int ret;
+
+	make_key(hc, &key, fd, buf);
+
+	pthread_rwlock_rdlock(&hc->map_lock);
+
+	ret = 1;
+
+	s = (hc->map != NULL) ? find_slot(hc, &key, &copy, 0) : NULL;
+	if (s != NULL && copy.used && copy.midstate.length &&
+	    copy.size <= key.size) {
+		*ms = copy.midstate;
+		ret = 0;
+	}
+
+	pthread_rwlock_unlock(&hc->map_lock);
+
+	return ret;
+}
+
+static void flush_batch(struct hash_cache *hc)
+{
+	int i;
+
+	pthread_rwlock_wrlock(&hc->map_lock);
+
+	if (hc->fd < 0 || hc->map == NULL || lock_current_file(hc) < 0) {
+		pthread_rwlock_unlock(&hc->map_lock);
+		hc->batch_len = 0;
+		return;
+	}
+
+	for (i = 0; i < hc->batch_len; i++) {
+		struct hash_cache_slot *key = hc->batch + i;
+		struct hash_cache_slot copy;
+		struct hash_cache_slot *s;
+
+		s = find_slot(hc, key, &copy, 1);
+		if (s != NULL && !copy.used &&
+		    4 * (hc->hdr->num_used + 1) > 3 * hc->hdr->num_slots) {
+			if (rebuild_cache(hc, 2 * hc->hdr->num_slots, 0) == 0)
+				s = find_slot(hc, key, &copy, 1);
+		}
+
+		if (s != NULL) {
+			if (!copy.used)
+				hc->hdr->num_used++;
+			write_slot(s, key);
+		}
+	}
+
+	flock(hc->fd, LOCK_UN);
+
+	pthread_rwlock_unlock(&hc->map_lock);
+
+	hc->batch_len = 0;
+}
+
+void hash_cache_insert(struct hash_cache *hc, int fd, const struct stat *buf,
+		       const uint8_t *hash, const struct sha512_midstate *ms)
+{
+	struct hash_cache_slot *key;
+
+	if (hc->readonly)
+		return;
+
+	pthread_mutex_lock(&hc->batch_lock);
+
+	key = hc->batch + hc->batch_len++;
+	make_key(hc, key, fd, buf);
+	memcpy(key->hash, hash, 64);
+	if (ms != NULL)
+		key->midstate = *ms;
+	key->used = 1;
+	key->day = today();
+
+	if (hc->batch_len == HASH_CACHE_BATCH)
+		flush_batch(hc);
+
+	pthread_mutex_unlock(&hc->batch_lock);
+}
+
+void hash_cache_close(struct hash_cache *hc)
+{
+	if (hc->batch_len)
+		flush_batch(hc);
+
+	unmap_cache(hc);
+	if (hc->fd >= 0)
+		close(hc->fd);
+	pthread_rwlock_destroy(&hc->map_lock);
+	pthread_mutex_destroy(&hc->dev_lock);
+	pthread_mutex_destroy(&hc->batch_lock);
+	free(hc->devs);
+	free(hc->path);
+	free(hc);
+}
+
+int hash_cache_compact(const char *path, int max_age_days)
+{
+	struct hash_cache *hc;
+	uint64_t used;
+	uint64_t num_slots;
+	uint32_t min_day;
+	int ret;
+
+	hc = hash_cache_open(path);
+	if (hc == NULL)
+		return 1;
+
+	if (hc->readonly) {
+		fprintf(stderr, "%s: hash cache file is read-only\n", path);
+		hash_cache_close(hc);
+		return 1;
+	}
+
+	if (lock_current_file(hc) < 0) {
+		hash_cache_close(hc);
+		return 1;
+	}
+
+	min_day = 0;
+	if (max_age_days > 0 && today() > max_age_days)
+		min_day = today() - max_age_days;
+
+	used = hc->hdr->num_used;
+
+	num_slots = HASH_CACHE_MIN_SLOTS;
+	while (num_slots < 2 * used)
+		num_slots *= 2;
+
+	ret = rebuild_cache(hc, num_slots, min_day);
+	if (ret == 0) {
+		fprintf(stderr, "%s: kept %lld of %lld entries, "
+				"%lld slots\n", path,
+			(long long)hc->hdr->num_used, (long long)used,
+			(long long)num_slots);
+	}
+
+	flock(hc->fd, LOCK_UN);
+
+	hash_cache_close(hc);
+
+	return !!ret;
+}
@@ -17,23 +17,305 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <iv_list.h>
 #include <openssl/sha.h>
 #include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
+#include <time.h>
 #include <unistd.h>
 #include "mksums_common.h"
+#include "probes.h"
+#include "stats.h"
+#include "sumfile.h"
+
+#define MIDSTATE_CHECK_BLOCK	4096
+#define MIDSTATE_MIN_LENGTH	1048576
+#define READ_BUF_SIZE		1048576
+
+struct hash_counters
+{
+	uint64_t		sparse_files;
+	uint64_t		sparse_bytes;
+	uint64_t		resumed_files;
+	uint64_t		resumed_bytes;
+	uint64_t		files;
+	uint64_t		bytes;
+};
+
+static const uint8_t zero_block[1048576];
+
+static uint64_t get_be64(const uint8_t *p)
+{
+	return (((uint64_t)p[0]) << 56) | (((uint64_t)p[1]) << 48) |
+	       (((uint64_t)p[2]) << 40) | (((uint64_t)p[3]) << 32) |
+	       (((uint64_t)p[4]) << 24) | (((uint64_t)p[5]) << 16) |
+	       (((uint64_t)p[6]) <<  8) | (((uint64_t)p[7]) <<  0);
+}
+
+static void put_be64(uint8_t *p, uint64_t x)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (x >> (56 - 8 * i)) & 0xff;
+}
+
+static void hash_update(SHA512_CTX *c, const uint8_t *buf, size_t len,
+			SHA512_CTX *snap)
+{
+	if (snap == NULL) {
+		SHA512_Update(c, buf, len);
+	} else if (c->num == 0) {
+		size_t aligned;
+
+		aligned = len & ~((size_t)SHA512_CBLOCK - 1);
+		if (aligned) {
+			SHA512_Update(c, buf, aligned);
+			*snap = *c;
+		}
+		SHA512_Update(c, buf + aligned, len - aligned);
+	} else {
+		SHA512_Update(c, buf, len);
+		if (c->num == 0)
+			*snap = *c;
+	}
+}
+
+static void hash_zeroes(SHA512_CTX *c, off_t len, SHA512_CTX *snap)
+{
+	while (len) {
+		size_t chunk;
+
+		chunk = sizeof(zero_block);
+		if (chunk > len)
+			chunk = len;
+
+		hash_update(c, zero_block, chunk, snap);
+		len -= chunk;
+	}
+}
+
+static int hash_dense(int fd, SHA512_CTX *c, off_t off, SHA512_CTX *snap,
+		      uint8_t *buf, struct hash_counters *cnt)
+{
+	if (off) {
+		stats_count(STATS_SYS_LSEEK, 1);
+		if (lseek(fd, off, SEEK_SET) < 0) {
+			perror("lseek");
+			return 1;
+		}
+	}
+
+	while (1) {
+		uint64_t start;
+		uint64_t tstart;
+		int ret;
+
+		start = PROBE_START(file_read);
+		tstart = throttle_start();
+		stats_count(STATS_SYS_READ, 1);
+		ret = read(fd, buf, READ_BUF_SIZE);
+		if (ret < 0) {
+			perror("read");
+			return 1;
+		}
+		stats_count(STATS_BYTES_READ, ret);
+		throttle_io(tstart, ret);
+		PROBE4(file_read, fd, off, ret, PROBE_LATENCY(start));
+		cnt->bytes += ret;
+		off += ret;
+
+		if (ret == 0)
+			break;
+
+		hash_update(c, buf, ret, snap);
+
+		if (ret < READ_BUF_SIZE)
+			break;
+	}
+
+	return 0;
+}
+
+static int hash_sparse(int fd, SHA512_CTX *c, off_t off, off_t size,
+		       SHA512_CTX *snap, uint8_t *buf,
+		       struct hash_counters *cnt)
+{
+	off_t skipped;
+
+	skipped = 0;
+	while (off < size) {
+		off_t data;
+		off_t hole;
+
+		stats_count(STATS_SYS_LSEEK, 1);
+		data = lseek(fd, off, SEEK_DATA);
+		if (data < 0)
+			data = (errno == ENXIO) ? size : off;
+		if (data > size)
+			data = size;
+
+		if (data > off) {
+			hash_zeroes(c, data - off, snap);
+			skipped += data - off;
+			off = data;
+		}
+
+		if (off == size)
+			break;
+
+		stats_count(STATS_SYS_LSEEK, 1);
+		hole = lseek(fd, off, SEEK_HOLE);
+		if (hole < 0 || hole > size)
+			hole = size;
+
+		while (off < hole) {
+			size_t toread;
+			uint64_t start;
+			uint64_t tstart;
+			int ret;
+
+			toread = READ_BUF_SIZE;
+			if (toread > hole - off)
+				toread = hole - off;
+
+			start = PROBE_START(file_read);
+			tstart = throttle_start();
+			stats_count(STATS_SYS_PREAD, 1);
+			ret = pread(fd, buf, toread, off);
+			if (ret < 0) {
+				perror("pread");
+				return 1;
+			}
+			stats_count(STATS_BYTES_READ, ret);
+			throttle_io(tstart, ret);
+			PROBE4(file_read, fd, off, ret, PROBE_LATENCY(start));
+			cnt->bytes += ret;
 
-static int hash_file(struct file_to_hash *fh, int xattr_cache_hash)
+			if (ret == 0)
+				goto out;
+
+			hash_update(c, buf, ret, snap);
+			off += ret;
+		}
+	}
+
+out:
+	if (skipped) {
+		cnt->sparse_files++;
+		cnt->sparse_bytes += skipped;
+	}
+
+	return 0;
+}
+
+static int midstate_check(int fd, uint64_t length, uint8_t *check)
+{
+	uint8_t buf[MIDSTATE_CHECK_BLOCK];
+	uint8_t digest[SHA512_DIGEST_LENGTH];
+	size_t len;
+
+	len = sizeof(buf);
+	if (len > length)
+		len = length;
+
+	stats_count(STATS_SYS_PREAD, 1);
+	if (pread(fd, buf, len, length - len) != len)
+		return 1;
+	stats_count(STATS_BYTES_READ, len);
+
+	SHA512(buf, len, digest);
+	memcpy(check, digest, 16);
+
+	return 0;
+}
+
+static int get_midstate(int fd, const struct hash_options *opts,
+			const struct stat *statbuf,
+			struct sha512_midstate *ms)
+{
+	int have_ms;
+	uint8_t check[16];
+
+	have_ms = 0;
+
+	if (opts->xattr_cache_hash) {
+		uint8_t x[8 + 64 + 16];
+
+		stats_count(STATS_SYS_GETXATTR, 1);
+		if (fgetxattr(fd, "user.sha512.midstate", x,
+			      sizeof(x)) == sizeof(x)) {
+			int i;
+
+			ms->length = get_be64(x);
+			for (i = 0; i < 8; i++)
+				ms->h[i] = get_be64(x + 8 + 8 * i);
+			memcpy(ms->check, x + 72, 16);
+
+			have_ms = 1;
+		}
+	}
+
+	if (!have_ms && opts->cache != NULL &&
+	    !hash_cache_lookup_midstate(opts->cache, fd, statbuf, ms)) {
+		have_ms = 1;
+	}
+
+	if (!have_ms || ms->length == 0 || ms->length % SHA512_CBLOCK ||
+	    ms->length > statbuf->st_size) {
+		return 1;
+	}
+
+	if (midstate_check(fd, ms->length, check))
+		return 1;
+
+	return !!memcmp(check, ms->check, sizeof(check));
+}
+
+static void restore_midstate(SHA512_CTX *c, const struct sha512_midstate *ms)
+{
+	int i;
+
+	SHA512_Init(c);
+	for (i = 0; i < 8; i++)
+		c->h[i] = ms->h[i];
+	c->Nl = ms->length << 3;
+	c->Nh = ms->length >> 61;
+}
+
+static int save_midstate(int fd, const SHA512_CTX *snap,
+			 struct sha512_midstate *ms)
+{
+	int i;
+
+	ms->length = (snap->Nl >> 3) | (snap->Nh << 61);
+	if (ms->length < MIDSTATE_MIN_LENGTH)
+		return 1;
+
+	for (i = 0; i < 8; i++)
+		ms->h[i] = snap->h[i];
+
+	return midstate_check(fd, ms->length, ms->check);
+}
+
+static int hash_file(struct file_to_hash *fh, const struct hash_options *opts,
+		     uint8_t *buf, struct hash_counters *cnt,
+		     struct stat *statbuf)
 {
 	int fd;
-	struct stat statbuf;
 	SHA512_CTX c;
+	SHA512_CTX snap;
+	off_t off;
+	struct sha512_midstate ms;
+	int have_ms;
 
 	fd = openat_try_noatime(fh->dir->dirfd, fh->d_name, 0);
 	if (fd < 0) {
@@ -45,15 +327,23 @@ static int hash_file(struct file_to_hash *fh, int xattr_cache_hash)
 		return 1;
 	}
 
-	if (xattr_cache_hash) {
-		uint8_t sha512[12 + 64];
+	PROBE3(file_open, fh->d_ino, fh->st_size, fd);
 
-		if (fstat(fd, &statbuf) < 0) {
+	if (opts->xattr_cache_hash || opts->cache != NULL || opts->sparse ||
+	    opts->resume_appends || opts->journal != NULL ||
+	    opts->hashed != NULL) {
+		stats_count(STATS_SYS_FSTAT, 1);
+		if (fstat(fd, statbuf) < 0) {
 			perror("fstat");
 			close(fd);
 			return 1;
 		}
+	}
+
+	if (opts->xattr_cache_hash) {
+		uint8_t sha512[12 + 64];
 
+		stats_count(STATS_SYS_GETXATTR, 1);
 		if (fgetxattr(fd, "user.sha512", sha512,
 			      sizeof(sha512)) == sizeof(sha512)) {
 			uint64_t sec;
@@ -73,67 +363,132 @@ static int hash_file(struct file_to_hash *fh, int xattr_cache_hash)
 			       (((uint64_t)sha512[10]) <<  8) |
 			       (((uint64_t)sha512[11]) <<  0);
 
-			if (sec == statbuf.st_mtim.tv_sec &&
-			    nsec == statbuf.st_mtim.tv_nsec) {
+			if (sec == statbuf->st_mtim.tv_sec &&
+			    nsec == statbuf->st_mtim.tv_nsec) {
+				stats_count(STATS_XATTR_CACHE_HIT, 1);
+				PROBE1(xattr_cache_hit, fh->d_ino);
 				memcpy(fh->hash, sha512 + 12, 64);
 				close(fd);
 				return 0;
 			}
 		}
+
+		stats_count(STATS_XATTR_CACHE_MISS, 1);
+		PROBE1(xattr_cache_miss, fh->d_ino);
+	}
+
+	if (opts->cache != NULL) {
+		if (!hash_cache_lookup(opts->cache, fd, statbuf, fh->hash)) {
+			stats_count(STATS_HASH_CACHE_HIT, 1);
+			close(fd);
+			return 0;
+		}
+
+		stats_count(STATS_HASH_CACHE_MISS, 1);
+	}
+
+	if (opts->journal != NULL &&
+	    !journal_lookup(opts->journal, fh, statbuf, fh->hash)) {
+		close(fd);
+		return 0;
 	}
 
 	SHA512_Init(&c);
+	off = 0;
 
-	while (1) {
-		uint8_t buf[1048576];
-		int ret;
+	if (opts->resume_appends && statbuf->st_size >= MIDSTATE_MIN_LENGTH &&
+	    !get_midstate(fd, opts, statbuf, &ms)) {
+		restore_midstate(&c, &ms);
+		off = ms.length;
 
-		ret = read(fd, buf, sizeof(buf));
-		if (ret < 0) {
-			perror("read");
+		cnt->resumed_files++;
+		cnt->resumed_bytes += off;
+	}
+
+	snap = c;
+
+	if (opts->sparse && (off_t)statbuf->st_blocks * 512 < statbuf->st_size) {
+		if (hash_sparse(fd, &c, off, statbuf->st_size,
+				opts->resume_appends ? &snap : NULL,
+				buf, cnt)) {
 			close(fd);
 			return 1;
 		}
-
-		if (ret == 0)
-			break;
-
-		SHA512_Update(&c, buf, ret);
-
-		if (ret < sizeof(buf))
-			break;
+	} else if (hash_dense(fd, &c, off,
+			      opts->resume_appends ? &snap : NULL, buf, cnt)) {
+		close(fd);
+		return 1;
 	}
 
 	SHA512_Final(fh->hash, &c);
 
-	if (xattr_cache_hash) {
+	have_ms = 0;
+	if (opts->resume_appends)
+		have_ms = !save_midstate(fd, &snap, &ms);
+
+	if (opts->xattr_cache_hash || opts->cache != NULL ||
+	    opts->journal != NULL) {
 		struct stat statbuf2;
 
+		stats_count(STATS_SYS_FSTAT, 1);
 		if (fstat(fd, &statbuf2) < 0) {
 			perror("fstat");
 			close(fd);
 			return 0;
 		}
 
-		if (statbuf.st_mtim.tv_sec == statbuf2.st_mtim.tv_sec &&
-		    statbuf.st_mtim.tv_nsec == statbuf2.st_mtim.tv_nsec) {
+		if (opts->cache != NULL &&
+		    statbuf->st_size == statbuf2.st_size &&
+		    statbuf->st_mtim.tv_sec == statbuf2.st_mtim.tv_sec &&
+		    statbuf->st_mtim.tv_nsec == statbuf2.st_mtim.tv_nsec &&
+		    statbuf->st_ctim.tv_sec == statbuf2.st_ctim.tv_sec &&
+		    statbuf->st_ctim.tv_nsec == statbuf2.st_ctim.tv_nsec) {
+			hash_cache_insert(opts->cache, fd, statbuf, fh->hash,
+					  have_ms ? &ms : NULL);
+		}
+
+		if (opts->journal != NULL &&
+		    statbuf->st_size == statbuf2.st_size &&
+		    statbuf->st_mtim.tv_sec == statbuf2.st_mtim.tv_sec &&
+		    statbuf->st_mtim.tv_nsec == statbuf2.st_mtim.tv_nsec) {
+			journal_record(opts->journal, fh, statbuf, fh->hash);
+		}
+
+		if (opts->xattr_cache_hash &&
+		    statbuf->st_mtim.tv_sec == statbuf2.st_mtim.tv_sec &&
+		    statbuf->st_mtim.tv_nsec == statbuf2.st_mtim.tv_nsec) {
 			uint8_t sha512[12 + 64];
 
-			sha512[ 0] = (statbuf.st_mtim.tv_sec >> 56) & 0xff;
-			sha512[ 1] = (statbuf.st_mtim.tv_sec >> 48) & 0xff;
-			sha512[ 2] = (statbuf.st_mtim.tv_sec >> 40) & 0xff;
-			sha512[ 3] = (statbuf.st_mtim.tv_sec >> 32) & 0xff;
-			sha512[ 4] = (statbuf.st_mtim.tv_sec >> 24) & 0xff;
-			sha512[ 5] = (statbuf.st_mtim.tv_sec >> 16) & 0xff;
-			sha512[ 6] = (statbuf.st_mtim.tv_sec >>  8) & 0xff;
-			sha512[ 7] = (statbuf.st_mtim.tv_sec >>  0) & 0xff;
-			sha512[ 8] = (statbuf.st_mtim.tv_nsec >> 24) & 0xff;
-			sha512[ 9] = (statbuf.st_mtim.tv_nsec >> 16) & 0xff;
-			sha512[10] = (statbuf.st_mtim.tv_nsec >>  8) & 0xff;
-			sha512[11] = (statbuf.st_mtim.tv_nsec >>  0) & 0xff;
+			sha512[ 0] = (statbuf->st_mtim.tv_sec >> 56) & 0xff;
+			sha512[ 1] = (statbuf->st_mtim.tv_sec >> 48) & 0xff;
+			sha512[ 2] = (statbuf->st_mtim.tv_sec >> 40) & 0xff;
+			sha512[ 3] = (statbuf->st_mtim.tv_sec >> 32) & 0xff;
+			sha512[ 4] = (statbuf->st_mtim.tv_sec >> 24) & 0xff;
+			sha512[ 5] = (statbuf->st_mtim.tv_sec >> 16) & 0xff;
+			sha512[ 6] = (statbuf->st_mtim.tv_sec >>  8) & 0xff;
+			sha512[ 7] = (statbuf->st_mtim.tv_sec >>  0) & 0xff;
+			sha512[ 8] = (statbuf->st_mtim.tv_nsec >> 24) & 0xff;
+			sha512[ 9] = (statbuf->st_mtim.tv_nsec >> 16) & 0xff;
+			sha512[10] = (statbuf->st_mtim.tv_nsec >>  8) & 0xff;
+			sha512[11] = (statbuf->st_mtim.tv_nsec >>  0) & 0xff;
 			memcpy(sha512 + 12, fh->hash, 64);
 
+			stats_count(STATS_SYS_SETXATTR, 1);
 			fsetxattr(fd, "user.sha512", sha512, sizeof(sha512), 0);
+
+			if (have_ms) {
+				uint8_t x[8 + 64 + 16];
+				int i;
+
+				put_be64(x, ms.length);
+				for (i = 0; i < 8; i++)
+					put_be64(x + 8 + 8 * i, ms.h[i]);
+				memcpy(x + 72, ms.check, 16);
+
+				stats_count(STATS_SYS_SETXATTR, 1);
+				fsetxattr(fd, "user.sha512.midstate", x,
+					  sizeof(x), 0);
+			}
 		}
 	}
 
@@ -142,20 +497,112 @@ static int hash_file(struct file_to_hash *fh, int xattr_cache_hash)
 	return 0;
 }
 
+/*
+ * Hashes a single file outside of a hash_chain() run, for callers
+ * that learn about files one at a time.
+ */
+int hash_one_file(struct file_to_hash *fh, const struct hash_options *opts)
+{
+	struct hash_counters cnt;
+	struct stat statbuf;
+	uint8_t *buf;
+	int ret;
+
+	memset(&cnt, 0, sizeof(cnt));
+
+	buf = malloc(READ_BUF_SIZE);
+	if (buf == NULL)
+		abort();
+
+	ret = hash_file(fh, opts, buf, &cnt, &statbuf);
+	fh->state = ret ? STATE_FAILED : STATE_OK;
+
+	free(buf);
+
+	return ret;
+}
 
 struct hash_state
 {
 	struct iv_list_head	*files;
-	int			xattr_cache_hash;
+	const struct hash_options *opts;
 
 	pthread_mutex_t		lock;
-	struct iv_list_head	*prehash;
+	struct iv_list_head	*prehash[NUMA_MAX_NODES];
 	struct iv_list_head	*preprint;
+	uint64_t		print_seq;
+	uint64_t		printed;
+	struct dir		*print_dir;
+	char			*print_path;
+	int			print_path_len;
+
+	struct hash_counters	cnt;
+	struct hash_counters	node_cnt[NUMA_MAX_NODES];
 };
 
+#define PRINT_PATH_SIZE		65536
+
+static void print_binary(struct hash_state *hs, struct file_to_hash *fh,
+			 const uint8_t *hash)
+{
+	if (fh->dir != hs->print_dir) {
+		int len;
+
+		len = format_dir_path(hs->print_path, PRINT_PATH_SIZE - 1,
+				      fh->dir);
+		if (len >= PRINT_PATH_SIZE - 1)
+			len = PRINT_PATH_SIZE - 2;
+		hs->print_path[len++] = '/';
+
+		hs->print_dir = fh->dir;
+		hs->print_path_len = len;
+	}
+
+	sumfile_write(hs->opts->binary, hash, hs->print_path,
+		      hs->print_path_len, fh->d_name, strlen(fh->d_name));
+}
+
+/*
+ * Hard links to a file that was already hashed never go through
+ * hash_file(), so their stat data is looked up here.
+ */
+static void report_backref(struct hash_state *hs, struct file_to_hash *fh,
+			   struct file_to_hash *fh_hash)
+{
+	struct stat statbuf;
+
+	if (fh_hash->state == STATE_OK) {
+		stats_count(STATS_SYS_FSTATAT, 1);
+		if (fstatat(fh->dir->dirfd, fh->d_name, &statbuf,
+			    AT_SYMLINK_NOFOLLOW) == 0) {
+			hs->opts->hashed(hs->opts->hashed_cookie, fh,
+					 fh_hash->hash, &statbuf);
+			return;
+		}
+	}
+
+	hs->opts->hashed(hs->opts->hashed_cookie, fh, NULL, NULL);
+}
+
 static void *hash_thread(void *cookie)
 {
 	struct hash_state *hs = cookie;
+	FILE *out = hs->opts->out;
+	struct hash_counters cnt;
+	uint8_t *buf;
+	int node;
+
+	memset(&cnt, 0, sizeof(cnt));
+
+	buf = malloc(READ_BUF_SIZE);
+	if (buf == NULL)
+		abort();
+
+	/*
+	 * When steering, every node walks the list with its own cursor
+	 * and only picks up files on devices attached to it.
+	 */
+	node = hs->opts->numa_steer ? numa_current_node() : 0;
 
 	pthread_mutex_lock(&hs->lock);
 
@@ -164,23 +611,61 @@ static void *hash_thread(void *cookie)
 		struct file_to_hash *fh;
 		int flush;
 
-		nxt = hs->prehash->next;
+		nxt = hs->prehash[node]->next;
 		if (nxt == hs->files)
 			break;
 
-		hs->prehash = nxt;
+		hs->prehash[node] = nxt;
 		fh = iv_container_of(nxt, struct file_to_hash, list);
 
+		if (hs->opts->numa_steer && fh->node != node)
+			continue;
+
 		if (fh->state == STATE_NOTYET) {
+			struct stat statbuf;
+			uint64_t start;
+			uint64_t probe_start;
+
 			pthread_mutex_unlock(&hs->lock);
-			fh->state = hash_file(fh, hs->xattr_cache_hash) ?
+			start = stats_time();
+			probe_start = PROBE_START(file_done);
+			fh->state = hash_file(fh, hs->opts, buf, &cnt,
+					      &statbuf) ?
 					STATE_FAILED : STATE_OK;
+			stats_latency(STATS_HIST_FILE_HASH, start);
+			PROBE4(file_done, fh->d_ino, fh->st_size,
+			       PROBE_LATENCY(probe_start), fh->state);
+			progress_file_hashed(fh->st_size > 0 ? fh->st_size : 0);
+			cnt.files++;
+
+			/*
+			 * Hand results to the caller right here on the
+			 * worker, so that it doesn't wait for the lock.
+			 */
+			if (hs->opts->hashed != NULL) {
+				int ok = (fh->state == STATE_OK);
+
+				hs->opts->hashed(hs->opts->hashed_cookie, fh,
+						 ok ? fh->hash : NULL,
+						 ok ? &statbuf : NULL);
+			}
+
 			pthread_mutex_lock(&hs->lock);
 		}
 
+		/*
+		 * Print everything up to the first file that hasn't been
+		 * hashed yet.  Backrefs always point to earlier files, so
+		 * anything they refer to has been resolved by then.  If
+		 * the caller wants results handed to it instead, that
+		 * happens here too, so that it sees them in list order.
+		 * Hard links are handed to a hashed callback here as
+		 * well, and sums are only printed if there is an output.
+		 */
 		flush = 0;
-		while (hs->preprint != hs->prehash) {
+		while (hs->preprint->next != hs->files) {
 			struct file_to_hash *fh_hash;
+			unsigned long long seq;
 
 			fh = iv_container_of(hs->preprint->next,
 					     struct file_to_hash, list);
@@ -188,45 +673,211 @@ static void *hash_thread(void *cookie)
 				break;
 
 			hs->preprint = &fh->list;
+			seq = hs->print_seq++;
+
+			fh_hash = fh;
+			while (fh_hash->state == STATE_BACKREF)
+				fh_hash = fh_hash->backref;
 
-			if (fh->state == STATE_BACKREF)
-				fh_hash = fh->backref;
-			else
-				fh_hash = fh;
+			if (hs->opts->hashed != NULL &&
+			    fh->state == STATE_BACKREF) {
+				report_backref(hs, fh, fh_hash);
+			}
 
-			if (fh_hash->state == STATE_OK) {
+			if (hs->opts->result != NULL) {
+				if (fh_hash->state == STATE_OK) {
+					hs->opts->result(hs->opts->result_cookie,
+							 fh, fh_hash->hash);
+				} else if (fh_hash->state == STATE_FAILED) {
+					hs->opts->result(hs->opts->result_cookie,
+							 fh, NULL);
+				}
+			} else if (out == NULL) {
+				continue;
+			} else if (fh_hash->state == STATE_OK &&
+				   hs->opts->binary != NULL) {
+				print_binary(hs, fh, fh_hash->hash);
+				flush = 1;
+			} else if (fh_hash->state == STATE_OK) {
 				int i;
 
+				if (hs->opts->print_seq)
+					fprintf(out, "%llu ", seq);
+
 				for (i = 0; i < sizeof(fh_hash->hash); i++)
-					printf("%.2x", fh_hash->hash[i]);
-				printf("  ");
-				print_dir_path(stdout, fh->dir);
-				printf("/%s\n", fh->d_name);
+					fprintf(out, "%.2x", fh_hash->hash[i]);
+				fprintf(out, "  ");
+				print_dir_path(out, fh->dir);
+				fprintf(out, "/%s\n", fh->d_name);
 
+				hs->printed++;
 				flush = 1;
 			}
 		}
 
 		if (flush)
-			fflush(stdout);
+			fflush(out);
 	}
 
+	hs->cnt.sparse_files += cnt.sparse_files;
+	hs->cnt.sparse_bytes += cnt.sparse_bytes;
+	hs->cnt.resumed_files += cnt.resumed_files;
+	hs->cnt.resumed_bytes += cnt.resumed_bytes;
+
+	node = numa_current_node();
+	hs->node_cnt[node].files += cnt.files;
+	hs->node_cnt[node].bytes += cnt.bytes;
+
 	pthread_mutex_unlock(&hs->lock);
 
+	free(buf);
+
 	return NULL;
 }
 
-void hash_chain(struct iv_list_head *files, int xattr_cache_hash)
+static void assign_nodes(struct iv_list_head *files)
+{
+	struct iv_list_head *lh;
+	struct dir *last_dir;
+	dev_t last_dev;
+	int last_node;
+	int rr;
+
+	last_dir = NULL;
+	last_dev = 0;
+	last_node = -1;
+	rr = 0;
+
+	iv_list_for_each (lh, files) {
+		struct file_to_hash *fh;
+
+		fh = iv_container_of(lh, struct file_to_hash, list);
+		if (fh->state != STATE_NOTYET)
+			continue;
+
+		if (fh->dir != last_dir) {
+			struct stat buf;
+
+			last_dir = fh->dir;
+			if (fstat(fh->dir->dirfd, &buf) == 0 &&
+			    buf.st_dev != last_dev) {
+				last_dev = buf.st_dev;
+				last_node = numa_dev_node(buf.st_dev);
+			}
+		}
+
+		/*
+		 * Files on devices without a known home node are spread
+		 * over all nodes.
+		 */
+		if (last_node >= 0) {
+			fh->node = last_node;
+		} else {
+			fh->node = rr;
+			rr = (rr + 1) % numa_nodes;
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int hash_chain(struct iv_list_head *files, const struct hash_options *opts)
 {
 	struct hash_state hs;
+	double secs;
+	int ret;
+	int i;
 
 	hs.files = files;
-	hs.xattr_cache_hash = xattr_cache_hash;
+	hs.opts = opts;
 	pthread_mutex_init(&hs.lock, NULL);
-	hs.prehash = files;
+	for (i = 0; i < NUMA_MAX_NODES; i++)
+		hs.prehash[i] = files;
 	hs.preprint = files;
+	hs.print_seq = 0;
+	hs.printed = 0;
+	hs.print_dir = NULL;
+	hs.print_path = NULL;
+	if (opts->binary != NULL) {
+		hs.print_path = malloc(PRINT_PATH_SIZE);
+		if (hs.print_path == NULL)
+			abort();
+	}
+	memset(&hs.cnt, 0, sizeof(hs.cnt));
+	memset(&hs.node_cnt, 0, sizeof(hs.node_cnt));
+
+	if (opts->numa_steer)
+		assign_nodes(files);
+
+	if (progress_enabled) {
+		struct iv_list_head *lh;
+		uint64_t num_files;
+		uint64_t num_bytes;
+
+		num_files = 0;
+		num_bytes = 0;
+		iv_list_for_each (lh, files) {
+			struct file_to_hash *fh;
+
+			fh = iv_container_of(lh, struct file_to_hash, list);
+			if (fh->state == STATE_NOTYET) {
+				num_files++;
+				if (fh->st_size > 0)
+					num_bytes += fh->st_size;
+			}
+		}
+
+		progress_hash_start(num_files, num_bytes);
+	}
 
-	run_threads(hash_thread, &hs, 2 * sysconf(_SC_NPROCESSORS_ONLN));
+	secs = now();
+
+	ret = run_threads(hash_thread, &hs, opts->threads ? opts->threads :
+					    2 * sysconf(_SC_NPROCESSORS_ONLN));
+
+	secs = now() - secs;
 
 	pthread_mutex_destroy(&hs.lock);
+	free(hs.print_path);
+
+	if (ret)
+		return 1;
+
+	if (opts->printed != NULL)
+		*opts->printed = hs.printed;
+
+	if (numa_enabled) {
+		for (i = 0; i < numa_nodes; i++) {
+			fprintf(stderr, "numa: node %d: hashed %llu files, "
+					"%llu bytes, %.1f MB/s\n",
+				numa_node_id(i),
+				(unsigned long long)hs.node_cnt[i].files,
+				(unsigned long long)hs.node_cnt[i].bytes,
+				secs > 0 ?
+				    hs.node_cnt[i].bytes / secs / 1e6 : 0.0);
+		}
+	}
+
+	if (opts->sparse) {
+		fprintf(stderr, "sparse: skipped reading %llu bytes of holes "
+				"in %llu files\n",
+			(unsigned long long)hs.cnt.sparse_bytes,
+			(unsigned long long)hs.cnt.sparse_files);
+	}
+
+	if (opts->resume_appends) {
+		fprintf(stderr, "resume: resumed %llu files, skipped reading "
+				"%llu bytes\n",
+			(unsigned long long)hs.cnt.resumed_files,
+			(unsigned long long)hs.cnt.resumed_bytes);
+	}
+
+	return 0;
 }
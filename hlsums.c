@@ -25,6 +25,7 @@
 #include <sys/resource.h>
 #include <sys/types.h>
 #include "hlsums_common.h"
+#include "stats.h"
 
 static int contents_only;
 static int do_link;
@@ -98,10 +99,14 @@ int main(int argc, char *argv[])
 		{ "contents-only", no_argument, 0, 'c', },
 		{ "dedup", no_argument, 0, 'd', },
 		{ "link", no_argument, 0, 'l', },
+		{ "stats-json", required_argument, 0, 'S', },
 		{ 0, 0, 0, 0, },
 	};
 	struct rlimit rlim;
 	struct iv_avl_tree hashes;
+	char *stats_file;
+
+	stats_file = NULL;
 
 	while (1) {
 		int c;
@@ -123,6 +128,10 @@ int main(int argc, char *argv[])
 			do_link = 1;
 			break;
 
+		case 'S':
+			stats_file = optarg;
+			break;
+
 		case '?':
 			return 1;
 
@@ -133,7 +142,7 @@ int main(int argc, char *argv[])
 
 	if (argc == optind) {
 		fprintf(stderr, "%s: [--contents-only] [--dedup] [--link] "
-				"[sumfile]+\n", argv[0]);
+				"[--stats-json=FILE] [sumfile]+\n", argv[0]);
 		return 1;
 	}
 
@@ -153,12 +162,22 @@ int main(int argc, char *argv[])
 		setrlimit(RLIMIT_NOFILE, &rlim);
 	}
 
+	if (stats_file != NULL)
+		stats_start();
+
+	stats_phase_begin("read_sum_files");
 	if (read_sum_files(&hashes, argc - optind, argv + optind))
 		return 1;
+	stats_phase_end();
 
+	stats_phase_begin("link_dedup");
 	link_dedup(&hashes);
+	stats_phase_end();
 
 	free_hashes(&hashes);
 
+	if (stats_file != NULL && stats_write_json(stats_file, "hlsums"))
+		return 1;
+
 	return 0;
 }
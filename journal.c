@@ -0,0 +1,525 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "mksums_common.h"
+
+/*
+ * The journal is an append-only text file that starts with a header
+ * line, followed by records of the form:
+ *
+ *	<check> H <sha512> <ino> <size> <mtime_sec>.<mtime_nsec> <len>:<path>
+ *	<check> S <num_files>
+ *
+ * where <check> is the FNV-1a hash of everything after it on the line,
+ * and <path> is exactly <len> bytes, so that paths with embedded
+ * newlines survive.  H records are completed hashes, and S records mark
+ * the end of a scan.  Records are buffered and written out, followed by
+ * an fdatasync(), at most once per JOURNAL_SYNC_INTERVAL or whenever
+ * the buffer fills.  A torn record at the end of the file (from a crash
+ * in the middle of a write) is detected on load and truncated away.
+ */
+#define JOURNAL_HEADER		"mksums-journal 1\n"
+#define JOURNAL_BUF_SIZE	524288
+#define JOURNAL_SYNC_INTERVAL	1
+
+struct journal_entry
+{
+	struct iv_avl_node	an;
+	uint64_t		path_hash;
+	uint64_t		ino;
+	uint64_t		size;
+	uint64_t		mtime_sec;
+	uint32_t		mtime_nsec;
+	uint8_t			hash[64];
+};
+
+struct journal
+{
+	int			fd;
+	struct iv_avl_tree	entries;
+	uint64_t		hits;
+
+	pthread_mutex_t		lock;
+	char			*buf;
+	size_t			buf_used;
+	time_t			last_sync;
+};
+
+static uint32_t check(const char *p, size_t len)
+{
+	uint32_t h;
+
+	h = 0x811c9dc5;
+	while (len--) {
+		h ^= (uint8_t)*p++;
+		h *= 0x01000193;
+	}
+
+	return h;
+}
+
+static uint64_t hash_path(const char *p, size_t len)
+{
+	uint64_t h;
+
+	h = 0xcbf29ce484222325ULL;
+	while (len--) {
+		h ^= (uint8_t)*p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static int compare_entries(const struct iv_avl_node *_a,
+			   const struct iv_avl_node *_b)
+{
+	const struct journal_entry *a;
+	const struct journal_entry *b;
+
+	a = iv_container_of(_a, struct journal_entry, an);
+	b = iv_container_of(_b, struct journal_entry, an);
+
+	if (a->path_hash < b->path_hash)
+		return -1;
+	if (a->path_hash > b->path_hash)
+		return 1;
+
+	return 0;
+}
+
+static struct journal_entry *find_entry(struct iv_avl_tree *tree,
+				        uint64_t path_hash)
+{
+	struct iv_avl_node *an;
+
+	an = tree->root;
+	while (an != NULL) {
+		struct journal_entry *e;
+
+		e = iv_container_of(an, struct journal_entry, an);
+		if (path_hash == e->path_hash)
+			return e;
+
+		if (path_hash < e->path_hash)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static int file_path(char *buf, size_t len, struct file_to_hash *fh)
+{
+	int n;
+
+	n = format_dir_path(buf, len, fh->dir);
+
+	return n + snprintf(buf + (n < len ? n : len),
+			    n < len ? len - n : 0, "/%s", fh->d_name);
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+/*
+ * The journal is mmap()ed and not NUL terminated, so all parsing is
+ * done by hand, bounded by the end of the mapping.
+ */
+static int parse_num(const char **p, const char *end, int base,
+		     uint64_t *val, char term)
+{
+	const char *q;
+
+	*val = 0;
+	for (q = *p; q < end && *q != term; q++) {
+		int d;
+
+		d = hex_digit(*q);
+		if (d < 0 || d >= base)
+			return 1;
+		*val = *val * base + d;
+	}
+
+	if (q == *p || q == end)
+		return 1;
+
+	*p = q + 1;
+
+	return 0;
+}
+
+/*
+ * Parses the record at p, returning its length, or 0 if it is torn or
+ * corrupt.
+ */
+static size_t parse_record(struct journal *j, const char *p, const char *end)
+{
+	const char *body;
+	const char *q;
+	const char *eol;
+	uint64_t chk;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t sec;
+	uint64_t nsec;
+	uint64_t len;
+	uint8_t hash[64];
+	int i;
+	struct journal_entry *e;
+	struct journal_entry *old;
+
+	q = p;
+	if (parse_num(&q, end, 16, &chk, ' ') || end - q < 2)
+		return 0;
+	body = q;
+
+	if (body[0] == 'S') {
+		eol = memchr(body, '\n', end - body);
+		if (eol == NULL || check(body, eol - body) != chk)
+			return 0;
+
+		return eol + 1 - p;
+	}
+
+	if (body[0] != 'H' || body[1] != ' ' || end - body < 2 + 128 + 1)
+		return 0;
+
+	q = body + 2;
+	for (i = 0; i < 64; i++) {
+		int hi;
+		int lo;
+
+		hi = hex_digit(q[2 * i]);
+		lo = hex_digit(q[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return 0;
+		hash[i] = (hi << 4) | lo;
+	}
+	q += 128;
+
+	if (*q++ != ' ' ||
+	    parse_num(&q, end, 10, &ino, ' ') ||
+	    parse_num(&q, end, 10, &size, ' ') ||
+	    parse_num(&q, end, 10, &sec, '.') ||
+	    parse_num(&q, end, 10, &nsec, ' ') ||
+	    parse_num(&q, end, 10, &len, ':') ||
+	    len >= end - q) {
+		return 0;
+	}
+
+	eol = q + len;
+	if (*eol != '\n' || check(body, eol - body) != chk)
+		return 0;
+
+	e = malloc(sizeof(*e));
+	if (e == NULL)
+		abort();
+
+	e->path_hash = hash_path(q, len);
+	e->ino = ino;
+	e->size = size;
+	e->mtime_sec = sec;
+	e->mtime_nsec = nsec;
+	memcpy(e->hash, hash, sizeof(e->hash));
+
+	/*
+	 * Later records for the same path supersede earlier ones.
+	 */
+	old = find_entry(&j->entries, e->path_hash);
+	if (old != NULL) {
+		iv_avl_tree_delete(&j->entries, &old->an);
+		free(old);
+	}
+	iv_avl_tree_insert(&j->entries, &e->an);
+
+	return eol + 1 - p;
+}
+
+static int load_journal(struct journal *j, const char *path)
+{
+	struct stat buf;
+	char *map;
+	off_t off;
+	int num;
+
+	if (fstat(j->fd, &buf) < 0) {
+		perror("fstat");
+		return 1;
+	}
+
+	if (buf.st_size == 0) {
+		if (write(j->fd, JOURNAL_HEADER, strlen(JOURNAL_HEADER)) !=
+		    strlen(JOURNAL_HEADER)) {
+			perror("write");
+			return 1;
+		}
+		return 0;
+	}
+
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, j->fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (buf.st_size < strlen(JOURNAL_HEADER) ||
+	    memcmp(map, JOURNAL_HEADER, strlen(JOURNAL_HEADER))) {
+		fprintf(stderr, "%s: not a mksums journal\n", path);
+		munmap(map, buf.st_size);
+		return 1;
+	}
+
+	num = 0;
+	off = strlen(JOURNAL_HEADER);
+	while (off < buf.st_size) {
+		size_t len;
+
+		len = parse_record(j, map + off, map + buf.st_size);
+		if (len == 0)
+			break;
+
+		off += len;
+		num++;
+	}
+
+	munmap(map, buf.st_size);
+
+	if (off < buf.st_size) {
+		fprintf(stderr, "%s: discarding %lld bytes of torn or corrupt "
+				"records\n", path,
+			(long long)(buf.st_size - off));
+		if (ftruncate(j->fd, off) < 0) {
+			perror("ftruncate");
+			return 1;
+		}
+	}
+
+	if (lseek(j->fd, off, SEEK_SET) < 0) {
+		perror("lseek");
+		return 1;
+	}
+
+	fprintf(stderr, "%s: loaded %d records\n", path, num);
+
+	return 0;
+}
+
+static void free_journal(struct journal *j)
+{
+	struct iv_avl_node *an;
+	struct iv_avl_node *an2;
+
+	iv_avl_tree_for_each_safe (an, an2, &j->entries) {
+		iv_avl_tree_delete(&j->entries, an);
+		free(iv_container_of(an, struct journal_entry, an));
+	}
+
+	close(j->fd);
+	free(j);
+}
+
+struct journal *journal_open(const char *path)
+{
+	struct journal *j;
+
+	j = malloc(sizeof(*j));
+	if (j == NULL)
+		abort();
+
+	j->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (j->fd < 0) {
+		perror("open");
+		free(j);
+		return NULL;
+	}
+
+	INIT_IV_AVL_TREE(&j->entries, compare_entries);
+	j->hits = 0;
+
+	if (load_journal(j, path)) {
+		free_journal(j);
+		return NULL;
+	}
+
+	pthread_mutex_init(&j->lock, NULL);
+	j->buf = malloc(JOURNAL_BUF_SIZE);
+	if (j->buf == NULL)
+		abort();
+	j->buf_used = 0;
+	j->last_sync = time(NULL);
+
+	return j;
+}
+
+static void flush(struct journal *j)
+{
+	size_t off;
+
+	off = 0;
+	while (off < j->buf_used) {
+		ssize_t ret;
+
+		ret = write(j->fd, j->buf + off, j->buf_used - off);
+		if (ret < 0) {
+			perror("write");
+			exit(1);
+		}
+
+		off += ret;
+	}
+
+	if (fdatasync(j->fd) < 0) {
+		perror("fdatasync");
+		exit(1);
+	}
+
+	j->buf_used = 0;
+	j->last_sync = time(NULL);
+}
+
+static void append(struct journal *j, const char *body, size_t len)
+{
+	char chk[16];
+
+	snprintf(chk, sizeof(chk), "%.8x ", check(body, len));
+
+	pthread_mutex_lock(&j->lock);
+
+	if (j->buf_used + 9 + len + 1 > JOURNAL_BUF_SIZE)
+		flush(j);
+
+	if (9 + len + 1 > JOURNAL_BUF_SIZE) {
+		fprintf(stderr, "journal: record too long\n");
+	} else {
+		memcpy(j->buf + j->buf_used, chk, 9);
+		memcpy(j->buf + j->buf_used + 9, body, len);
+		j->buf[j->buf_used + 9 + len] = '\n';
+		j->buf_used += 9 + len + 1;
+	}
+
+	if (time(NULL) - j->last_sync >= JOURNAL_SYNC_INTERVAL)
+		flush(j);
+
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_close(struct journal *j)
+{
+	flush(j);
+	fprintf(stderr, "journal: reused %llu results\n",
+		(unsigned long long)j->hits);
+
+	pthread_mutex_destroy(&j->lock);
+	free(j->buf);
+	free_journal(j);
+}
+
+int journal_lookup(struct journal *j, struct file_to_hash *fh,
+		   const struct stat *buf, uint8_t *hash)
+{
+	char path[8192];
+	struct journal_entry *e;
+	int len;
+
+	if (iv_avl_tree_empty(&j->entries))
+		return 1;
+
+	len = file_path(path, sizeof(path), fh);
+	if (len >= sizeof(path))
+		return 1;
+
+	e = find_entry(&j->entries, hash_path(path, len));
+	if (e == NULL)
+		return 1;
+
+	if (e->ino != buf->st_ino || e->size != buf->st_size ||
+	    e->mtime_sec != buf->st_mtim.tv_sec ||
+	    e->mtime_nsec != buf->st_mtim.tv_nsec) {
+		return 1;
+	}
+
+	memcpy(hash, e->hash, sizeof(e->hash));
+	__atomic_fetch_add(&j->hits, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void journal_record(struct journal *j, struct file_to_hash *fh,
+		    const struct stat *buf, const uint8_t *hash)
+{
+	char rec[8192 + 256];
+	int n;
+	int len;
+	int i;
+
+	n = sprintf(rec, "H ");
+	for (i = 0; i < 64; i++)
+		n += sprintf(rec + n, "%.2x", hash[i]);
+
+	n += sprintf(rec + n, " %llu %llu %llu.%.9lu ",
+		     (unsigned long long)buf->st_ino,
+		     (unsigned long long)buf->st_size,
+		     (unsigned long long)buf->st_mtim.tv_sec,
+		     (unsigned long)buf->st_mtim.tv_nsec);
+
+	len = file_path(rec + n + 16, sizeof(rec) - n - 16, fh);
+	if (len >= sizeof(rec) - n - 16)
+		return;
+
+	n += sprintf(rec + n, "%d:", len);
+	len = file_path(rec + n, sizeof(rec) - n, fh);
+
+	append(j, rec, n + len);
+}
+
+void journal_scan_done(struct journal *j, struct iv_list_head *files)
+{
+	struct iv_list_head *lh;
+	char rec[64];
+	uint64_t num;
+
+	num = 0;
+	iv_list_for_each (lh, files)
+		num++;
+
+	append(j, rec, sprintf(rec, "S %llu", (unsigned long long)num));
+}
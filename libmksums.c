@@ -0,0 +1,178 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iv_list.h>
+#include <string.h>
+#include "libmksums.h"
+#include "mksums_common.h"
+
+#define DIR_PATH_SIZE		65536
+
+struct mksums_ctx
+{
+	struct hash_options	opts;
+	int			scan_threads;
+	mksums_cb		cb;
+	void			*cookie;
+};
+
+struct mksums_run_state
+{
+	struct mksums_ctx	*ctx;
+	unsigned int		generation;
+};
+
+struct mksums_ctx *mksums_ctx_new(void)
+{
+	struct mksums_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		abort();
+
+	return ctx;
+}
+
+void mksums_ctx_free(struct mksums_ctx *ctx)
+{
+	if (ctx->opts.cache != NULL)
+		hash_cache_close(ctx->opts.cache);
+
+	free(ctx);
+}
+
+void mksums_set_scan_threads(struct mksums_ctx *ctx, int nthreads)
+{
+	ctx->scan_threads = nthreads;
+}
+
+void mksums_set_hash_threads(struct mksums_ctx *ctx, int nthreads)
+{
+	ctx->opts.threads = nthreads;
+}
+
+int mksums_set_cache_file(struct mksums_ctx *ctx, const char *path)
+{
+	struct hash_cache *cache;
+
+	cache = hash_cache_open(path);
+	if (cache == NULL)
+		return 1;
+
+	if (ctx->opts.cache != NULL)
+		hash_cache_close(ctx->opts.cache);
+	ctx->opts.cache = cache;
+
+	return 0;
+}
+
+void mksums_set_xattr_cache(struct mksums_ctx *ctx, int enable)
+{
+	ctx->opts.xattr_cache_hash = !!enable;
+}
+
+void mksums_set_sparse(struct mksums_ctx *ctx, int enable)
+{
+	ctx->opts.sparse = !!enable;
+}
+
+void mksums_set_callback(struct mksums_ctx *ctx, mksums_cb cb, void *cookie)
+{
+	ctx->cb = cb;
+	ctx->cookie = cookie;
+}
+
+/*
+ * Workers mostly get files from the same directory in a row, so each
+ * one keeps the last directory path it formatted.  Pool threads live
+ * as long as the process, and so do these buffers.  Directories are
+ * freed at the end of every run, and workers can go back and forth
+ * between runs of different contexts, so every run gets a generation
+ * number of its own, and the cached pointer is only trusted within
+ * the run that it was set in.
+ */
+static unsigned int run_generation;
+static __thread unsigned int last_generation;
+static __thread struct dir *last_dir;
+static __thread char *dir_path;
+static __thread int dir_path_len;
+
+static void deliver(void *cookie, struct file_to_hash *fh,
+		    const uint8_t *hash, const struct stat *st)
+{
+	struct mksums_run_state *run = cookie;
+	struct mksums_result res;
+
+	if (dir_path == NULL) {
+		dir_path = malloc(DIR_PATH_SIZE);
+		if (dir_path == NULL)
+			abort();
+	}
+
+	if (fh->dir != last_dir || last_generation != run->generation) {
+		dir_path_len = format_dir_path(dir_path, DIR_PATH_SIZE,
+					       fh->dir);
+		if (dir_path_len >= DIR_PATH_SIZE)
+			dir_path_len = DIR_PATH_SIZE - 1;
+		last_dir = fh->dir;
+		last_generation = run->generation;
+	}
+
+	res.dir = dir_path;
+	res.dirlen = dir_path_len;
+	res.name = fh->d_name;
+	res.namelen = strlen(fh->d_name);
+	res.digest = hash;
+	res.st = st;
+
+	run->ctx->cb(run->ctx->cookie, &res);
+}
+
+int mksums_run(struct mksums_ctx *ctx, int num_roots, char *roots[])
+{
+	struct iv_list_head files;
+	int failed;
+
+	INIT_IV_LIST_HEAD(&files);
+
+	failed = scan_tree(&files, num_roots, roots, 0, ctx->scan_threads);
+
+	find_hard_links(&files);
+
+	if (ctx->cb != NULL) {
+		struct mksums_run_state run;
+		struct hash_options opts;
+
+		run.ctx = ctx;
+		run.generation = __atomic_add_fetch(&run_generation, 1,
+						    __ATOMIC_RELAXED);
+
+		opts = ctx->opts;
+		opts.hashed = deliver;
+		opts.hashed_cookie = &run;
+		if (hash_chain(&files, &opts))
+			failed = 1;
+	}
+
+	free_file_chain(&files);
+
+	return failed;
+}
@@ -0,0 +1,90 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __LIBMKSUMS_H
+#define __LIBMKSUMS_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Embeddable version of the mksums scan, hard link and hash
+ * pipeline.  Instead of printing sums, mksums_run() hands each file's
+ * result to a callback.
+ *
+ * Callbacks are made from the hash worker threads, concurrently and
+ * in no particular order, and must be thread safe.  The workers run
+ * on small (256 KiB) stacks, so callbacks must not put large buffers
+ * on the stack.  The result and everything it points to is only valid
+ * during the callback.  Hard links to the same inode are hashed once
+ * and reported once per path.
+ *
+ * The scan keeps a descriptor open for every directory until the run
+ * ends, so callers should raise RLIMIT_NOFILE like mksums does.  Runs
+ * can be made from several threads at once, and share one worker pool
+ * that grows to give every run in progress its threads.  A context
+ * must not be changed while a run using it is in progress.  struct
+ * stat must have the layout that _FILE_OFFSET_BITS=64 gives.
+ */
+struct mksums_ctx;
+
+struct mksums_result
+{
+	const char		*dir;		/* without trailing slash */
+	int			dirlen;
+	const char		*name;
+	int			namelen;
+	const uint8_t		*digest;	/* 64 bytes, NULL on error */
+	const struct stat	*st;		/* NULL on error */
+};
+
+typedef void (*mksums_cb)(void *cookie, const struct mksums_result *res);
+
+struct mksums_ctx *mksums_ctx_new(void);
+void mksums_ctx_free(struct mksums_ctx *ctx);
+
+/* Pool sizes, zero means the mksums default. */
+void mksums_set_scan_threads(struct mksums_ctx *ctx, int nthreads);
+void mksums_set_hash_threads(struct mksums_ctx *ctx, int nthreads);
+
+/* Same as the --cache-file, --xattr-cache-hash and --sparse options. */
+int mksums_set_cache_file(struct mksums_ctx *ctx, const char *path);
+void mksums_set_xattr_cache(struct mksums_ctx *ctx, int enable);
+void mksums_set_sparse(struct mksums_ctx *ctx, int enable);
+
+void mksums_set_callback(struct mksums_ctx *ctx, mksums_cb cb, void *cookie);
+
+/*
+ * Returns nonzero if any of the roots or directories under them could
+ * not be read, or if the worker threads could not be started.  Such
+ * errors are also printed to stderr.  Files that can't be hashed are
+ * reported through the callback instead.
+ */
+int mksums_run(struct mksums_ctx *ctx, int num_roots, char *roots[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -24,6 +24,8 @@
 #include <iv_list.h>
 #include <string.h>
 #include "hlsums_common.h"
+#include "probes.h"
+#include "stats.h"
 
 static int contents_only;
 
@@ -97,21 +99,30 @@ static int better_leader(const struct inode *a, const struct inode *b)
 static int try_link(char *from, char *to)
 {
 	static const char *tempfile = "zufequohshuel8Aihoovie9ooMiegiiJ";
+	uint64_t start;
 	int ret;
 
+	start = PROBE_START(link);
+	stats_count(STATS_SYS_LINK, 1);
 	ret = link(to, tempfile);
 	if (ret < 0) {
 		fprintf(stderr, "linking %s: %s\n", to, strerror(errno));
 		return -1;
 	}
+	PROBE2(link, to, PROBE_LATENCY(start));
 
+	start = PROBE_START(rename);
+	stats_count(STATS_SYS_RENAME, 1);
 	ret = rename(tempfile, from);
 	if (ret < 0) {
 		fprintf(stderr, "renaming %s: %s\n", from, strerror(errno));
+		stats_count(STATS_SYS_UNLINK, 1);
 		unlink(tempfile);
 		return -1;
 	}
+	PROBE2(rename, from, PROBE_LATENCY(start));
 
+	stats_count(STATS_SYS_UNLINK, 1);
 	ret = unlink(tempfile);
 	if (ret == 0) {
 		fprintf(stderr, "unexpected hard links: %s / %s\n", from, to);
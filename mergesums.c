@@ -0,0 +1,389 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include "sumfile.h"
+
+/*
+ * Merges the outputs of "mksums --shard" runs back into the order a
+ * single unsharded run would have printed them in.  Every shard line
+ * is prefixed by its position in the global file list, and each shard
+ * prints in increasing position order, so a k-way merge on that
+ * position suffices.
+ *
+ * Each shard output starts with a "# mksums shard I/N TOTAL" header.
+ * All N shards must be given exactly once, and must agree on N and on
+ * the length of the file list, or the merged output would silently be
+ * incomplete.  For the same reason, each must end with the
+ * "# mksums shard end I/N ENTRIES" trailer that mksums writes once it
+ * is done, with the number of sums before it.
+ */
+struct shard
+{
+	char			*file;
+	FILE			*fp;
+	char			*line;
+	size_t			len;
+	int			index;
+	int			count;
+	unsigned long long	total;
+	unsigned long long	seq;
+	unsigned long long	entries;
+	char			*sum;
+};
+
+static struct shard *shards;
+static int num_shards;
+static struct shard **heap;
+static int heap_size;
+
+static int shard_header(struct shard *s)
+{
+	ssize_t len;
+	int end;
+
+	len = getline(&s->line, &s->len, s->fp);
+	if (len < 0 && ferror(s->fp)) {
+		perror("getline");
+		return 1;
+	}
+
+	end = 0;
+	if (len <= 0 ||
+	    sscanf(s->line, "# mksums shard %d/%d %llu%n", &s->index,
+		   &s->count, &s->total, &end) != 3 ||
+	    s->line[end] != '\n' || s->count <= 0 ||
+	    s->index < 0 || s->index >= s->count) {
+		fprintf(stderr, "%s: no mksums --shard header\n", s->file);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int check_shards(void)
+{
+	struct shard **by_index;
+	int count;
+	int i;
+
+	count = shards[0].count;
+
+	for (i = 1; i < num_shards; i++) {
+		if (shards[i].count != count ||
+		    shards[i].total != shards[0].total) {
+			fprintf(stderr, "%s: shard %d/%d of %llu files doesn't "
+					"match %s: shard %d/%d of %llu files\n",
+				shards[i].file, shards[i].index,
+				shards[i].count, shards[i].total,
+				shards[0].file, shards[0].index,
+				shards[0].count, shards[0].total);
+			return 1;
+		}
+	}
+
+	by_index = calloc(count, sizeof(*by_index));
+	if (by_index == NULL)
+		abort();
+
+	for (i = 0; i < num_shards; i++) {
+		struct shard *s = &shards[i];
+
+		if (by_index[s->index] != NULL) {
+			fprintf(stderr, "%s: shard %d/%d is also in %s\n",
+				s->file, s->index, count,
+				by_index[s->index]->file);
+			free(by_index);
+			return 1;
+		}
+		by_index[s->index] = s;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (by_index[i] == NULL) {
+			fprintf(stderr, "missing shard %d/%d\n", i, count);
+			free(by_index);
+			return 1;
+		}
+	}
+
+	free(by_index);
+
+	return 0;
+}
+
+static void shard_end(struct shard *s)
+{
+	int index;
+	int count;
+	unsigned long long entries;
+	int end;
+
+	end = 0;
+	if (sscanf(s->line, "# mksums shard end %d/%d %llu%n", &index,
+		   &count, &entries, &end) != 3 || s->line[end] != '\n') {
+		fprintf(stderr, "%s: not a mksums --shard output line: %s",
+			s->file, s->line);
+		exit(1);
+	}
+
+	if (index != s->index || count != s->count ||
+	    entries != s->entries) {
+		fprintf(stderr, "%s: shard %d/%d with %llu entries ends as "
+				"shard %d/%d with %llu entries\n", s->file,
+			s->index, s->count, s->entries, index, count, entries);
+		exit(1);
+	}
+
+	if (getline(&s->line, &s->len, s->fp) > 0) {
+		fprintf(stderr, "%s: data after the end of the shard\n",
+			s->file);
+		exit(1);
+	}
+}
+
+static int shard_next(struct shard *s)
+{
+	unsigned long long prev;
+	ssize_t len;
+	char *end;
+
+	prev = s->seq;
+
+	len = getline(&s->line, &s->len, s->fp);
+	if (len <= 0) {
+		if (ferror(s->fp)) {
+			perror("getline");
+			exit(1);
+		}
+		fprintf(stderr, "%s: shard output is incomplete\n", s->file);
+		exit(1);
+	}
+
+	if (s->line[0] == '#') {
+		shard_end(s);
+		return 1;
+	}
+
+	s->seq = strtoull(s->line, &end, 10);
+	if (end == s->line || *end != ' ') {
+		fprintf(stderr, "%s: not a mksums --shard output line: %s",
+			s->file, s->line);
+		exit(1);
+	}
+
+	if (s->sum != NULL && s->seq <= prev) {
+		fprintf(stderr, "%s: entries out of order at %llu\n",
+			s->file, s->seq);
+		exit(1);
+	}
+
+	if (s->seq >= s->total) {
+		fprintf(stderr, "%s: entry %llu beyond the end of the "
+				"file list\n", s->file, s->seq);
+		exit(1);
+	}
+
+	s->sum = end + 1;
+	s->entries++;
+
+	return 0;
+}
+
+static int heap_less(int a, int b)
+{
+	return heap[a]->seq < heap[b]->seq;
+}
+
+static void heap_swap(int a, int b)
+{
+	struct shard *s;
+
+	s = heap[a];
+	heap[a] = heap[b];
+	heap[b] = s;
+}
+
+static void heap_down(int i)
+{
+	while (1) {
+		int min;
+
+		min = i;
+		if (2 * i + 1 < heap_size && heap_less(2 * i + 1, min))
+			min = 2 * i + 1;
+		if (2 * i + 2 < heap_size && heap_less(2 * i + 2, min))
+			min = 2 * i + 2;
+
+		if (min == i)
+			break;
+
+		heap_swap(i, min);
+		i = min;
+	}
+}
+
+static void emit(struct sumfile_writer *w, char *sum)
+{
+	uint8_t hash[64];
+	char *path;
+	char *slash;
+	int len;
+
+	if (w == NULL) {
+		fputs(sum, stdout);
+		return;
+	}
+
+	len = strlen(sum);
+	if (len && sum[len - 1] == '\n')
+		sum[--len] = 0;
+
+	if (len < 131 || sumfile_parse_hex(hash, sum)) {
+		fprintf(stderr, "error parsing line: %s\n", sum);
+		return;
+	}
+
+	path = sum + 130;
+	slash = strrchr(path, '/');
+	if (slash == NULL)
+		slash = path - 1;
+
+	sumfile_write(w, hash, path, slash + 1 - path,
+		      slash + 1, sum + len - (slash + 1));
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{ "binary", no_argument, 0, 'b', },
+		{ 0, 0, 0, 0, },
+	};
+	struct sumfile_writer *w;
+	unsigned long long last;
+	int have_last;
+	int ret;
+	int i;
+
+	w = NULL;
+
+	while (1) {
+		int c;
+
+		c = getopt_long(argc, argv, "b", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'b':
+			w = sumfile_writer_open(stdout);
+			break;
+
+		case '?':
+			return 1;
+
+		default:
+			abort();
+		}
+	}
+
+	if (argc == optind) {
+		fprintf(stderr, "%s: [--binary] [shard output]+\n", argv[0]);
+		return 1;
+	}
+
+	num_shards = argc - optind;
+
+	shards = calloc(num_shards, sizeof(*shards));
+	heap = calloc(num_shards, sizeof(*heap));
+	if (shards == NULL || heap == NULL)
+		abort();
+
+	for (i = 0; i < num_shards; i++) {
+		struct shard *s = &shards[i];
+
+		s->file = argv[optind + i];
+		s->fp = fopen(s->file, "r");
+		if (s->fp == NULL) {
+			perror("fopen");
+			return 1;
+		}
+
+		if (shard_header(s))
+			return 1;
+	}
+
+	if (check_shards())
+		return 1;
+
+	heap_size = 0;
+	for (i = 0; i < num_shards; i++) {
+		struct shard *s = &shards[i];
+
+		if (!shard_next(s)) {
+			heap[heap_size++] = s;
+		} else {
+			fclose(s->fp);
+			free(s->line);
+		}
+	}
+
+	for (i = heap_size / 2 - 1; i >= 0; i--)
+		heap_down(i);
+
+	have_last = 0;
+	last = 0;
+	while (heap_size) {
+		struct shard *s;
+
+		s = heap[0];
+
+		if (have_last && s->seq == last) {
+			fprintf(stderr, "%s: entry %llu also present in "
+					"another shard\n", s->file, s->seq);
+			return 1;
+		}
+		have_last = 1;
+		last = s->seq;
+
+		emit(w, s->sum);
+
+		if (shard_next(s)) {
+			heap[0] = heap[--heap_size];
+			fclose(s->fp);
+			free(s->line);
+		}
+
+		heap_down(0);
+	}
+
+	ret = 0;
+	if (w != NULL)
+		ret = sumfile_writer_close(w);
+	else if (fflush(stdout))
+		ret = 1;
+
+	free(heap);
+	free(shards);
+
+	return ret;
+}
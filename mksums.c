@@ -22,35 +22,337 @@
 #include <errno.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <string.h>
 #include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "compress.h"
 #include "mksums_common.h"
+#include "stats.h"
+#include "sumfile.h"
+
+static int parse_bandwidth(const char *arg, uint64_t *val)
+{
+	char *end;
+
+	*val = strtoull(arg, &end, 0);
+	if (*end == 'k' || *end == 'K') {
+		*val <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		*val <<= 20;
+		end++;
+	} else if (*end == 'g' || *end == 'G') {
+		*val <<= 30;
+		end++;
+	}
+
+	return *end != 0 || *val == 0;
+}
 
 int main(int argc, char *argv[])
 {
 	static struct option long_options[] = {
+		{ "binary", no_argument, 0, 'B', },
+		{ "cache-file", required_argument, 0, 'c', },
+		{ "compact-cache", optional_argument, 0, 'C', },
+		{ "dir-digests", required_argument, 0, 'D', },
+		{ "dup-candidates-only", no_argument, 0, 'd', },
+		{ "idle-io", no_argument, 0, 'I', },
+		{ "journal", required_argument, 0, 'J', },
+		{ "max-iops", required_argument, 0, 'O', },
+		{ "max-read-bandwidth", required_argument, 0, 'W', },
+		{ "max-read-latency", required_argument, 0, 'L', },
+		{ "numa", optional_argument, 0, 'N', },
+		{ "partial-prefilter", optional_argument, 0, 'p', },
+		{ "progress", no_argument, 0, 'P', },
+		{ "reflink-reuse", no_argument, 0, 'r', },
+		{ "resume-appends", no_argument, 0, 'R', },
+		{ "shard", required_argument, 0, 'H', },
+		{ "shard-sizes", required_argument, 0, 'E', },
+		{ "sparse", no_argument, 0, 's', },
+		{ "stats-json", required_argument, 0, 'S', },
+		{ "two-tier", no_argument, 0, 't', },
+		{ "verify", required_argument, 0, 'V', },
+		{ "watch", optional_argument, 0, 'w', },
 		{ "xattr-cache-hash", no_argument, 0, 'x', },
+		{ "zstd", optional_argument, 0, 'Z', },
 		{ 0, 0, 0, 0, },
 	};
-	int xattr_cache_hash;
+	struct hash_options opts;
+	int binary;
+	int shard_index;
+	int shard_count;
+	int shard_subtree;
+	char *shard_sizes;
+	uint64_t shard_entries;
+	uint64_t max_bandwidth;
+	uint64_t max_iops;
+	int max_latency;
+	int idle_io;
+	char *verify_file;
+	struct verify *verify;
+	int watch_debounce;
+	struct watch *watch;
+	int zstd;
+	int zstd_level;
+	int zstd_threads;
+	char *cache_file;
+	int compact_cache;
+	int max_age_days;
+	char *dir_digests;
+	int dup_candidates_only;
+	int partial_prefilter;
+	off_t partial_head;
+	off_t partial_tail;
+	int two_tier;
+	int reflink;
+	int progress;
+	char *stats_file;
+	char *journal_file;
 	struct rlimit rlim;
 	struct iv_list_head files;
-	int i;
+	struct iv_list_head extra;
+	int scan_failed;
 
-	xattr_cache_hash = 0;
+	opts.xattr_cache_hash = 0;
+	opts.cache = NULL;
+	opts.sparse = 0;
+	opts.resume_appends = 0;
+	opts.numa_steer = 0;
+	opts.journal = NULL;
+	opts.binary = NULL;
+	opts.out = stdout;
+	opts.print_seq = 0;
+	opts.printed = NULL;
+	opts.result = NULL;
+	opts.result_cookie = NULL;
+	opts.hashed = NULL;
+	opts.hashed_cookie = NULL;
+	opts.threads = 0;
+	binary = 0;
+	shard_index = 0;
+	shard_count = 0;
+	shard_subtree = 0;
+	shard_sizes = NULL;
+	max_bandwidth = 0;
+	max_iops = 0;
+	max_latency = 0;
+	idle_io = 0;
+	verify_file = NULL;
+	verify = NULL;
+	watch_debounce = -1;
+	watch = NULL;
+	zstd = 0;
+	zstd_level = 3;
+	zstd_threads = 0;
+	cache_file = NULL;
+	compact_cache = 0;
+	max_age_days = 0;
+	dir_digests = NULL;
+	dup_candidates_only = 0;
+	partial_prefilter = 0;
+	partial_head = 65536;
+	partial_tail = 65536;
+	two_tier = 0;
+	reflink = 0;
+	progress = 0;
+	stats_file = NULL;
+	journal_file = NULL;
 
 	while (1) {
 		int c;
 
-		c = getopt_long(argc, argv, "x", long_options, NULL);
+		c = getopt_long(argc, argv, "c:drstx", long_options, NULL);
 		if (c == -1)
 			break;
 
 		switch (c) {
+		case 'B':
+			binary = 1;
+			break;
+
+		case 'c':
+			cache_file = optarg;
+			break;
+
+		case 'C':
+			compact_cache = 1;
+			if (optarg != NULL)
+				max_age_days = atoi(optarg);
+			break;
+
+		case 'd':
+			dup_candidates_only = 1;
+			break;
+
+		case 'D':
+			dir_digests = optarg;
+			break;
+
+		case 'E':
+			shard_sizes = optarg;
+			shard_subtree = 1;
+			break;
+
+		case 'H': {
+			char *end;
+
+			shard_index = strtol(optarg, &end, 10);
+			if (*end == '/')
+				shard_count = strtol(end + 1, &end, 10);
+
+			if (!strcmp(end, ",subtree")) {
+				shard_subtree = 1;
+			} else if (!strcmp(end, ",path")) {
+				shard_subtree = 0;
+			} else if (*end) {
+				shard_count = 0;
+			}
+
+			if (shard_count <= 0 || shard_index < 0 ||
+			    shard_index >= shard_count) {
+				fprintf(stderr, "%s: invalid shard: %s\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+		}
+
+		case 'I':
+			idle_io = 1;
+			break;
+
+		case 'J':
+			journal_file = optarg;
+			break;
+
+		case 'L':
+			max_latency = atoi(optarg);
+			if (max_latency <= 0) {
+				fprintf(stderr, "%s: invalid read latency "
+						"target: %s\n", argv[0], optarg);
+				return 1;
+			}
+			break;
+
+		case 'N':
+			if (optarg != NULL && strcmp(optarg, "steer")) {
+				fprintf(stderr, "%s: invalid --numa mode: "
+						"%s\n", argv[0], optarg);
+				return 1;
+			}
+
+			if (numa_init())
+				return 1;
+
+			opts.numa_steer = (optarg != NULL);
+			break;
+
+		case 'O':
+			max_iops = strtoull(optarg, NULL, 0);
+			if (max_iops == 0) {
+				fprintf(stderr, "%s: invalid IOPS limit: %s\n",
+					argv[0], optarg);
+				return 1;
+			}
+			break;
+
+		case 'p':
+			dup_candidates_only = 1;
+			partial_prefilter = 1;
+			if (optarg != NULL) {
+				char *end;
+
+				partial_head = strtoll(optarg, &end, 0);
+				partial_tail = partial_head;
+				if (*end == ',')
+					partial_tail = strtoll(end + 1, &end, 0);
+
+				if (*end || partial_head < 0 ||
+				    partial_tail < 0 ||
+				    partial_head + partial_tail == 0) {
+					fprintf(stderr, "%s: invalid partial "
+							"prefilter size: %s\n",
+						argv[0], optarg);
+					return 1;
+				}
+			}
+			break;
+
+		case 'P':
+			progress = 1;
+			break;
+
+		case 'r':
+			reflink = 1;
+			break;
+
+		case 'R':
+			opts.resume_appends = 1;
+			break;
+
+		case 's':
+			opts.sparse = 1;
+			break;
+
+		case 'S':
+			stats_file = optarg;
+			break;
+
+		case 't':
+			dup_candidates_only = 1;
+			two_tier = 1;
+			break;
+
+		case 'V':
+			verify_file = optarg;
+			break;
+
+		case 'W':
+			if (parse_bandwidth(optarg, &max_bandwidth)) {
+				fprintf(stderr, "%s: invalid bandwidth limit: "
+						"%s\n", argv[0], optarg);
+				return 1;
+			}
+			break;
+
+		case 'w':
+			watch_debounce = 500;
+			if (optarg != NULL) {
+				char *end;
+
+				watch_debounce = strtol(optarg, &end, 0);
+				if (*end || watch_debounce < 0) {
+					fprintf(stderr, "%s: invalid watch "
+							"debounce: %s\n",
+						argv[0], optarg);
+					return 1;
+				}
+			}
+			break;
+
 		case 'x':
-			xattr_cache_hash = 1;
+			opts.xattr_cache_hash = 1;
+			break;
+
+		case 'Z':
+			zstd = 1;
+			if (optarg != NULL) {
+				char *end;
+
+				zstd_level = strtol(optarg, &end, 0);
+				if (*end == ',')
+					zstd_threads = strtol(end + 1, &end, 0);
+
+				if (*end || zstd_threads < 0) {
+					fprintf(stderr, "%s: invalid zstd "
+							"parameters: %s\n",
+						argv[0], optarg);
+					return 1;
+				}
+			}
 			break;
 
 		case '?':
@@ -61,8 +363,33 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (argc == optind) {
-		fprintf(stderr, "%s: [--xattr-cache-hash] [dir]+\n", argv[0]);
+	if (compact_cache) {
+		if (cache_file == NULL) {
+			fprintf(stderr, "%s: --compact-cache needs "
+					"--cache-file\n", argv[0]);
+			return 1;
+		}
+
+		return hash_cache_compact(cache_file, max_age_days);
+	}
+
+	if (argc == optind && verify_file == NULL) {
+		fprintf(stderr, "%s: [--binary] [--cache-file=FILE] "
+				"[--compact-cache[=DAYS]] [--dir-digests=FILE] "
+				"[--dup-candidates-only] [--idle-io] "
+				"[--journal=FILE] [--max-iops=N] "
+				"[--max-read-bandwidth=BYTES[K|M|G]] "
+				"[--max-read-latency=MS] [--numa[=steer]] "
+				"[--partial-prefilter[=HEAD[,TAIL]]] "
+				"[--progress] "
+				"[--reflink-reuse] [--resume-appends] "
+				"[--shard=I/N[,path|subtree]] "
+				"[--shard-sizes=FILE] "
+				"[--sparse] [--stats-json=FILE] [--two-tier] "
+				"[--watch[=DEBOUNCE_MS]] [--xattr-cache-hash] "
+				"[--zstd[=LEVEL[,THREADS]]] [dir]+\n"
+				"       %s --verify=SUMFILE [options] [dir]*\n",
+			argv[0], argv[0]);
 		return 1;
 	}
 
@@ -79,18 +406,222 @@ int main(int argc, char *argv[])
 		setrlimit(RLIMIT_NOFILE, &rlim);
 	}
 
+	if (opts.resume_appends && !opts.xattr_cache_hash &&
+	    cache_file == NULL) {
+		fprintf(stderr, "%s: --resume-appends needs --cache-file or "
+				"--xattr-cache-hash\n", argv[0]);
+		return 1;
+	}
+
+	if (shard_sizes != NULL && !shard_count) {
+		fprintf(stderr, "%s: --shard-sizes needs --shard\n", argv[0]);
+		return 1;
+	}
+
+	if (shard_count && binary) {
+		fprintf(stderr, "%s: --shard output can't be --binary, "
+				"use mergesums --binary instead\n", argv[0]);
+		return 1;
+	}
+	opts.print_seq = !!shard_count;
+
+	if (watch_debounce >= 0 &&
+	    (binary || zstd || shard_count || dup_candidates_only)) {
+		fprintf(stderr, "%s: --watch can't be combined with --binary, "
+				"--zstd, --shard or prefiltering\n", argv[0]);
+		return 1;
+	}
+
+	/*
+	 * Verification must read every file, so anything that could
+	 * supply a hash without reading the file is out, and so is
+	 * anything that changes what gets hashed or printed.
+	 */
+	if (verify_file != NULL &&
+	    (binary || zstd || shard_count || watch_debounce >= 0 ||
+	     dup_candidates_only || reflink || cache_file != NULL ||
+	     opts.xattr_cache_hash || opts.resume_appends ||
+	     journal_file != NULL || opts.numa_steer)) {
+		fprintf(stderr, "%s: --verify can't be combined with caching, "
+				"journaling, output, prefilter, --shard, "
+				"--watch or --numa=steer options\n", argv[0]);
+		return 1;
+	}
+
+	if (dir_digests != NULL &&
+	    (shard_count || watch_debounce >= 0 || dup_candidates_only ||
+	     verify_file != NULL)) {
+		fprintf(stderr, "%s: --dir-digests needs all files hashed, "
+				"and can't be combined with --shard, --watch, "
+				"--verify or prefiltering\n", argv[0]);
+		return 1;
+	}
+
+	if (throttle_init(max_bandwidth, max_iops, max_latency, idle_io))
+		return 1;
+
+	if (cache_file != NULL) {
+		opts.cache = hash_cache_open(cache_file);
+		if (opts.cache == NULL)
+			return 1;
+	}
+
+	if (zstd) {
+		opts.out = compress_open(stdout, zstd_level, zstd_threads);
+		if (opts.out == NULL)
+			return 1;
+	}
+
+	if (journal_file != NULL) {
+		opts.journal = journal_open(journal_file);
+		if (opts.journal == NULL)
+			return 1;
+	}
+
+	if (verify_file != NULL) {
+		stats_phase_begin("verify_open");
+		verify = verify_open(verify_file, opts.out);
+		stats_phase_end();
+		if (verify == NULL)
+			return 1;
+
+		opts.result = verify_result;
+		opts.result_cookie = verify;
+	}
+
+	if (watch_debounce >= 0) {
+		watch = watch_open(argc - optind, argv + optind,
+				   watch_debounce);
+		if (watch == NULL)
+			return 1;
+
+		opts.hashed = watch_seed;
+		opts.hashed_cookie = watch;
+	}
+
+	if (stats_file != NULL)
+		stats_start();
+
+	if (progress)
+		progress_start();
+
 	INIT_IV_LIST_HEAD(&files);
+	INIT_IV_LIST_HEAD(&extra);
 
-	for (i = optind; i < argc; i++) {
-		if (scan_tree(&files, argv[i]))
-			return 0;
+	if (verify != NULL && argc == optind) {
+		stats_phase_begin("verify_build");
+		scan_failed = verify_build(verify, &files);
+		stats_phase_end();
+	} else {
+		stats_phase_begin("scan_tree");
+		scan_failed = scan_tree(&files, argc - optind, argv + optind,
+					dup_candidates_only || progress, 0);
+		stats_phase_end();
+
+		if (verify != NULL) {
+			stats_phase_begin("verify_match");
+			verify_match(verify, &files, &extra);
+			stats_phase_end();
+		}
 	}
 
+	if (opts.journal != NULL)
+		journal_scan_done(opts.journal, &files);
+
+	stats_phase_begin("find_hard_links");
 	find_hard_links(&files);
+	stats_phase_end();
+
+	if (dup_candidates_only) {
+		stats_phase_begin("prefilter_size");
+		prefilter_size(&files);
+		stats_phase_end();
+	}
+
+	if (partial_prefilter) {
+		stats_phase_begin("prefilter_partial");
+		prefilter_partial(&files, partial_head, partial_tail);
+		stats_phase_end();
+	}
+
+	if (two_tier) {
+		stats_phase_begin("prefilter_tier1");
+		prefilter_tier1(&files);
+		stats_phase_end();
+	}
+
+	if (reflink) {
+		stats_phase_begin("reflink_reuse");
+		reflink_reuse(&files);
+		stats_phase_end();
+	}
+
+	if (binary)
+		opts.binary = sumfile_writer_open(opts.out);
+
+	if (shard_count) {
+		stats_phase_begin("shard_files");
+		if (shard_files(&files, shard_index, shard_count,
+				shard_subtree, shard_sizes, opts.out))
+			return 1;
+		stats_phase_end();
+	}
+
+	if (shard_count)
+		opts.printed = &shard_entries;
+
+	stats_phase_begin("hash_chain");
+	if (hash_chain(&files, &opts))
+		scan_failed = 1;
+	else if (shard_count)
+		shard_end(shard_index, shard_count, shard_entries, opts.out);
+	stats_phase_end();
+
+	if (opts.binary != NULL && sumfile_writer_close(opts.binary))
+		scan_failed = 1;
+
+	if (opts.out != stdout && fclose(opts.out)) {
+		perror("zstd");
+		scan_failed = 1;
+	}
+
+	progress_stop();
+
+	if (dir_digests != NULL) {
+		stats_phase_begin("dir_digests");
+		if (dir_digests_write(&files, dir_digests))
+			scan_failed = 1;
+		stats_phase_end();
+	}
 
-	hash_chain(&files, xattr_cache_hash);
+	if (watch != NULL)
+		fflush(opts.out);
 
+	/*
+	 * Extra files share directories with the ones that were
+	 * verified, so they have to be freed as one chain.
+	 */
+	iv_list_splice_tail(&extra, &files);
 	free_file_chain(&files);
 
-	return 0;
+	if (watch != NULL) {
+		opts.hashed = NULL;
+		watch_run(watch, &opts);
+	}
+
+	throttle_report();
+
+	if (verify != NULL && verify_close(verify))
+		scan_failed = 1;
+
+	if (opts.cache != NULL)
+		hash_cache_close(opts.cache);
+
+	if (opts.journal != NULL)
+		journal_close(opts.journal);
+
+	if (stats_file != NULL && stats_write_json(stats_file, "mksums"))
+		return 1;
+
+	return scan_failed;
 }
@@ -28,14 +28,18 @@
 #include <string.h>
 #include <unistd.h>
 #include "mksums_common.h"
+#include "stats.h"
 
 int openat_try_noatime(int dirfd, const char *pathname, int flags)
 {
 	int fd;
 
+	stats_count(STATS_SYS_OPEN, 1);
 	fd = openat(dirfd, pathname, flags | O_RDONLY | O_NOFOLLOW | O_NOATIME);
-	if (fd < 0 && errno == EPERM)
+	if (fd < 0 && errno == EPERM) {
+		stats_count(STATS_SYS_OPEN, 1);
 		fd = openat(dirfd, pathname, flags | O_RDONLY | O_NOFOLLOW);
+	}
 
 	return fd;
 }
@@ -49,6 +53,26 @@ void print_dir_path(FILE *fp, struct dir *dir)
 	fprintf(fp, "%s", dir->name);
 }
 
+/*
+ * Like print_dir_path(), but formats into buf.  Returns the length of
+ * the full path, which may exceed len, like snprintf() does.
+ */
+int format_dir_path(char *buf, size_t len, struct dir *dir)
+{
+	int n;
+
+	n = 0;
+	if (dir->parent != NULL) {
+		n = format_dir_path(buf, len, dir->parent);
+		if (n < len)
+			buf[n] = '/';
+		n++;
+	}
+
+	return n + snprintf(buf + (n < len ? n : len),
+			    n < len ? len - n : 0, "%s", dir->name);
+}
+
 static void queue_free_dir(struct dir **dir_chain, struct dir *dir)
 {
 	if (dir->dirfd != -1) {
@@ -89,45 +113,167 @@ void free_file_chain(struct iv_list_head *files)
 	}
 }
 
-void run_threads(void *(*handler)(void *), void *cookie, int nthreads)
+/*
+ * All multi-threaded phases share one pool of long-lived worker
+ * threads.  run_threads() queues a job that runs a handler on nthreads
+ * workers, growing the pool so that every job in progress gets all of
+ * its workers, and waits for all of them to return.  Jobs can be run
+ * from several threads at once, for example by libmksums users with
+ * several contexts.  Workers get small stacks, so anything that runs
+ * on them must keep big buffers (read buffers, FIEMAP requests) on the
+ * heap and stay well below POOL_STACK_SIZE.
+ *
+ * Worker i belongs to NUMA node i % numa_nodes, and the nthreads slots
+ * of each job are spread round-robin over the nodes, so that every node
+ * gets its share of each phase.  Without --numa there is one node.
+ */
+#define POOL_STACK_SIZE		262144
+
+struct pool_job
+{
+	struct iv_list_head	list;
+	void			*(*handler)(void *);
+	void			*cookie;
+	int			to_start[NUMA_MAX_NODES];
+	int			running;
+	pthread_cond_t		done;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static int pool_threads;
+static int pool_wanted;
+static struct iv_list_head pool_jobs = IV_LIST_HEAD_INIT(pool_jobs);
+
+static struct pool_job *pool_find_job(int node)
+{
+	struct iv_list_head *lh;
+
+	iv_list_for_each (lh, &pool_jobs) {
+		struct pool_job *job;
+
+		job = iv_container_of(lh, struct pool_job, list);
+		if (job->to_start[node])
+			return job;
+	}
+
+	return NULL;
+}
+
+static void *pool_thread(void *_node)
+{
+	int node = (intptr_t)_node;
+
+	numa_bind_thread(node);
+
+	pthread_mutex_lock(&pool_lock);
+
+	while (1) {
+		struct pool_job *job;
+
+		job = pool_find_job(node);
+		if (job == NULL) {
+			pthread_cond_wait(&pool_work, &pool_lock);
+			continue;
+		}
+
+		job->to_start[node]--;
+
+		pthread_mutex_unlock(&pool_lock);
+		job->handler(job->cookie);
+		pthread_mutex_lock(&pool_lock);
+
+		if (!--job->running)
+			pthread_cond_signal(&job->done);
+	}
+
+	return NULL;
+}
+
+static int pool_grow(int nthreads)
 {
 	pthread_attr_t attr;
 	int ret;
-	pthread_t tid[nthreads];
-	int i;
+
+	if (pool_threads >= nthreads)
+		return 0;
 
 	ret = pthread_attr_init(&attr);
 	if (ret) {
 		fprintf(stderr, "pthread_attr_init: %s\n", strerror(ret));
-		exit(1);
+		return 1;
 	}
 
-	ret = pthread_attr_setstacksize(&attr, 536870912);
+	ret = pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
 	if (ret) {
 		fprintf(stderr, "pthread_attr_setstacksize: %s\n",
 			strerror(ret));
-		exit(1);
+		goto out;
+	}
+
+	ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (ret) {
+		fprintf(stderr, "pthread_attr_setdetachstate: %s\n",
+			strerror(ret));
+		goto out;
 	}
 
-	for (i = 0; i < nthreads; i++) {
-		ret = pthread_create(tid + i, &attr, handler, cookie);
+	while (pool_threads < nthreads) {
+		pthread_t tid;
+
+		ret = pthread_create(&tid, &attr, pool_thread,
+				     (void *)(intptr_t)(pool_threads % numa_nodes));
 		if (ret) {
 			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
-			exit(1);
+			goto out;
 		}
-	}
 
-	ret = pthread_attr_destroy(&attr);
-	if (ret) {
-		fprintf(stderr, "pthread_attr_destroy: %s\n", strerror(ret));
-		exit(1);
+		pool_threads++;
 	}
 
-	for (i = 0; i < nthreads; i++) {
-		ret = pthread_join(tid[i], NULL);
-		if (ret) {
-			fprintf(stderr, "pthread_join: %s\n", strerror(ret));
-			exit(1);
-		}
+out:
+	pthread_attr_destroy(&attr);
+
+	return !!ret;
+}
+
+/*
+ * Returns nonzero, without running the handler at all, if the pool
+ * can't be grown to give the job nthreads workers.
+ */
+int run_threads(void *(*handler)(void *), void *cookie, int nthreads)
+{
+	struct pool_job job;
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+
+	if (pool_grow(pool_wanted + nthreads)) {
+		pthread_mutex_unlock(&pool_lock);
+		return 1;
 	}
+	pool_wanted += nthreads;
+
+	job.handler = handler;
+	job.cookie = cookie;
+	memset(job.to_start, 0, sizeof(job.to_start));
+	for (i = 0; i < nthreads; i++)
+		job.to_start[i % numa_nodes]++;
+	job.running = nthreads;
+	pthread_cond_init(&job.done, NULL);
+
+	iv_list_add_tail(&job.list, &pool_jobs);
+	pthread_cond_broadcast(&pool_work);
+
+	while (job.running)
+		pthread_cond_wait(&job.done, &pool_lock);
+
+	iv_list_del(&job.list);
+	pool_wanted -= nthreads;
+
+	pthread_mutex_unlock(&pool_lock);
+
+	pthread_cond_destroy(&job.done);
+
+	return 0;
 }
@@ -22,12 +22,18 @@
 
 #include <dirent.h>
 #include <iv_list.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
+#define NUMA_MAX_NODES		64
+
 struct dir
 {
 	struct dir		*parent;
 	int			dirfd;
+	dev_t			st_dev;
 	char			name[0];
 };
 
@@ -36,6 +42,7 @@ enum state {
 	STATE_BACKREF,
 	STATE_OK,
 	STATE_FAILED,
+	STATE_SKIPPED,
 };
 
 struct file_to_hash
@@ -44,6 +51,9 @@ struct file_to_hash
 	struct dir		*dir;
 	ino_t			d_ino;
 	enum state		state;
+	int			node;
+	off_t			st_size;
+	uint8_t			prefilter[16];
 	union {
 		uint8_t			hash[64];
 		struct file_to_hash	*backref;
@@ -51,20 +61,130 @@ struct file_to_hash
 	char			d_name[0];
 };
 
+struct hash_options
+{
+	int			xattr_cache_hash;
+	struct hash_cache	*cache;
+	int			sparse;
+	int			resume_appends;
+	int			numa_steer;
+	struct journal		*journal;
+	struct sumfile_writer	*binary;
+	FILE			*out;
+	int			print_seq;
+	uint64_t		*printed;
+	void			(*result)(void *cookie,
+					  struct file_to_hash *fh,
+					  const uint8_t *hash);
+	void			*result_cookie;
+	void			(*hashed)(void *cookie,
+					  struct file_to_hash *fh,
+					  const uint8_t *hash,
+					  const struct stat *st);
+	void			*hashed_cookie;
+	int			threads;
+};
+
+struct sha512_midstate
+{
+	uint64_t		length;
+	uint64_t		h[8];
+	uint8_t			check[16];
+};
+
+/* dir_digests.c */
+int dir_digests_write(struct iv_list_head *files, const char *file);
+
 /* find_hard_links.c */
 void find_hard_links(struct iv_list_head *files);
 
+/* hash_cache.c */
+struct hash_cache *hash_cache_open(const char *path);
+void hash_cache_close(struct hash_cache *hc);
+int hash_cache_lookup(struct hash_cache *hc, int fd, const struct stat *buf,
+		      uint8_t *hash);
+int hash_cache_lookup_midstate(struct hash_cache *hc, int fd,
+			       const struct stat *buf,
+			       struct sha512_midstate *ms);
+void hash_cache_insert(struct hash_cache *hc, int fd, const struct stat *buf,
+		       const uint8_t *hash, const struct sha512_midstate *ms);
+int hash_cache_compact(const char *path, int max_age_days);
+
 /* hash_chain.c */
-void hash_chain(struct iv_list_head *files, int xattr_cache_hash);
+int hash_chain(struct iv_list_head *files, const struct hash_options *opts);
+int hash_one_file(struct file_to_hash *fh, const struct hash_options *opts);
+
+/* journal.c */
+struct journal *journal_open(const char *path);
+void journal_close(struct journal *j);
+int journal_lookup(struct journal *j, struct file_to_hash *fh,
+		   const struct stat *buf, uint8_t *hash);
+void journal_record(struct journal *j, struct file_to_hash *fh,
+		    const struct stat *buf, const uint8_t *hash);
+void journal_scan_done(struct journal *j, struct iv_list_head *files);
 
 /* mksums_common.c */
 int openat_try_noatime(int dirfd, const char *pathname, int flags);
 void print_dir_path(FILE *fp, struct dir *dir);
+int format_dir_path(char *buf, size_t len, struct dir *dir);
 void free_file_chain(struct iv_list_head *files);
-void run_threads(void *(*handler)(void *), void *cookie, int nthreads);
+int run_threads(void *(*handler)(void *), void *cookie, int nthreads);
+
+/* numa.c */
+extern int numa_enabled;
+extern int numa_nodes;
+int numa_init(void);
+void numa_bind_thread(int node);
+int numa_current_node(void);
+int numa_node_id(int node);
+int numa_dev_node(dev_t dev);
+
+/* prefilter.c */
+void prefilter_size(struct iv_list_head *files);
+void prefilter_partial(struct iv_list_head *files, off_t head, off_t tail);
+void prefilter_tier1(struct iv_list_head *files);
+void reflink_reuse(struct iv_list_head *files);
+
+/* progress.c */
+extern int progress_enabled;
+void progress_start(void);
+void progress_stop(void);
+void progress_dir_scanned(int files, uint64_t bytes);
+void progress_scan_queue(int depth);
+void progress_hash_start(uint64_t files, uint64_t bytes);
+void progress_file_hashed(uint64_t bytes);
 
 /* scan_tree.c */
-int scan_tree(struct iv_list_head *files, char *root_name);
+int scan_tree(struct iv_list_head *files, int num_roots, char *root_name[],
+	      int stat_files, int nthreads);
+
+/* shard.c */
+int shard_files(struct iv_list_head *files, int index, int count,
+		int subtree, const char *estimate_file, FILE *out);
+void shard_end(int index, int count, uint64_t entries, FILE *out);
+
+/* throttle.c */
+extern int throttle_enabled;
+int throttle_init(uint64_t bandwidth, uint64_t iops, int latency_ms,
+		  int idle);
+uint64_t throttle_start(void);
+void throttle_io(uint64_t start, size_t bytes);
+void throttle_report(void);
+
+/* verify.c */
+struct verify *verify_open(const char *file, FILE *out);
+int verify_build(struct verify *v, struct iv_list_head *files);
+void verify_match(struct verify *v, struct iv_list_head *files,
+		  struct iv_list_head *extra);
+void verify_result(void *cookie, struct file_to_hash *fh,
+		   const uint8_t *hash);
+int verify_close(struct verify *v);
+
+/* watch.c */
+struct watch *watch_open(int num_roots, char *roots[], int debounce);
+void watch_seed(void *cookie, struct file_to_hash *fh,
+		const uint8_t *hash, const struct stat *st);
+void watch_run(struct watch *w, const struct hash_options *opts);
 
 
 #endif
@@ -0,0 +1,188 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Streaming implementation of MurmurHash3_x64_128, which was placed
+ * in the public domain by Austin Appleby.
+ */
+
+#include <string.h>
+#include "murmur3.h"
+
+#define C1	0x87c37b91114253d5ULL
+#define C2	0x4cf5ad432745937fULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+	return ((uint64_t)p[0]) | (((uint64_t)p[1]) << 8) |
+	       (((uint64_t)p[2]) << 16) | (((uint64_t)p[3]) << 24) |
+	       (((uint64_t)p[4]) << 32) | (((uint64_t)p[5]) << 40) |
+	       (((uint64_t)p[6]) << 48) | (((uint64_t)p[7]) << 56);
+}
+
+static inline void put_le64(uint8_t *p, uint64_t x)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (x >> (8 * i)) & 0xff;
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+static inline void do_block(struct murmur3_ctx *c, const uint8_t *p)
+{
+	uint64_t k1;
+	uint64_t k2;
+
+	k1 = get_le64(p);
+	k2 = get_le64(p + 8);
+
+	k1 *= C1;
+	k1 = rotl64(k1, 31);
+	k1 *= C2;
+	c->h1 ^= k1;
+
+	c->h1 = rotl64(c->h1, 27);
+	c->h1 += c->h2;
+	c->h1 = c->h1 * 5 + 0x52dce729;
+
+	k2 *= C2;
+	k2 = rotl64(k2, 33);
+	k2 *= C1;
+	c->h2 ^= k2;
+
+	c->h2 = rotl64(c->h2, 31);
+	c->h2 += c->h1;
+	c->h2 = c->h2 * 5 + 0x38495ab5;
+}
+
+void murmur3_init(struct murmur3_ctx *c, uint64_t seed)
+{
+	c->h1 = seed;
+	c->h2 = seed;
+	c->len = 0;
+	c->buflen = 0;
+}
+
+void murmur3_update(struct murmur3_ctx *c, const uint8_t *data, size_t len)
+{
+	c->len += len;
+
+	if (c->buflen) {
+		size_t tocopy;
+
+		tocopy = sizeof(c->buf) - c->buflen;
+		if (tocopy > len)
+			tocopy = len;
+
+		memcpy(c->buf + c->buflen, data, tocopy);
+		c->buflen += tocopy;
+		data += tocopy;
+		len -= tocopy;
+
+		if (c->buflen < sizeof(c->buf))
+			return;
+
+		do_block(c, c->buf);
+		c->buflen = 0;
+	}
+
+	while (len >= 16) {
+		do_block(c, data);
+		data += 16;
+		len -= 16;
+	}
+
+	if (len) {
+		memcpy(c->buf, data, len);
+		c->buflen = len;
+	}
+}
+
+void murmur3_final(struct murmur3_ctx *c, uint8_t *digest)
+{
+	const uint8_t *tail = c->buf;
+	uint64_t k1;
+	uint64_t k2;
+	uint64_t h1;
+	uint64_t h2;
+
+	h1 = c->h1;
+	h2 = c->h2;
+
+	k1 = 0;
+	k2 = 0;
+
+	switch (c->buflen) {
+	case 15: k2 ^= ((uint64_t)tail[14]) << 48;
+	case 14: k2 ^= ((uint64_t)tail[13]) << 40;
+	case 13: k2 ^= ((uint64_t)tail[12]) << 32;
+	case 12: k2 ^= ((uint64_t)tail[11]) << 24;
+	case 11: k2 ^= ((uint64_t)tail[10]) << 16;
+	case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;
+	case  9: k2 ^= ((uint64_t)tail[ 8]) << 0;
+		 k2 *= C2;
+		 k2 = rotl64(k2, 33);
+		 k2 *= C1;
+		 h2 ^= k2;
+
+	case  8: k1 ^= ((uint64_t)tail[ 7]) << 56;
+	case  7: k1 ^= ((uint64_t)tail[ 6]) << 48;
+	case  6: k1 ^= ((uint64_t)tail[ 5]) << 40;
+	case  5: k1 ^= ((uint64_t)tail[ 4]) << 32;
+	case  4: k1 ^= ((uint64_t)tail[ 3]) << 24;
+	case  3: k1 ^= ((uint64_t)tail[ 2]) << 16;
+	case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;
+	case  1: k1 ^= ((uint64_t)tail[ 0]) << 0;
+		 k1 *= C1;
+		 k1 = rotl64(k1, 31);
+		 k1 *= C2;
+		 h1 ^= k1;
+	}
+
+	h1 ^= c->len;
+	h2 ^= c->len;
+
+	h1 += h2;
+	h2 += h1;
+
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+
+	h1 += h2;
+	h2 += h1;
+
+	put_le64(digest, h1);
+	put_le64(digest + 8, h2);
+}
@@ -0,0 +1,40 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __MURMUR3_H
+#define __MURMUR3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct murmur3_ctx
+{
+	uint64_t		h1;
+	uint64_t		h2;
+	uint64_t		len;
+	uint8_t			buf[16];
+	int			buflen;
+};
+
+void murmur3_init(struct murmur3_ctx *c, uint64_t seed);
+void murmur3_update(struct murmur3_ctx *c, const uint8_t *data, size_t len);
+void murmur3_final(struct murmur3_ctx *c, uint8_t *digest);
+
+
+#endif
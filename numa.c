@@ -0,0 +1,231 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include "mksums_common.h"
+
+/*
+ * NUMA topology comes straight from sysfs, so no libnuma is needed.
+ * Each enabled node gets the set of CPUs it contains; pool workers are
+ * pinned to the CPUs of one node and given a preferred-local memory
+ * policy, so that their stacks, read buffers and digest contexts are
+ * first touched, and therefore allocated, on that node.
+ */
+int numa_enabled;
+int numa_nodes = 1;
+
+static int node_id[NUMA_MAX_NODES];
+static cpu_set_t node_cpus[NUMA_MAX_NODES];
+static __thread int current_node;
+
+static int read_sysfs(const char *path, char *buf, size_t len)
+{
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 1;
+
+	if (fgets(buf, len, fp) == NULL) {
+		fclose(fp);
+		return 1;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+/*
+ * Calls cb for every number in a sysfs list such as "0-3,8,10-11".
+ */
+static void parse_list(char *list, void (*cb)(void *cookie, int n),
+		       void *cookie)
+{
+	char *p;
+
+	p = list;
+	while (*p >= '0' && *p <= '9') {
+		int from;
+		int to;
+
+		from = strtol(p, &p, 10);
+		to = from;
+		if (*p == '-')
+			to = strtol(p + 1, &p, 10);
+
+		for (; from <= to; from++)
+			cb(cookie, from);
+
+		if (*p == ',')
+			p++;
+	}
+}
+
+static void add_node(void *cookie, int node)
+{
+	if (numa_nodes < NUMA_MAX_NODES)
+		node_id[numa_nodes++] = node;
+}
+
+static void add_cpu(void *cookie, int cpu)
+{
+	CPU_SET(cpu, (cpu_set_t *)cookie);
+}
+
+int numa_init(void)
+{
+	char buf[4096];
+	int i;
+
+	if (read_sysfs("/sys/devices/system/node/online", buf, sizeof(buf))) {
+		fprintf(stderr, "numa: can't read node topology\n");
+		return 1;
+	}
+
+	numa_nodes = 0;
+	parse_list(buf, add_node, NULL);
+
+	for (i = 0; i < numa_nodes; i++) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", node_id[i]);
+
+		CPU_ZERO(&node_cpus[i]);
+		if (!read_sysfs(path, buf, sizeof(buf)))
+			parse_list(buf, add_cpu, &node_cpus[i]);
+
+		if (!CPU_COUNT(&node_cpus[i])) {
+			memmove(node_id + i, node_id + i + 1,
+				(numa_nodes - i - 1) * sizeof(*node_id));
+			numa_nodes--;
+			i--;
+		}
+	}
+
+	if (!numa_nodes) {
+		fprintf(stderr, "numa: no nodes with CPUs found\n");
+		numa_nodes = 1;
+		return 1;
+	}
+
+	numa_enabled = 1;
+
+	return 0;
+}
+
+void numa_bind_thread(int node)
+{
+	unsigned long mask[(NUMA_MAX_NODES + 8 * sizeof(long) - 1) /
+			   (8 * sizeof(long))];
+	int ret;
+
+	current_node = node;
+
+	if (!numa_enabled)
+		return;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+				     &node_cpus[node]);
+	if (ret)
+		fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(ret));
+
+	memset(mask, 0, sizeof(mask));
+	mask[node_id[node] / (8 * sizeof(long))] |=
+		1UL << (node_id[node] % (8 * sizeof(long)));
+
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+		    8 * sizeof(mask) + 1) < 0 && errno != ENOSYS) {
+		perror("set_mempolicy");
+	}
+}
+
+int numa_current_node(void)
+{
+	return current_node;
+}
+
+int numa_node_id(int node)
+{
+	return node_id[node];
+}
+
+static int sysfs_numa_node(const char *dir)
+{
+	char path[PATH_MAX + 16];
+	char buf[32];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/numa_node", dir);
+	if (read_sysfs(path, buf, sizeof(buf)))
+		return -1;
+
+	for (i = 0; i < numa_nodes; i++) {
+		if (node_id[i] == atoi(buf))
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Maps a block device to the node its controller hangs off, by walking
+ * up its sysfs device path until some ancestor (typically the PCI
+ * function) has a numa_node attribute.  Returns -1 if unknown, e.g. for
+ * network or virtual filesystems.
+ */
+int numa_dev_node(dev_t dev)
+{
+	char path[PATH_MAX];
+	char real[PATH_MAX];
+	char *p;
+
+	if (!numa_enabled || numa_nodes == 1)
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+		 major(dev), minor(dev));
+	if (realpath(path, real) == NULL)
+		return -1;
+
+	while ((p = strrchr(real, '/')) != NULL && p != real) {
+		int node;
+
+		node = sysfs_numa_node(real);
+		if (node >= 0)
+			return node;
+
+		*p = 0;
+	}
+
+	return -1;
+}
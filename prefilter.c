@@ -0,0 +1,570 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <linux/fiemap.h>
+#include <openssl/sha.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "extents.h"
+#include "mksums_common.h"
+#include "murmur3.h"
+#include "stats.h"
+
+static struct file_to_hash **collect_candidates(struct iv_list_head *files,
+						int *num)
+{
+	struct file_to_hash **v;
+	struct iv_list_head *lh;
+	int n;
+
+	n = 0;
+	iv_list_for_each (lh, files) {
+		struct file_to_hash *fh;
+
+		fh = iv_container_of(lh, struct file_to_hash, list);
+		if (fh->state == STATE_NOTYET)
+			n++;
+	}
+
+	v = malloc((n ? n : 1) * sizeof(*v));
+	if (v == NULL)
+		abort();
+
+	n = 0;
+	iv_list_for_each (lh, files) {
+		struct file_to_hash *fh;
+
+		fh = iv_container_of(lh, struct file_to_hash, list);
+		if (fh->state == STATE_NOTYET)
+			v[n++] = fh;
+	}
+
+	*num = n;
+
+	return v;
+}
+
+static void skip_singletons(struct file_to_hash **v, int num,
+			    int (*compare)(const void *, const void *))
+{
+	int i;
+
+	qsort(v, num, sizeof(*v), compare);
+
+	i = 0;
+	while (i < num) {
+		int j;
+
+		for (j = i + 1; j < num; j++) {
+			if (compare(v + i, v + j))
+				break;
+		}
+
+		if (j == i + 1 || v[i]->st_size <= 0) {
+			for (; i < j; i++)
+				v[i]->state = STATE_SKIPPED;
+		}
+
+		i = j;
+	}
+}
+
+static int compare_sizes(const void *_a, const void *_b)
+{
+	const struct file_to_hash *a = *((struct file_to_hash **)_a);
+	const struct file_to_hash *b = *((struct file_to_hash **)_b);
+
+	if (a->st_size < b->st_size)
+		return -1;
+	if (a->st_size > b->st_size)
+		return 1;
+
+	return 0;
+}
+
+void prefilter_size(struct iv_list_head *files)
+{
+	struct file_to_hash **v;
+	int num;
+
+	v = collect_candidates(files, &num);
+	skip_singletons(v, num, compare_sizes);
+	free(v);
+}
+
+
+struct prefilter_state
+{
+	struct file_to_hash	**v;
+	int			num;
+	char			*ok;
+	int			(*digest)(struct prefilter_state *ps,
+					  struct file_to_hash *fh, uint8_t *buf);
+	size_t			buf_size;
+	off_t			head;
+	off_t			tail;
+	int			keep_groups;
+
+	pthread_mutex_t		lock;
+	int			next;
+};
+
+static void *prefilter_thread(void *cookie)
+{
+	struct prefilter_state *ps = cookie;
+	uint8_t *buf;
+
+	buf = malloc(ps->buf_size);
+	if (buf == NULL)
+		abort();
+
+	pthread_mutex_lock(&ps->lock);
+
+	while (ps->next < ps->num) {
+		int i;
+
+		i = ps->next++;
+
+		pthread_mutex_unlock(&ps->lock);
+		ps->ok[i] = !ps->digest(ps, ps->v[i], buf);
+		pthread_mutex_lock(&ps->lock);
+	}
+
+	pthread_mutex_unlock(&ps->lock);
+
+	free(buf);
+
+	return NULL;
+}
+
+static int compare_offs(const void *_a, const void *_b)
+{
+	const off_t *a = _a;
+	const off_t *b = _b;
+
+	if (*a < *b)
+		return -1;
+	if (*a > *b)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * A file whose prefilter digest can't be computed stays a candidate
+ * for full hashing.  With keep_groups set, so do all other files of
+ * its size, as they can't be told apart from it without hashing, and
+ * skipping them as singletons would lose the duplicate.
+ */
+static void drop_failed_groups(struct prefilter_state *ps)
+{
+	off_t *failed;
+	int num_failed;
+	int i;
+
+	failed = malloc(ps->num * sizeof(*failed));
+	if (failed == NULL)
+		abort();
+
+	num_failed = 0;
+	for (i = 0; i < ps->num; i++) {
+		if (!ps->ok[i])
+			failed[num_failed++] = ps->v[i]->st_size;
+	}
+
+	if (num_failed) {
+		qsort(failed, num_failed, sizeof(*failed), compare_offs);
+
+		for (i = 0; i < ps->num; i++) {
+			if (ps->ok[i] &&
+			    bsearch(&ps->v[i]->st_size, failed, num_failed,
+				    sizeof(*failed), compare_offs) != NULL) {
+				ps->ok[i] = 0;
+			}
+		}
+	}
+
+	free(failed);
+}
+
+static void run_prefilter(struct prefilter_state *ps)
+{
+	int i;
+	int j;
+
+	ps->ok = malloc(ps->num ? ps->num : 1);
+	if (ps->ok == NULL)
+		abort();
+	pthread_mutex_init(&ps->lock, NULL);
+	ps->next = 0;
+
+	if (ps->num && run_threads(prefilter_thread, ps,
+				   2 * sysconf(_SC_NPROCESSORS_ONLN))) {
+		exit(1);
+	}
+
+	pthread_mutex_destroy(&ps->lock);
+
+	if (ps->keep_groups && ps->num)
+		drop_failed_groups(ps);
+
+	j = 0;
+	for (i = 0; i < ps->num; i++) {
+		if (ps->ok[i])
+			ps->v[j++] = ps->v[i];
+	}
+	ps->num = j;
+
+	free(ps->ok);
+}
+
+static int compare_prefilter_digests(const void *_a, const void *_b)
+{
+	const struct file_to_hash *a = *((struct file_to_hash **)_a);
+	const struct file_to_hash *b = *((struct file_to_hash **)_b);
+	int ret;
+
+	ret = compare_sizes(_a, _b);
+	if (ret)
+		return ret;
+
+	return memcmp(a->prefilter, b->prefilter, sizeof(a->prefilter));
+}
+
+static int read_range(int fd, uint8_t *buf, off_t off, off_t len)
+{
+	while (len) {
+		uint64_t start;
+		ssize_t ret;
+
+		start = throttle_start();
+		stats_count(STATS_SYS_PREAD, 1);
+		ret = pread(fd, buf, len, off);
+		if (ret < 0) {
+			perror("pread");
+			return 1;
+		}
+		stats_count(STATS_BYTES_READ, ret);
+		throttle_io(start, ret);
+
+		if (ret == 0)
+			return 1;
+
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int digest_partial(struct prefilter_state *ps,
+			  struct file_to_hash *fh, uint8_t *buf)
+{
+	int fd;
+	SHA512_CTX c;
+	uint8_t digest[64];
+
+	fd = openat_try_noatime(fh->dir->dirfd, fh->d_name, 0);
+	if (fd < 0)
+		return 1;
+
+	SHA512_Init(&c);
+
+	if (read_range(fd, buf, 0, ps->head)) {
+		close(fd);
+		return 1;
+	}
+	SHA512_Update(&c, buf, ps->head);
+
+	if (read_range(fd, buf, fh->st_size - ps->tail, ps->tail)) {
+		close(fd);
+		return 1;
+	}
+	SHA512_Update(&c, buf, ps->tail);
+
+	SHA512_Final(digest, &c);
+
+	memcpy(fh->prefilter, digest, sizeof(fh->prefilter));
+
+	close(fd);
+
+	return 0;
+}
+
+void prefilter_partial(struct iv_list_head *files, off_t head, off_t tail)
+{
+	struct prefilter_state ps;
+	int i;
+	int j;
+
+	ps.v = collect_candidates(files, &ps.num);
+
+	j = 0;
+	for (i = 0; i < ps.num; i++) {
+		if (ps.v[i]->st_size > head + tail)
+			ps.v[j++] = ps.v[i];
+	}
+	ps.num = j;
+
+	ps.digest = digest_partial;
+	ps.buf_size = head > tail ? head : tail;
+	ps.head = head;
+	ps.tail = tail;
+	ps.keep_groups = 1;
+	run_prefilter(&ps);
+
+	skip_singletons(ps.v, ps.num, compare_prefilter_digests);
+
+	free(ps.v);
+}
+
+static int digest_tier1(struct prefilter_state *ps,
+			struct file_to_hash *fh, uint8_t *buf)
+{
+	int fd;
+	struct murmur3_ctx c;
+
+	fd = openat_try_noatime(fh->dir->dirfd, fh->d_name, 0);
+	if (fd < 0)
+		return 1;
+
+	murmur3_init(&c, 0);
+
+	while (1) {
+		uint64_t start;
+		ssize_t ret;
+
+		start = throttle_start();
+		stats_count(STATS_SYS_READ, 1);
+		ret = read(fd, buf, ps->buf_size);
+		if (ret < 0) {
+			perror("read");
+			close(fd);
+			return 1;
+		}
+		stats_count(STATS_BYTES_READ, ret);
+		throttle_io(start, ret);
+
+		if (ret == 0)
+			break;
+
+		murmur3_update(&c, buf, ret);
+	}
+
+	murmur3_final(&c, fh->prefilter);
+
+	close(fd);
+
+	return 0;
+}
+
+void prefilter_tier1(struct iv_list_head *files)
+{
+	struct prefilter_state ps;
+
+	ps.v = collect_candidates(files, &ps.num);
+	ps.digest = digest_tier1;
+	ps.buf_size = 1048576;
+	ps.keep_groups = 1;
+	run_prefilter(&ps);
+
+	skip_singletons(ps.v, ps.num, compare_prefilter_digests);
+
+	free(ps.v);
+}
+
+
+/*
+ * Physical block numbers only mean something within one filesystem,
+ * so the device is mixed into the extent fingerprint, and checked
+ * again before a digest is actually reused.
+ */
+static int digest_extents(struct prefilter_state *ps,
+			  struct file_to_hash *fh, uint8_t *buf)
+{
+	int fd;
+	struct stat statbuf;
+	struct iv_avl_tree extents;
+	uint64_t fp;
+	int ret;
+
+	fd = openat_try_noatime(fh->dir->dirfd, fh->d_name, 0);
+	if (fd < 0)
+		return 1;
+
+	stats_count(STATS_SYS_FSTAT, 1);
+	if (fstat(fd, &statbuf) < 0) {
+		close(fd);
+		return 1;
+	}
+	fh->st_size = statbuf.st_size;
+
+	ret = 1;
+	if (fh->st_size > 0) {
+		if (!extent_tree_build(&extents, fd, FIEMAP_FLAG_SYNC) &&
+		    !extent_tree_fingerprint(&extents, &fp)) {
+			fp ^= (uint64_t)statbuf.st_dev * 0x9e3779b97f4a7c15ULL;
+			memset(fh->prefilter, 0, sizeof(fh->prefilter));
+			memcpy(fh->prefilter, &fp, sizeof(fp));
+			ret = 0;
+		}
+		extent_tree_free(&extents);
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+static int open_extents(struct file_to_hash *fh, struct iv_avl_tree *extents,
+			dev_t *dev)
+{
+	int fd;
+	struct stat statbuf;
+	int ret;
+
+	fd = openat_try_noatime(fh->dir->dirfd, fh->d_name, 0);
+	if (fd < 0)
+		return 1;
+
+	stats_count(STATS_SYS_FSTAT, 1);
+	if (fstat(fd, &statbuf) < 0) {
+		close(fd);
+		return 1;
+	}
+	*dev = statbuf.st_dev;
+
+	ret = extent_tree_build(extents, fd, FIEMAP_FLAG_SYNC);
+	if (ret)
+		extent_tree_free(extents);
+
+	close(fd);
+
+	return ret;
+}
+
+static int same_extent_fp(const void *_a, const void *_b)
+{
+	const struct file_to_hash *a = *((struct file_to_hash **)_a);
+	const struct file_to_hash *b = *((struct file_to_hash **)_b);
+	int ret;
+
+	ret = compare_sizes(_a, _b);
+	if (ret)
+		return ret;
+
+	return memcmp(a->prefilter, b->prefilter, sizeof(uint64_t));
+}
+
+static int compare_extent_fps(const void *_a, const void *_b)
+{
+	const struct file_to_hash *a = *((struct file_to_hash **)_a);
+	const struct file_to_hash *b = *((struct file_to_hash **)_b);
+	uint64_t aidx;
+	uint64_t bidx;
+	int ret;
+
+	ret = same_extent_fp(_a, _b);
+	if (ret)
+		return ret;
+
+	memcpy(&aidx, a->prefilter + sizeof(uint64_t), sizeof(aidx));
+	memcpy(&bidx, b->prefilter + sizeof(uint64_t), sizeof(bidx));
+
+	if (aidx < bidx)
+		return -1;
+	if (aidx > bidx)
+		return 1;
+
+	return 0;
+}
+
+void reflink_reuse(struct iv_list_head *files)
+{
+	struct prefilter_state ps;
+	int i;
+
+	ps.v = collect_candidates(files, &ps.num);
+	ps.digest = digest_extents;
+	ps.buf_size = 1;
+	ps.keep_groups = 0;
+	run_prefilter(&ps);
+
+	for (i = 0; i < ps.num; i++) {
+		uint64_t idx = i;
+
+		memcpy(ps.v[i]->prefilter + sizeof(uint64_t), &idx,
+		       sizeof(idx));
+	}
+
+	qsort(ps.v, ps.num, sizeof(*ps.v), compare_extent_fps);
+
+	i = 0;
+	while (i < ps.num) {
+		struct file_to_hash *leader;
+		struct iv_avl_tree lext;
+		dev_t ldev;
+		int j;
+		int k;
+
+		leader = ps.v[i];
+
+		for (j = i + 1; j < ps.num; j++) {
+			if (same_extent_fp(ps.v + i, ps.v + j))
+				break;
+		}
+
+		if (j == i + 1 || open_extents(leader, &lext, &ldev)) {
+			i = j;
+			continue;
+		}
+
+		for (k = i + 1; k < j; k++) {
+			struct file_to_hash *fh = ps.v[k];
+			struct iv_avl_tree ext;
+			dev_t dev;
+
+			if (open_extents(fh, &ext, &dev))
+				continue;
+
+			if (dev == ldev &&
+			    !extent_tree_diff(&lext, 0, &ext, 0,
+					      leader->st_size)) {
+				fh->state = STATE_BACKREF;
+				fh->backref = leader;
+			}
+
+			extent_tree_free(&ext);
+		}
+
+		extent_tree_free(&lext);
+
+		i = j;
+	}
+
+	free(ps.v);
+}
@@ -0,0 +1,39 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "probes.h"
+
+#ifdef HAVE_SYS_SDT_H
+
+#define SEMAPHORE	__attribute__((section(".probes")))
+
+unsigned short mksums_dir_pick_semaphore SEMAPHORE;
+unsigned short mksums_dir_scan_start_semaphore SEMAPHORE;
+unsigned short mksums_dir_scan_done_semaphore SEMAPHORE;
+unsigned short mksums_file_open_semaphore SEMAPHORE;
+unsigned short mksums_file_read_semaphore SEMAPHORE;
+unsigned short mksums_file_done_semaphore SEMAPHORE;
+unsigned short mksums_xattr_cache_hit_semaphore SEMAPHORE;
+unsigned short mksums_xattr_cache_miss_semaphore SEMAPHORE;
+unsigned short mksums_fiemap_semaphore SEMAPHORE;
+unsigned short mksums_dedupe_range_semaphore SEMAPHORE;
+unsigned short mksums_link_semaphore SEMAPHORE;
+unsigned short mksums_rename_semaphore SEMAPHORE;
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __PROBES_H
+#define __PROBES_H
+
+/*
+ * USDT probes in the "mksums" provider.  Every probe has a semaphore,
+ * and probe sites test it before evaluating any arguments, so that
+ * arguments that are costly to compute (latencies) are only computed
+ * while a tracer is attached.  Without <sys/sdt.h>, all of this
+ * compiles away.
+ */
+#ifdef HAVE_SYS_SDT_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define _SDT_HAS_SEMAPHORES	1
+#include <sys/sdt.h>
+
+#define PROBE_ENABLED(name)	__builtin_expect(mksums_##name##_semaphore, 0)
+
+#define PROBE1(name, a)						\
+	do {								\
+		if (PROBE_ENABLED(name))				\
+			DTRACE_PROBE1(mksums, name, a);			\
+	} while (0)
+#define PROBE2(name, a, b)						\
+	do {								\
+		if (PROBE_ENABLED(name))				\
+			DTRACE_PROBE2(mksums, name, a, b);		\
+	} while (0)
+#define PROBE3(name, a, b, c)						\
+	do {								\
+		if (PROBE_ENABLED(name))				\
+			DTRACE_PROBE3(mksums, name, a, b, c);		\
+	} while (0)
+#define PROBE4(name, a, b, c, d)					\
+	do {								\
+		if (PROBE_ENABLED(name))				\
+			DTRACE_PROBE4(mksums, name, a, b, c, d);	\
+	} while (0)
+
+extern unsigned short mksums_dir_pick_semaphore;
+extern unsigned short mksums_dir_scan_start_semaphore;
+extern unsigned short mksums_dir_scan_done_semaphore;
+extern unsigned short mksums_file_open_semaphore;
+extern unsigned short mksums_file_read_semaphore;
+extern unsigned short mksums_file_done_semaphore;
+extern unsigned short mksums_xattr_cache_hit_semaphore;
+extern unsigned short mksums_xattr_cache_miss_semaphore;
+extern unsigned short mksums_fiemap_semaphore;
+extern unsigned short mksums_dedupe_range_semaphore;
+extern unsigned short mksums_link_semaphore;
+extern unsigned short mksums_rename_semaphore;
+
+static inline uint64_t probe_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A tracer that attaches between PROBE_START() and the probe gets a
+ * latency of zero rather than one measured from the epoch.
+ */
+#define PROBE_START(name)	(PROBE_ENABLED(name) ? probe_time() : 0)
+#define PROBE_LATENCY(start)	((start) ? probe_time() - (start) : 0)
+
+#else
+
+#define PROBE_ENABLED(name)	0
+
+#define PROBE1(name, a)		do { (void)(a); } while (0)
+#define PROBE2(name, a, b)	do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c)	do { (void)(a); (void)(b); (void)(c); } while (0)
+#define PROBE4(name, a, b, c, d) \
+	do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+
+#define PROBE_START(name)	0
+#define PROBE_LATENCY(start)	((void)(start), 0)
+
+#endif
+
+
+#endif
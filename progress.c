@@ -0,0 +1,294 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <iv_list.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mksums_common.h"
+
+/*
+ * On a terminal, the status line is redrawn in place every second.
+ * When stderr goes to a file or pipe, that would fill it with
+ * carriage returns, so plain lines are logged less often instead.
+ */
+#define PROGRESS_TTY_INTERVAL	1
+#define PROGRESS_LOG_INTERVAL	30
+
+struct progress_counters
+{
+	struct iv_list_head	list;
+	uint64_t		dirs_scanned;
+	uint64_t		files_scanned;
+	uint64_t		bytes_scanned;
+	uint64_t		files_hashed;
+	uint64_t		bytes_hashed;
+};
+
+int progress_enabled;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct iv_list_head all_counters = IV_LIST_HEAD_INIT(all_counters);
+static __thread struct progress_counters *my_counters;
+static pthread_t display_thread;
+static int stopping;
+static int redraw;
+
+static int scan_queue;
+static uint64_t hash_total_files;
+static uint64_t hash_total_bytes;
+static double hash_start;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct progress_counters *get_counters(void)
+{
+	struct progress_counters *pc;
+
+	pc = my_counters;
+	if (pc == NULL) {
+		pc = calloc(1, sizeof(*pc));
+		if (pc == NULL)
+			abort();
+
+		pthread_mutex_lock(&lock);
+		iv_list_add_tail(&pc->list, &all_counters);
+		pthread_mutex_unlock(&lock);
+
+		my_counters = pc;
+	}
+
+	return pc;
+}
+
+static void add(uint64_t *counter, uint64_t val)
+{
+	__atomic_store_n(counter, *counter + val, __ATOMIC_RELAXED);
+}
+
+void progress_dir_scanned(int files, uint64_t bytes)
+{
+	struct progress_counters *pc;
+
+	if (progress_enabled) {
+		pc = get_counters();
+		add(&pc->dirs_scanned, 1);
+		add(&pc->files_scanned, files);
+		add(&pc->bytes_scanned, bytes);
+	}
+}
+
+void progress_scan_queue(int depth)
+{
+	if (progress_enabled)
+		__atomic_store_n(&scan_queue, depth, __ATOMIC_RELAXED);
+}
+
+void progress_hash_start(uint64_t files, uint64_t bytes)
+{
+	if (progress_enabled) {
+		pthread_mutex_lock(&lock);
+		hash_total_files = files;
+		hash_total_bytes = bytes;
+		hash_start = now();
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void progress_file_hashed(uint64_t bytes)
+{
+	struct progress_counters *pc;
+
+	if (progress_enabled) {
+		pc = get_counters();
+		add(&pc->files_hashed, 1);
+		add(&pc->bytes_hashed, bytes);
+	}
+}
+
+static void sum_counters(struct progress_counters *sum)
+{
+	struct iv_list_head *lh;
+
+	memset(sum, 0, sizeof(*sum));
+
+	iv_list_for_each (lh, &all_counters) {
+		struct progress_counters *pc;
+
+		pc = iv_container_of(lh, struct progress_counters, list);
+
+		sum->dirs_scanned +=
+			__atomic_load_n(&pc->dirs_scanned, __ATOMIC_RELAXED);
+		sum->files_scanned +=
+			__atomic_load_n(&pc->files_scanned, __ATOMIC_RELAXED);
+		sum->bytes_scanned +=
+			__atomic_load_n(&pc->bytes_scanned, __ATOMIC_RELAXED);
+		sum->files_hashed +=
+			__atomic_load_n(&pc->files_hashed, __ATOMIC_RELAXED);
+		sum->bytes_hashed +=
+			__atomic_load_n(&pc->bytes_hashed, __ATOMIC_RELAXED);
+	}
+}
+
+static void format_bytes(char *buf, size_t len, double bytes)
+{
+	static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+	int i;
+
+	for (i = 0; bytes >= 1024 && i < 5; i++)
+		bytes /= 1024;
+
+	snprintf(buf, len, "%.1f %s", bytes, units[i]);
+}
+
+static void format_eta(char *buf, size_t len, double secs)
+{
+	long s;
+
+	if (secs < 0 || secs > 1e8) {
+		snprintf(buf, len, "--:--:--");
+		return;
+	}
+
+	s = secs;
+	snprintf(buf, len, "%ld:%.2ld:%.2ld", s / 3600, (s / 60) % 60, s % 60);
+}
+
+static void display(struct progress_counters *prev, double *prev_time,
+		    int final)
+{
+	struct progress_counters cur;
+	double t;
+	double dt;
+	char scanned[32];
+	char hashed[32];
+	char eta[32];
+
+	sum_counters(&cur);
+
+	t = now();
+	dt = t - *prev_time;
+	if (dt <= 0)
+		dt = 1;
+
+	format_bytes(scanned, sizeof(scanned), cur.bytes_scanned);
+	format_bytes(hashed, sizeof(hashed), cur.bytes_hashed);
+
+	if (hash_start && cur.bytes_hashed && t > hash_start) {
+		double rate;
+		double left;
+
+		rate = cur.bytes_hashed / (t - hash_start);
+		left = (double)hash_total_bytes - (double)cur.bytes_hashed;
+		format_eta(eta, sizeof(eta), left > 0 ? left / rate : 0);
+	} else {
+		format_eta(eta, sizeof(eta), -1);
+	}
+
+	fprintf(stderr, "%sscanned %llu dirs %llu files %s, queue %d; "
+			"hashed %llu files %s, %.1f MB/s %.0f files/s, "
+			"backlog %llu, ETA %s%s",
+		redraw ? "\r" : "",
+		(unsigned long long)cur.dirs_scanned,
+		(unsigned long long)cur.files_scanned,
+		scanned,
+		__atomic_load_n(&scan_queue, __ATOMIC_RELAXED),
+		(unsigned long long)cur.files_hashed,
+		hashed,
+		(cur.bytes_hashed - prev->bytes_hashed) / dt / 1e6,
+		(cur.files_hashed - prev->files_hashed) / dt,
+		(unsigned long long)(hash_total_files > cur.files_hashed ?
+				     hash_total_files - cur.files_hashed : 0),
+		eta, redraw ? "  " : "\n");
+
+	if (redraw && final)
+		fputc('\n', stderr);
+
+	*prev = cur;
+	*prev_time = t;
+}
+
+static void *display_loop(void *cookie)
+{
+	struct progress_counters prev;
+	double prev_time;
+
+	memset(&prev, 0, sizeof(prev));
+	prev_time = now();
+
+	pthread_mutex_lock(&lock);
+
+	while (!stopping) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += redraw ? PROGRESS_TTY_INTERVAL :
+				      PROGRESS_LOG_INTERVAL;
+
+		if (pthread_cond_timedwait(&cond, &lock, &ts) == ETIMEDOUT)
+			display(&prev, &prev_time, 0);
+	}
+
+	display(&prev, &prev_time, 1);
+
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+void progress_start(void)
+{
+	int ret;
+
+	progress_enabled = 1;
+	redraw = isatty(STDERR_FILENO);
+
+	ret = pthread_create(&display_thread, NULL, display_loop, NULL);
+	if (ret) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		exit(1);
+	}
+}
+
+void progress_stop(void)
+{
+	if (!progress_enabled)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(display_thread, NULL);
+
+	progress_enabled = 0;
+}
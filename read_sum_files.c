@@ -19,11 +19,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <iv_avl.h>
 #include <iv_list.h>
 #include <obstack.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "hlsums_common.h"
+#include "compress.h"
+#include "stats.h"
+#include "sumfile.h"
 
 static int
 compare_hash(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
@@ -34,56 +39,88 @@ compare_hash(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
 	return memcmp(a->hash, b->hash, sizeof(a->hash));
 }
 
-static int hextoval(char c)
+static struct hash *find_hash(struct iv_avl_tree *tree, const uint8_t *hash)
 {
-	if (c >= '0' && c <= '9')
-		return c - '0';
+	struct iv_avl_node *an;
 
-	if (c >= 'A' && c <= 'F')
-		return 10 + (c - 'A');
+	an = tree->root;
+	while (an != NULL) {
+		struct hash *h;
+		int ret;
 
-	if (c >= 'a' && c <= 'f')
-		return 10 + (c - 'a');
+		h = iv_container_of(an, struct hash, an);
 
-	return -1;
+		ret = memcmp(hash, h->hash, sizeof(h->hash));
+		if (ret == 0)
+			return h;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
 }
 
-static int parse_hash(uint8_t *hash, char *text)
+static void add_dentry(struct hash *h, const char *dir, int dirlen,
+		       const char *name, int namelen)
 {
-	int i;
+	struct dentry *d;
 
-	for (i = 0; i < 64; i++) {
-		int val;
-		int val2;
+	d = malloc(sizeof(*d) + dirlen + namelen + 1);
+	if (d == NULL)
+		abort();
 
-		val = hextoval(text[2 * i]);
-		if (val < 0)
-			return 1;
+	memcpy(d->name, dir, dirlen);
+	memcpy(d->name + dirlen, name, namelen);
+	d->name[dirlen + namelen] = 0;
 
-		val2 = hextoval(text[2 * i + 1]);
-		if (val2 < 0)
-			return 1;
+	iv_list_add_tail(&d->list, &h->dentries);
+}
 
-		hash[i] = (val << 4) | val2;
-	}
 
-	return 0;
+/*
+ * Hashes seen only once so far.  For binary sum files, these point
+ * straight into the mmap()ed file, which stays mapped until all sum
+ * files have been read.  For text sum files, the digest and name are
+ * copied into the struct.
+ */
+struct hash_1ref
+{
+	struct iv_avl_node	an;
+	const uint8_t		*hash;
+	const char		*dir;
+	int			dirlen;
+	const char		*name;
+	int			namelen;
+	uint8_t			copy[0];
+};
+
+static int
+compare_hash_1ref(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
+{
+	const struct hash_1ref *a = iv_container_of(_a, struct hash_1ref, an);
+	const struct hash_1ref *b = iv_container_of(_b, struct hash_1ref, an);
+
+	return memcmp(a->hash, b->hash, 64);
 }
 
-static struct hash *find_hash(struct iv_avl_tree *tree, uint8_t *hash)
+static struct hash_1ref *
+find_hash_1ref(struct iv_avl_tree *tree, const uint8_t *hash)
 {
 	struct iv_avl_node *an;
 
 	an = tree->root;
 	while (an != NULL) {
-		struct hash *h;
+		struct hash_1ref *h1;
 		int ret;
 
-		h = iv_container_of(an, struct hash, an);
+		h1 = iv_container_of(an, struct hash_1ref, an);
 
-		ret = memcmp(hash, h->hash, sizeof(h->hash));
+		ret = memcmp(hash, h1->hash, 64);
 		if (ret == 0)
-			return h;
+			return h1;
 
 		if (ret < 0)
 			an = an->left;
@@ -94,116 +131,307 @@ static struct hash *find_hash(struct iv_avl_tree *tree, uint8_t *hash)
 	return NULL;
 }
 
-static void add_dentry(struct hash *h, char *name, int namelen)
+#define obstack_chunk_alloc	malloc
+#define obstack_chunk_free	free
+
+struct read_state
 {
-	struct dentry *d;
+	struct iv_avl_tree	*dst;
+	struct iv_avl_tree	hash_1ref;
+	struct obstack		pool;
+	int			copy;
+};
 
-	d = malloc(sizeof(*d) + namelen + 1);
-	if (d == NULL)
-		abort();
+static void add_entry(void *cookie, const uint8_t *hash,
+		      const char *dir, int dirlen, const char *name, int namelen)
+{
+	struct read_state *rs = cookie;
+	struct hash *h;
+	struct hash_1ref *h1;
+
+	h = find_hash(rs->dst, hash);
+	if (h != NULL) {
+		add_dentry(h, dir, dirlen, name, namelen);
+		return;
+	}
 
-	strcpy(d->name, name);
+	h1 = find_hash_1ref(&rs->hash_1ref, hash);
+	if (h1 != NULL) {
+		h = malloc(sizeof(*h));
+		if (h == NULL)
+			abort();
+		memcpy(h->hash, hash, sizeof(h->hash));
+		INIT_IV_LIST_HEAD(&h->dentries);
+		iv_avl_tree_insert(rs->dst, &h->an);
 
-	iv_list_add_tail(&d->list, &h->dentries);
+		add_dentry(h, h1->dir, h1->dirlen, h1->name, h1->namelen);
+		add_dentry(h, dir, dirlen, name, namelen);
+
+		iv_avl_tree_delete(&rs->hash_1ref, &h1->an);
+
+		return;
+	}
+
+	if (rs->copy) {
+		h1 = obstack_alloc(&rs->pool,
+				   sizeof(*h1) + 64 + dirlen + namelen);
+		if (h1 == NULL)
+			abort();
+
+		memcpy(h1->copy, hash, 64);
+		memcpy(h1->copy + 64, dir, dirlen);
+		memcpy(h1->copy + 64 + dirlen, name, namelen);
+
+		h1->hash = h1->copy;
+		h1->dir = (char *)h1->copy + 64;
+		h1->name = (char *)h1->copy + 64 + dirlen;
+	} else {
+		h1 = obstack_alloc(&rs->pool, sizeof(*h1));
+		if (h1 == NULL)
+			abort();
+
+		h1->hash = hash;
+		h1->dir = dir;
+		h1->name = name;
+	}
+
+	h1->dirlen = dirlen;
+	h1->namelen = namelen;
+	iv_avl_tree_insert(&rs->hash_1ref, &h1->an);
 }
 
+static int read_text_sum_file(struct read_state *rs, FILE *fp)
+{
+	rs->copy = 1;
+
+	while (1) {
+		char line[2048];
+		int len;
+		uint8_t hash[64];
 
-struct hash_1ref
+		if (fgets(line, sizeof(line), fp) == NULL) {
+			if (!feof(fp)) {
+				perror("fgets");
+				return 1;
+			}
+			break;
+		}
+
+		len = strlen(line);
+		stats_count(STATS_BYTES_READ, len);
+
+		if (len && line[len - 1] == '\n')
+			line[--len] = 0;
+
+		if (len < 131 || sumfile_parse_hex(hash, line)) {
+			fprintf(stderr, "error parsing line: %s\n", line);
+			continue;
+		}
+
+		add_entry(rs, hash, "", 0, line + 130, len - 130);
+	}
+
+	return 0;
+}
+
+/*
+ * Compressed sum files are decompressed by background jobs, of which
+ * at most this many are started ahead of the file being parsed.
+ */
+#define DECOMPRESS_JOBS		4
+
+struct sum_file
 {
-	struct iv_avl_node	an;
-	uint8_t			hash[64];
-	char			name[0];
+	int			fd;
+	int			zstd;
+	struct decompress_job	*job;
+	void			*map;
+	size_t			map_len;
+	int			mapped;
 };
 
-#define obstack_chunk_alloc	malloc
-#define obstack_chunk_free	free
-
-int read_sum_files(struct iv_avl_tree *dst, int num_files, char *file[])
+static int open_sum_file(struct sum_file *sf, char *file)
 {
-	struct iv_avl_tree hash_1ref;
-	struct obstack pool;
-	int i;
+	uint8_t magic[8];
+	ssize_t len;
+
+	stats_count(STATS_SYS_OPEN, 1);
+	sf->fd = open(file, O_RDONLY);
+	if (sf->fd < 0) {
+		perror("open");
+		return 1;
+	}
 
-	INIT_IV_AVL_TREE(dst, compare_hash);
+	stats_count(STATS_SYS_PREAD, 1);
+	len = pread(sf->fd, magic, sizeof(magic), 0);
+	if (len > 0 && decompress_is_zstd(magic, len))
+		sf->zstd = 1;
 
-	INIT_IV_AVL_TREE(&hash_1ref, compare_hash);
+	return 0;
+}
 
-	obstack_init(&pool);
-	obstack_chunk_size(&pool) = 131072;
+/*
+ * Binary sum files are parsed in place, so their decompressed contents
+ * have to stay in memory.  Text sum files are copied line by line, so
+ * they are streamed instead.
+ */
+static int start_decompress(struct sum_file *sf, char *file)
+{
+	if (sf->zstd && sf->job == NULL && sf->fd != -1) {
+		sf->job = decompress_start(file, sf->fd, sumfile_is_binary);
+		sf->fd = -1;
+		if (sf->job == NULL)
+			return 1;
+	}
 
-	for (i = 0; i < num_files; i++) {
-		FILE *fp;
-		char mapbuf[1048576];
+	return 0;
+}
 
-		fp = fopen(file[i], "r");
-		if (fp == NULL) {
-			perror("fopen");
+static int read_plain_sum_file(struct read_state *rs, struct sum_file *sf,
+			       char *file)
+{
+	struct stat buf;
+	uint8_t magic[8];
+	FILE *fp;
+	char mapbuf[1048576];
+	int ret;
+
+	stats_count(STATS_SYS_FSTAT, 1);
+	stats_count(STATS_SYS_PREAD, 1);
+	if (fstat(sf->fd, &buf) == 0 &&
+	    pread(sf->fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	    sumfile_is_binary(magic, sizeof(magic))) {
+		sf->map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED,
+			       sf->fd, 0);
+		if (sf->map == MAP_FAILED) {
+			perror("mmap");
+			sf->map = NULL;
 			return 1;
 		}
 
-		setbuffer(fp, mapbuf, sizeof(mapbuf));
+		sf->map_len = buf.st_size;
+		sf->mapped = 1;
+		madvise(sf->map, sf->map_len, MADV_SEQUENTIAL);
+		stats_count(STATS_BYTES_READ, buf.st_size);
 
-		while (1) {
-			char line[2048];
-			int len;
-			uint8_t hash[64];
-			struct hash *h;
-			struct hash_1ref *h1;
+		rs->copy = 0;
 
-			if (fgets(line, sizeof(line), fp) == NULL) {
-				if (!feof(fp)) {
-					perror("fgets");
-					return 1;
-				}
-				break;
-			}
+		return sumfile_parse(file, sf->map, sf->map_len, rs, add_entry);
+	}
 
-			len = strlen(line);
-			if (len && line[len - 1] == '\n')
-				line[--len] = 0;
+	fp = fdopen(sf->fd, "r");
+	if (fp == NULL) {
+		perror("fdopen");
+		return 1;
+	}
+	sf->fd = -1;
 
-			if (len < 131 || parse_hash(hash, line)) {
-				fprintf(stderr, "error parsing line: %s\n",
-					line);
-				continue;
-			}
+	setbuffer(fp, mapbuf, sizeof(mapbuf));
 
-			h = find_hash(dst, hash);
-			if (h != NULL) {
-				add_dentry(h, line + 130, len - 130);
-				continue;
-			}
+	ret = read_text_sum_file(rs, fp);
+
+	fclose(fp);
 
-			h1 = (struct hash_1ref *)find_hash(&hash_1ref, hash);
-			if (h1 != NULL) {
-				h = malloc(sizeof(*h));
-				if (h == NULL)
-					abort();
-				memcpy(h->hash, hash, sizeof(h->hash));
-				INIT_IV_LIST_HEAD(&h->dentries);
-				iv_avl_tree_insert(dst, &h->an);
+	return ret;
+}
 
-				add_dentry(h, h1->name, strlen(h1->name));
-				add_dentry(h, line + 130, len - 130);
+static int read_zstd_sum_file(struct read_state *rs, struct sum_file *sf,
+			      char *file)
+{
+	FILE *fp;
+	int ret;
 
-				iv_avl_tree_delete(&hash_1ref, &h1->an);
+	ret = decompress_finish(sf->job, &fp, &sf->map, &sf->map_len);
+	sf->job = NULL;
+	if (ret)
+		return 1;
 
-				continue;
-			}
+	if (fp != NULL) {
+		ret = read_text_sum_file(rs, fp);
+		if (fclose(fp))
+			ret = 1;
+
+		return ret;
+	}
+
+	rs->copy = 0;
+
+	return sumfile_parse(file, sf->map, sf->map_len, rs, add_entry);
+}
+
+int read_sum_files(struct iv_avl_tree *dst, int num_files, char *file[])
+{
+	struct read_state rs;
+	struct sum_file *sf;
+	int ret;
+	int i;
+
+	INIT_IV_AVL_TREE(dst, compare_hash);
+
+	rs.dst = dst;
+	INIT_IV_AVL_TREE(&rs.hash_1ref, compare_hash_1ref);
+
+	obstack_init(&rs.pool);
+	obstack_chunk_size(&rs.pool) = 131072;
+
+	sf = calloc(num_files, sizeof(*sf));
+	if (sf == NULL)
+		abort();
 
-			h1 = obstack_alloc(&pool, sizeof(*h1) + len - 130 + 1);
-			if (h1 == NULL)
-				abort();
+	/*
+	 * Open everything up front, so that missing files are caught
+	 * early.  Compressed sum files are decompressed in the background
+	 * up to DECOMPRESS_JOBS files ahead of the one being parsed.
+	 */
+	ret = 0;
+	for (i = 0; i < num_files; i++) {
+		sf[i].fd = -1;
+		if (!ret)
+			ret = open_sum_file(&sf[i], file[i]);
+	}
 
-			memcpy(h1->hash, hash, sizeof(h1->hash));
-			strcpy(h1->name, line + 130);
-			iv_avl_tree_insert(&hash_1ref, &h1->an);
+	for (i = 0; i < num_files && !ret; i++) {
+		int j;
+
+		for (j = i; j < num_files && j < i + DECOMPRESS_JOBS; j++) {
+			ret = start_decompress(&sf[j], file[j]);
+			if (ret)
+				break;
 		}
 
-		fclose(fp);
+		if (ret)
+			break;
+
+		if (sf[i].zstd)
+			ret = read_zstd_sum_file(&rs, &sf[i], file[i]);
+		else
+			ret = read_plain_sum_file(&rs, &sf[i], file[i]);
 	}
 
-	obstack_free(&pool, NULL);
+	obstack_free(&rs.pool, NULL);
 
-	return 0;
+	for (i = 0; i < num_files; i++) {
+		FILE *fp;
+		void *buf;
+		size_t len;
+
+		if (sf[i].job != NULL &&
+		    !decompress_finish(sf[i].job, &fp, &buf, &len)) {
+			if (fp != NULL)
+				fclose(fp);
+			free(buf);
+		}
+
+		if (sf[i].fd != -1)
+			close(sf[i].fd);
+
+		if (sf[i].mapped)
+			munmap(sf[i].map, sf[i].map_len);
+		else
+			free(sf[i].map);
+	}
+
+	free(sf);
+
+	return ret;
 }
@@ -22,8 +22,10 @@
 #include <errno.h>
 #include <iv_avl.h>
 #include <iv_list.h>
+#include <obstack.h>
 #include <string.h>
 #include "hlsums_common.h"
+#include "stats.h"
 
 static int
 compare_inodes(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
@@ -70,15 +72,20 @@ find_inode(struct iv_avl_tree *tree, dev_t st_dev, ino_t st_ino)
 	return NULL;
 }
 
+#define obstack_chunk_alloc	malloc
+#define obstack_chunk_free	free
+
 void scan_inodes(struct hash *h, void *cookie,
 		 void (*cb)(void *cookie, struct iv_avl_tree *inodes))
 {
 	struct iv_avl_tree inodes;
+	struct obstack pool;
 	struct iv_list_head *lh;
 	struct iv_list_head *lh2;
 	struct iv_avl_node *an;
 
 	INIT_IV_AVL_TREE(&inodes, compare_inodes);
+	obstack_init(&pool);
 
 	iv_list_for_each_safe (lh, lh2, &h->dentries) {
 		struct dentry *d;
@@ -88,6 +95,7 @@ void scan_inodes(struct hash *h, void *cookie,
 
 		d = iv_container_of(lh, struct dentry, list);
 
+		stats_count(STATS_SYS_STAT, 1);
 		ret = stat(d->name, &buf);
 		if (ret < 0) {
 			if (errno != ENOENT) {
@@ -109,7 +117,7 @@ void scan_inodes(struct hash *h, void *cookie,
 			continue;
 		}
 
-		ino = alloca(sizeof(*ino));
+		ino = obstack_alloc(&pool, sizeof(*ino));
 		if (ino == NULL)
 			abort();
 
@@ -138,4 +146,6 @@ void scan_inodes(struct hash *h, void *cookie,
 			iv_list_add_tail(lh, &h->dentries);
 		}
 	}
+
+	obstack_free(&pool, NULL);
 }
@@ -24,27 +24,48 @@
 #include <fcntl.h>
 #include <iv_avl.h>
 #include <iv_list.h>
+#include <obstack.h>
 #include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "mksums_common.h"
+#include "probes.h"
+#include "stats.h"
 
+/*
+ * All roots are scanned by one set of threads.  Directories waiting to
+ * be scanned are kept per device, in inode order, and devices that have
+ * work pending take turns, so that every spindle is kept busy and no
+ * device starves the others.
+ */
 struct scan_state
 {
 	pthread_mutex_t		lock;
 	pthread_cond_t		cond;
-	struct iv_list_head	*files;
+	struct iv_list_head	devices;
+	struct iv_list_head	active_devices;
+	int			threads_scanning;
+	int			dirs_queued;
+	int			stat_files;
+	int			failed;
+};
+
+struct scan_device
+{
+	struct iv_list_head	list;
+	struct iv_list_head	active;
+	dev_t			st_dev;
 	struct iv_avl_tree	dirs_to_scan;
 	ino_t			last_dir_inode_scanned;
-	int			threads_scanning;
 };
 
 struct dir_to_scan
 {
 	struct iv_avl_node	an;
 	struct iv_list_head	list;
+	struct scan_device	*sd;
 	struct dir		*dir;
 	ino_t			d_ino;
 };
@@ -73,20 +94,45 @@ static int compare_dirs_to_scan(const struct iv_avl_node *_a,
 		return -1;
 	if (a->d_ino > b->d_ino)
 		return 1;
+
+	/*
+	 * The same directory can be queued more than once if it is
+	 * reachable from several roots.
+	 */
+	if (a < b)
+		return -1;
+	if (a > b)
+		return 1;
+
 	return 0;
 }
 
+static void queue_dir(struct scan_state *st, struct dir_to_scan *ds)
+{
+	struct scan_device *sd = ds->sd;
+
+	if (sd->dirs_to_scan.root == NULL)
+		iv_list_add_tail(&sd->active, &st->active_devices);
+
+	iv_avl_tree_insert(&sd->dirs_to_scan, &ds->an);
+	st->dirs_queued++;
+}
+
 static struct dir_to_scan *pick_dir(struct scan_state *st)
 {
+	struct scan_device *sd;
 	struct iv_avl_node *an;
 	struct dir_to_scan *ds;
 
-	an = st->dirs_to_scan.root;
+	sd = iv_container_of(st->active_devices.next,
+			     struct scan_device, active);
+
+	an = sd->dirs_to_scan.root;
 	while (1) {
 		struct iv_avl_node *an2;
 
 		ds = iv_container_of(an, struct dir_to_scan, an);
-		if (st->last_dir_inode_scanned < ds->d_ino)
+		if (sd->last_dir_inode_scanned < ds->d_ino)
 			an2 = an->left;
 		else
 			an2 = an->right;
@@ -97,15 +143,22 @@ static struct dir_to_scan *pick_dir(struct scan_state *st)
 		an = an2;
 	}
 
-	if (ds->d_ino < st->last_dir_inode_scanned) {
+	if (ds->d_ino < sd->last_dir_inode_scanned) {
 		an = iv_avl_tree_next(an);
 		if (an == NULL)
-			an = iv_avl_tree_min(&st->dirs_to_scan);
+			an = iv_avl_tree_min(&sd->dirs_to_scan);
 
 		ds = iv_container_of(an, struct dir_to_scan, an);
 	}
 
-	st->last_dir_inode_scanned = ds->d_ino;
+	sd->last_dir_inode_scanned = ds->d_ino;
+
+	iv_avl_tree_delete(&sd->dirs_to_scan, &ds->an);
+	st->dirs_queued--;
+
+	iv_list_del(&sd->active);
+	if (sd->dirs_to_scan.root != NULL)
+		iv_list_add_tail(&sd->active, &st->active_devices);
 
 	return ds;
 }
@@ -122,42 +175,73 @@ static int compare_temp_dir_entries(const struct iv_avl_node *_a,
 	return strcmp(a->d_name, b->d_name);
 }
 
-static void scan_one_dir(struct dir_to_scan *ds, struct iv_avl_tree *dirs,
-			 struct iv_list_head *fhs)
+#define obstack_chunk_alloc	malloc
+#define obstack_chunk_free	free
+
+/*
+ * Errors are reported and the offending entry (or the rest of the
+ * directory) skipped, and make this return nonzero.
+ */
+static int scan_one_dir(struct dir_to_scan *ds, struct iv_avl_tree *dirs,
+			struct iv_list_head *fhs, int stat_files)
 {
+	int failed;
 	int dirfd;
 	DIR *dird;
 	struct iv_avl_tree ent_tree;
+	struct obstack ent_pool;
 	struct iv_avl_node *an;
+	int num_files;
+	uint64_t num_bytes;
+	uint64_t start;
+	uint64_t probe_start;
+
+	PROBE1(dir_scan_start, ds->d_ino);
+
+	start = stats_time();
+	probe_start = PROBE_START(dir_scan_done);
 
 	dirfd = dup(ds->dir->dirfd);
 	if (dirfd < 0) {
 		perror("dup");
-		exit(1);
+		return 1;
 	}
 
 	dird = fdopendir(dirfd);
 	if (dird == NULL) {
 		perror("fdopendir");
-		exit(1);
+		close(dirfd);
+		return 1;
 	}
 
 	INIT_IV_AVL_TREE(&ent_tree, compare_temp_dir_entries);
+	obstack_init(&ent_pool);
+
+	failed = 0;
+	num_files = 0;
+	num_bytes = 0;
 
 	while (1) {
 		struct dirent *ent;
 		ino_t d_ino;
 		unsigned char d_type;
+		struct stat buf;
+		int have_stat;
 		int len;
 		struct temp_dir_entry *e;
 
 		errno = 0;
 
+		stats_count(STATS_SYS_READDIR, 1);
 		ent = readdir(dird);
 		if (ent == NULL) {
 			if (errno) {
-				perror("readdir");
-				exit(1);
+				int err = errno;
+
+				fprintf(stderr, "error reading ");
+				print_dir_path(stderr, ds->dir);
+				fprintf(stderr, ": %s\n", strerror(err));
+				failed = 1;
 			}
 			break;
 		}
@@ -167,26 +251,50 @@ static void scan_one_dir(struct dir_to_scan *ds, struct iv_avl_tree *dirs,
 
 		d_ino = ent->d_ino;
 		d_type = ent->d_type;
+		have_stat = 0;
 
 		if (d_ino == 0xffffffff || d_type == DT_UNKNOWN) {
-			struct stat buf;
-
+			stats_count(STATS_SYS_FSTATAT, 1);
 			if (fstatat(ds->dir->dirfd, ent->d_name, &buf,
 				    AT_SYMLINK_NOFOLLOW) < 0) {
-				perror("fstatat");
-				exit(1);
+				int err = errno;
+
+				fprintf(stderr, "error stating ");
+				print_dir_path(stderr, ds->dir);
+				fprintf(stderr, "/%s: %s\n", ent->d_name,
+					strerror(err));
+				failed = 1;
+
+				continue;
 			}
 
 			d_ino = buf.st_ino;
 			d_type = IFTODT(buf.st_mode);
+			have_stat = 1;
 		}
 
 		if (d_type != DT_DIR && d_type != DT_REG)
 			continue;
 
+		if (d_type == DT_REG && stat_files && !have_stat) {
+			stats_count(STATS_SYS_FSTATAT, 1);
+			if (fstatat(ds->dir->dirfd, ent->d_name, &buf,
+				    AT_SYMLINK_NOFOLLOW) < 0) {
+				int err = errno;
+
+				fprintf(stderr, "error stating ");
+				print_dir_path(stderr, ds->dir);
+				fprintf(stderr, "/%s: %s\n", ent->d_name,
+					strerror(err));
+
+				continue;
+			}
+			have_stat = 1;
+		}
+
 		len = strlen(ent->d_name);
 
-		e = alloca(sizeof(*e));
+		e = obstack_alloc(&ent_pool, sizeof(*e));
 		if (e == NULL)
 			abort();
 
@@ -200,11 +308,13 @@ static void scan_one_dir(struct dir_to_scan *ds, struct iv_avl_tree *dirs,
 				abort();
 			dir->parent = ds->dir;
 			dir->dirfd = -1;
+			dir->st_dev = ds->dir->st_dev;
 			strcpy(dir->name, ent->d_name);
 
 			e->ds = malloc(sizeof(struct dir_to_scan));
 			if (e->ds == NULL)
 				abort();
+			e->ds->sd = ds->sd;
 			e->ds->dir = dir;
 			e->ds->d_ino = d_ino;
 
@@ -216,10 +326,15 @@ static void scan_one_dir(struct dir_to_scan *ds, struct iv_avl_tree *dirs,
 			e->fh->dir = ds->dir;
 			e->fh->d_ino = d_ino;
 			e->fh->state = STATE_NOTYET;
+			e->fh->st_size = have_stat ? buf.st_size : -1;
 			memset(e->fh->hash, 0, sizeof(e->fh->hash));
 			strcpy(e->fh->d_name, ent->d_name);
 
 			e->d_name = e->fh->d_name;
+
+			num_files++;
+			if (have_stat)
+				num_bytes += buf.st_size;
 		}
 
 		iv_avl_tree_insert(&ent_tree, &e->an);
@@ -227,12 +342,15 @@ static void scan_one_dir(struct dir_to_scan *ds, struct iv_avl_tree *dirs,
 
 	closedir(dird);
 
+	progress_dir_scanned(num_files, num_bytes);
+
 	iv_avl_tree_for_each (an, &ent_tree) {
 		struct temp_dir_entry *e;
 
 		e = iv_container_of(an, struct temp_dir_entry, an);
 
 		if (e->d_type == DT_DIR) {
+			struct stat buf;
 			int fd;
 
 			fd = openat_try_noatime(ds->dir->dirfd,
@@ -254,12 +372,30 @@ static void scan_one_dir(struct dir_to_scan *ds, struct iv_avl_tree *dirs,
 
 			e->ds->dir->dirfd = fd;
 
+			/*
+			 * Hard links are matched up by device and
+			 * inode, and a subdirectory can be a mount
+			 * point.
+			 */
+			stats_count(STATS_SYS_FSTAT, 1);
+			if (fstat(fd, &buf) == 0)
+				e->ds->dir->st_dev = buf.st_dev;
+
 			iv_avl_tree_insert(dirs, &e->ds->an);
 			iv_list_add_tail(&e->ds->list, fhs);
 		} else if (e->d_type == DT_REG) {
 			iv_list_add_tail(&e->fh->list, fhs);
 		}
 	}
+
+	obstack_free(&ent_pool, NULL);
+
+	stats_latency(STATS_HIST_DIR_SCAN, start);
+
+	PROBE3(dir_scan_done, ds->d_ino, num_files,
+	       PROBE_LATENCY(probe_start));
+
+	return failed;
 }
 
 static void *scan_thread(void *cookie)
@@ -272,18 +408,21 @@ static void *scan_thread(void *cookie)
 		struct dir_to_scan *ds;
 		struct iv_avl_tree dirs;
 		struct iv_list_head fhs;
+		int failed;
 
-		while (st->dirs_to_scan.root == NULL && st->threads_scanning)
+		while (iv_list_empty(&st->active_devices) &&
+		       st->threads_scanning) {
 			pthread_cond_wait(&st->cond, &st->lock);
+		}
 
-		if (st->dirs_to_scan.root == NULL)
+		if (iv_list_empty(&st->active_devices))
 			break;
 
 		ds = pick_dir(st);
 		if (ds == NULL)
 			abort();
 
-		iv_avl_tree_delete(&st->dirs_to_scan, &ds->an);
+		PROBE2(dir_pick, ds->d_ino, st->dirs_queued);
 
 		st->threads_scanning++;
 
@@ -291,13 +430,16 @@ static void *scan_thread(void *cookie)
 
 		INIT_IV_AVL_TREE(&dirs, compare_dirs_to_scan);
 		INIT_IV_LIST_HEAD(&fhs);
-		scan_one_dir(ds, &dirs, &fhs);
+		failed = scan_one_dir(ds, &dirs, &fhs, st->stat_files);
 
 		pthread_mutex_lock(&st->lock);
 
+		if (failed)
+			st->failed = 1;
+
 		st->threads_scanning--;
 
-		if (st->dirs_to_scan.root == NULL &&
+		if (iv_list_empty(&st->active_devices) &&
 		    (dirs.root != NULL || !st->threads_scanning)) {
 			pthread_cond_broadcast(&st->cond);
 		}
@@ -307,9 +449,12 @@ static void *scan_thread(void *cookie)
 
 			an = dirs.root;
 			iv_avl_tree_delete(&dirs, an);
-			iv_avl_tree_insert(&st->dirs_to_scan, an);
+			queue_dir(st, iv_container_of(an, struct dir_to_scan,
+						      an));
 		}
 
+		progress_scan_queue(st->dirs_queued);
+
 		iv_list_splice(&fhs, &ds->list);
 		iv_list_del(&ds->list);
 
@@ -321,43 +466,127 @@ static void *scan_thread(void *cookie)
 	return NULL;
 }
 
-int scan_tree(struct iv_list_head *files, char *root_name)
+static struct scan_device *get_device(struct scan_state *st, dev_t st_dev)
 {
-	int dirfd;
-	struct scan_state st;
-	struct dir *rootdir;
-	struct dir_to_scan *rootds;
+	struct iv_list_head *lh;
+	struct scan_device *sd;
 
-	dirfd = openat_try_noatime(AT_FDCWD, root_name, O_DIRECTORY);
-	if (dirfd < 0)
-		return 1;
+	iv_list_for_each (lh, &st->devices) {
+		sd = iv_container_of(lh, struct scan_device, list);
+		if (sd->st_dev == st_dev)
+			return sd;
+	}
+
+	sd = malloc(sizeof(*sd));
+	if (sd == NULL)
+		abort();
+
+	iv_list_add_tail(&sd->list, &st->devices);
+	INIT_IV_LIST_HEAD(&sd->active);
+	sd->st_dev = st_dev;
+	INIT_IV_AVL_TREE(&sd->dirs_to_scan, compare_dirs_to_scan);
+	sd->last_dir_inode_scanned = 0;
+
+	return sd;
+}
+
+/*
+ * Throws away the roots that were queued for a scan that could not
+ * be started.
+ */
+static void drop_queued_dirs(struct scan_state *st)
+{
+	struct iv_list_head *lh;
+
+	iv_list_for_each (lh, &st->devices) {
+		struct scan_device *sd;
+
+		sd = iv_container_of(lh, struct scan_device, list);
+		while (sd->dirs_to_scan.root != NULL) {
+			struct dir_to_scan *ds;
+
+			ds = iv_container_of(sd->dirs_to_scan.root,
+					     struct dir_to_scan, an);
+			iv_avl_tree_delete(&sd->dirs_to_scan, &ds->an);
+			iv_list_del(&ds->list);
+
+			close(ds->dir->dirfd);
+			free(ds->dir);
+			free(ds);
+		}
+	}
+}
+
+int scan_tree(struct iv_list_head *files, int num_roots, char *root_name[],
+	      int stat_files, int nthreads)
+{
+	struct scan_state st;
+	int failed;
+	int i;
 
 	pthread_mutex_init(&st.lock, NULL);
 	pthread_cond_init(&st.cond, NULL);
-	st.files = files;
-	INIT_IV_AVL_TREE(&st.dirs_to_scan, compare_dirs_to_scan);
-	st.last_dir_inode_scanned = 0;
+	INIT_IV_LIST_HEAD(&st.devices);
+	INIT_IV_LIST_HEAD(&st.active_devices);
 	st.threads_scanning = 0;
+	st.dirs_queued = 0;
+	st.stat_files = stat_files;
+	st.failed = 0;
+
+	failed = 0;
+	for (i = 0; i < num_roots; i++) {
+		int dirfd;
+		struct stat buf;
+		struct dir *rootdir;
+		struct dir_to_scan *rootds;
+
+		dirfd = openat_try_noatime(AT_FDCWD, root_name[i], O_DIRECTORY);
+		if (dirfd < 0 || fstat(dirfd, &buf) < 0) {
+			int err = errno;
+
+			fprintf(stderr, "error opening %s: %s\n",
+				root_name[i], strerror(err));
+			if (dirfd >= 0)
+				close(dirfd);
+			failed = 1;
 
-	rootdir = malloc(sizeof(*rootdir) + strlen(root_name) + 1);
-	if (rootdir == NULL)
-		abort();
-	rootdir->parent = NULL;
-	rootdir->dirfd = dirfd;
-	strcpy(rootdir->name, root_name);
+			continue;
+		}
 
-	rootds = malloc(sizeof(*rootds));
-	if (rootds == NULL)
-		abort();
-	iv_list_add_tail(&rootds->list, files);
-	rootds->dir = rootdir;
-	rootds->d_ino = 1;
-	iv_avl_tree_insert(&st.dirs_to_scan, &rootds->an);
+		rootdir = malloc(sizeof(*rootdir) + strlen(root_name[i]) + 1);
+		if (rootdir == NULL)
+			abort();
+		rootdir->parent = NULL;
+		rootdir->dirfd = dirfd;
+		rootdir->st_dev = buf.st_dev;
+		strcpy(rootdir->name, root_name[i]);
 
-	run_threads(scan_thread, &st, 128);
+		rootds = malloc(sizeof(*rootds));
+		if (rootds == NULL)
+			abort();
+		iv_list_add_tail(&rootds->list, files);
+		rootds->sd = get_device(&st, buf.st_dev);
+		rootds->dir = rootdir;
+		rootds->d_ino = buf.st_ino;
+		queue_dir(&st, rootds);
+	}
+
+	if (!iv_list_empty(&st.active_devices) &&
+	    run_threads(scan_thread, &st, nthreads ? nthreads : 128)) {
+		drop_queued_dirs(&st);
+		failed = 1;
+	}
+
+	while (!iv_list_empty(&st.devices)) {
+		struct scan_device *sd;
+
+		sd = iv_container_of(st.devices.next, struct scan_device, list);
+		iv_list_del(&sd->list);
+		free(sd);
+	}
 
 	pthread_mutex_destroy(&st.lock);
 	pthread_cond_destroy(&st.cond);
 
-	return 0;
+	return failed | st.failed;
 }
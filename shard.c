@@ -0,0 +1,306 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iv_list.h>
+#include <string.h>
+#include "mksums_common.h"
+
+/*
+ * Sharded runs: every shard scans the whole tree, so that all shards
+ * agree on the file list and its order, and then only hashes the
+ * files that it owns.  Ownership is decided by a hash of the file's
+ * path, or, in subtree mode, of its top-level subtree (the root
+ * argument plus the first path component below it), so that each
+ * subtree is read by a single shard.
+ *
+ * In subtree mode, shards can be balanced using a size estimate file
+ * in "du -s" format ("<size> <path>" per line, with paths as mksums
+ * prints them).  Subtrees listed there are assigned largest first to
+ * the least loaded shard, and any other subtrees fall back to hashing.
+ * Since every shard reads the same estimate file, they all compute
+ * the same assignment, even if the tree changes while they run.
+ *
+ * Each shard's output starts with a "# mksums shard I/N TOTAL" line,
+ * where TOTAL is the length of the global file list, so that
+ * mergesums can tell whether it was given a complete set of shards
+ * from the same file list.
+ */
+#define SHARD_PATH_SIZE		65536
+
+struct subtree_size
+{
+	unsigned long long	size;
+	int			shard;
+	char			*path;
+};
+
+static int num_estimates;
+static struct subtree_size *estimates;
+
+static uint64_t hash_string(const char *p, int len)
+{
+	uint64_t h;
+
+	h = 0xcbf29ce484222325ULL;
+	while (len--) {
+		h ^= (uint8_t)*p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static int compare_by_size(const void *_a, const void *_b)
+{
+	const struct subtree_size *a = _a;
+	const struct subtree_size *b = _b;
+
+	if (a->size > b->size)
+		return -1;
+	if (a->size < b->size)
+		return 1;
+
+	return strcmp(a->path, b->path);
+}
+
+static int compare_by_path(const void *_a, const void *_b)
+{
+	const struct subtree_size *a = _a;
+	const struct subtree_size *b = _b;
+
+	return strcmp(a->path, b->path);
+}
+
+static int read_estimates(const char *file, int count)
+{
+	unsigned long long *load;
+	FILE *fp;
+	char *line;
+	size_t len;
+	int max;
+	int i;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return 1;
+	}
+
+	line = NULL;
+	len = 0;
+	max = 0;
+	while (getline(&line, &len, fp) > 0) {
+		struct subtree_size *s;
+		char *end;
+		int l;
+
+		l = strlen(line);
+		if (l && line[l - 1] == '\n')
+			line[--l] = 0;
+
+		if (num_estimates == max) {
+			max = max ? 2 * max : 1024;
+			estimates = realloc(estimates,
+					    max * sizeof(*estimates));
+			if (estimates == NULL)
+				abort();
+		}
+
+		s = &estimates[num_estimates];
+
+		s->size = strtoull(line, &end, 10);
+		if (end == line || (*end != ' ' && *end != '\t')) {
+			fprintf(stderr, "%s: error parsing line: %s\n",
+				file, line);
+			continue;
+		}
+
+		while (*end == ' ' || *end == '\t')
+			end++;
+
+		s->path = strdup(end);
+		if (s->path == NULL)
+			abort();
+
+		num_estimates++;
+	}
+
+	free(line);
+	fclose(fp);
+
+	load = calloc(count, sizeof(*load));
+	if (load == NULL)
+		abort();
+
+	qsort(estimates, num_estimates, sizeof(*estimates), compare_by_size);
+
+	for (i = 0; i < num_estimates; i++) {
+		int best;
+		int j;
+
+		best = 0;
+		for (j = 1; j < count; j++) {
+			if (load[j] < load[best])
+				best = j;
+		}
+
+		estimates[i].shard = best;
+		load[best] += estimates[i].size;
+	}
+
+	free(load);
+
+	qsort(estimates, num_estimates, sizeof(*estimates), compare_by_path);
+
+	return 0;
+}
+
+static int subtree_shard(struct dir *dir, int count, char *path)
+{
+	struct subtree_size key;
+	struct subtree_size *s;
+	int len;
+
+	while (dir->parent != NULL && dir->parent->parent != NULL)
+		dir = dir->parent;
+
+	len = format_dir_path(path, SHARD_PATH_SIZE, dir);
+	if (len >= SHARD_PATH_SIZE)
+		len = SHARD_PATH_SIZE - 1;
+
+	key.path = path;
+	s = bsearch(&key, estimates, num_estimates, sizeof(*estimates),
+		    compare_by_path);
+	if (s != NULL)
+		return s->shard;
+
+	return hash_string(path, len) % count;
+}
+
+static int path_shard(struct file_to_hash *fh, int count, char *path)
+{
+	int len;
+
+	len = format_dir_path(path, SHARD_PATH_SIZE, fh->dir);
+	len += snprintf(path + (len < SHARD_PATH_SIZE ? len : SHARD_PATH_SIZE),
+			len < SHARD_PATH_SIZE ? SHARD_PATH_SIZE - len : 0,
+			"/%s", fh->d_name);
+	if (len >= SHARD_PATH_SIZE)
+		len = SHARD_PATH_SIZE - 1;
+
+	return hash_string(path, len) % count;
+}
+
+int shard_files(struct iv_list_head *files, int index, int count,
+		int subtree, const char *estimate_file, FILE *out)
+{
+	struct iv_list_head *lh;
+	struct dir *last_dir;
+	int last_shard;
+	unsigned long long total;
+	char *path;
+	int i;
+
+	if (estimate_file != NULL && read_estimates(estimate_file, count))
+		return 1;
+
+	path = malloc(SHARD_PATH_SIZE);
+	if (path == NULL)
+		abort();
+
+	/*
+	 * First decide ownership, stashing it in ->node, which is only
+	 * used later on when steering hashing to NUMA nodes.
+	 */
+	last_dir = NULL;
+	last_shard = 0;
+	iv_list_for_each (lh, files) {
+		struct file_to_hash *fh;
+
+		fh = iv_container_of(lh, struct file_to_hash, list);
+
+		if (!subtree) {
+			fh->node = path_shard(fh, count, path);
+		} else {
+			if (fh->dir != last_dir) {
+				last_dir = fh->dir;
+				last_shard = subtree_shard(fh->dir, count,
+							   path);
+			}
+			fh->node = last_shard;
+		}
+	}
+
+	/*
+	 * Then hash hard links and reflinks to files owned by other
+	 * shards ourselves, and skip everything we don't own.  Targets
+	 * always precede the files that refer to them, so walk the list
+	 * backwards to resolve backrefs before their targets change state.
+	 */
+	for (lh = files->prev; lh != files; lh = lh->prev) {
+		struct file_to_hash *fh;
+
+		fh = iv_container_of(lh, struct file_to_hash, list);
+
+		if (fh->node == index && fh->state == STATE_BACKREF) {
+			struct file_to_hash *target;
+
+			target = fh->backref;
+			while (target->state == STATE_BACKREF)
+				target = target->backref;
+
+			if (target->node != index)
+				fh->state = STATE_NOTYET;
+		} else if (fh->node != index && (fh->state == STATE_NOTYET ||
+						 fh->state == STATE_BACKREF)) {
+			fh->state = STATE_SKIPPED;
+		}
+	}
+
+	total = 0;
+	iv_list_for_each (lh, files) {
+		struct file_to_hash *fh;
+
+		fh = iv_container_of(lh, struct file_to_hash, list);
+		fh->node = 0;
+		total++;
+	}
+
+	fprintf(out, "# mksums shard %d/%d %llu\n", index, count, total);
+
+	free(path);
+
+	for (i = 0; i < num_estimates; i++)
+		free(estimates[i].path);
+	free(estimates);
+
+	return 0;
+}
+
+/*
+ * Written once all of this shard's sums have been, so that mergesums
+ * can tell a complete shard output from one that was cut short.
+ */
+void shard_end(int index, int count, uint64_t entries, FILE *out)
+{
+	fprintf(out, "# mksums shard end %d/%d %llu\n", index, count,
+		(unsigned long long)entries);
+}
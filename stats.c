@@ -0,0 +1,284 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "stats.h"
+
+/*
+ * Latency histograms use power-of-two buckets in microseconds:
+ * bucket 0 counts samples below 1 us, bucket i (i >= 1) counts samples
+ * in [2^(i-1), 2^i) us, and the last bucket catches everything above.
+ */
+#define HIST_BUCKETS	40
+#define MAX_PHASES	16
+
+struct histogram
+{
+	uint64_t	count;
+	uint64_t	sum_ns;
+	uint64_t	max_ns;
+	uint64_t	bucket[HIST_BUCKETS];
+};
+
+struct phase
+{
+	const char	*name;
+	uint64_t	wall_ns;
+	uint64_t	user_us;
+	uint64_t	sys_us;
+};
+
+int stats_enabled;
+uint64_t stats_counters[STATS_NUM_COUNTERS];
+
+static struct histogram histograms[STATS_NUM_HISTOGRAMS];
+static struct phase phases[MAX_PHASES];
+static int num_phases;
+static int phase_open;
+static uint64_t start_ns;
+
+static const char *syscall_names[STATS_NUM_SYSCALLS] = {
+	[STATS_SYS_OPEN]	= "open",
+	[STATS_SYS_READ]	= "read",
+	[STATS_SYS_PREAD]	= "pread",
+	[STATS_SYS_LSEEK]	= "lseek",
+	[STATS_SYS_STAT]	= "stat",
+	[STATS_SYS_FSTAT]	= "fstat",
+	[STATS_SYS_FSTATAT]	= "fstatat",
+	[STATS_SYS_READDIR]	= "readdir",
+	[STATS_SYS_GETXATTR]	= "getxattr",
+	[STATS_SYS_SETXATTR]	= "setxattr",
+	[STATS_SYS_IOCTL]	= "ioctl",
+	[STATS_SYS_LINK]	= "link",
+	[STATS_SYS_RENAME]	= "rename",
+	[STATS_SYS_UNLINK]	= "unlink",
+};
+
+static const char *histogram_names[STATS_NUM_HISTOGRAMS] = {
+	[STATS_HIST_FILE_HASH]	= "file_hash",
+	[STATS_HIST_DIR_SCAN]	= "dir_scan",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void cpu_time(uint64_t *user_us, uint64_t *sys_us)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	*user_us = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec;
+	*sys_us = ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+}
+
+void stats_start(void)
+{
+	stats_enabled = 1;
+	start_ns = now_ns();
+}
+
+void stats_phase_begin(const char *name)
+{
+	struct phase *p;
+
+	if (!stats_enabled || num_phases == MAX_PHASES)
+		return;
+
+	p = &phases[num_phases];
+	p->name = name;
+	p->wall_ns = now_ns();
+	cpu_time(&p->user_us, &p->sys_us);
+
+	phase_open = 1;
+}
+
+void stats_phase_end(void)
+{
+	struct phase *p;
+	uint64_t user_us;
+	uint64_t sys_us;
+
+	if (!stats_enabled || !phase_open)
+		return;
+
+	p = &phases[num_phases++];
+	p->wall_ns = now_ns() - p->wall_ns;
+	cpu_time(&user_us, &sys_us);
+	p->user_us = user_us - p->user_us;
+	p->sys_us = sys_us - p->sys_us;
+
+	phase_open = 0;
+}
+
+uint64_t stats_time(void)
+{
+	return stats_enabled ? now_ns() : 0;
+}
+
+void stats_latency(enum stats_histogram h, uint64_t start)
+{
+	struct histogram *hist = &histograms[h];
+	uint64_t ns;
+	uint64_t us;
+	uint64_t max;
+	int i;
+
+	if (!stats_enabled)
+		return;
+
+	ns = now_ns() - start;
+
+	us = ns / 1000;
+	for (i = 0; us && i < HIST_BUCKETS - 1; i++)
+		us >>= 1;
+
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->bucket[i], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+	while (ns > max) {
+		if (__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			break;
+	}
+}
+
+static void write_hit_rate(FILE *fp, const char *name,
+			   uint64_t hits, uint64_t misses)
+{
+	fprintf(fp, "  \"%s\": { \"hits\": %llu, \"misses\": %llu, "
+		    "\"hit_rate\": %.4f },\n", name,
+		(unsigned long long)hits, (unsigned long long)misses,
+		hits + misses ? (double)hits / (hits + misses) : 0.0);
+}
+
+static void write_histogram(FILE *fp, int h, int last)
+{
+	struct histogram *hist = &histograms[h];
+	int first;
+	int i;
+
+	fprintf(fp, "    \"%s\": { \"count\": %llu, \"sum_us\": %llu, "
+		    "\"max_us\": %llu, \"buckets_us\": {",
+		histogram_names[h],
+		(unsigned long long)hist->count,
+		(unsigned long long)(hist->sum_ns / 1000),
+		(unsigned long long)(hist->max_ns / 1000));
+
+	first = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!hist->bucket[i])
+			continue;
+
+		/*
+		 * Keys are the exclusive upper bound of each bucket.
+		 */
+		fprintf(fp, "%s \"%s%llu\": %llu", first ? "" : ",",
+			i == HIST_BUCKETS - 1 ? ">=" : "<",
+			i == HIST_BUCKETS - 1 ? 1ULL << (i - 1) : 1ULL << i,
+			(unsigned long long)hist->bucket[i]);
+		first = 0;
+	}
+
+	fprintf(fp, " } }%s\n", last ? "" : ",");
+}
+
+int stats_write_json(const char *path, const char *program)
+{
+	FILE *fp;
+	struct rusage ru;
+	uint64_t user_us;
+	uint64_t sys_us;
+	int i;
+
+	if (!stats_enabled)
+		return 0;
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		perror("fopen");
+		return 1;
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu_time(&user_us, &sys_us);
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"program\": \"%s\",\n", program);
+	fprintf(fp, "  \"wall_sec\": %.6f,\n", (now_ns() - start_ns) / 1e9);
+	fprintf(fp, "  \"user_sec\": %.6f,\n", user_us / 1e6);
+	fprintf(fp, "  \"sys_sec\": %.6f,\n", sys_us / 1e6);
+	fprintf(fp, "  \"peak_rss_kb\": %ld,\n", ru.ru_maxrss);
+
+	fprintf(fp, "  \"phases\": [\n");
+	for (i = 0; i < num_phases; i++) {
+		struct phase *p = &phases[i];
+
+		fprintf(fp, "    { \"name\": \"%s\", \"wall_sec\": %.6f, "
+			    "\"user_sec\": %.6f, \"sys_sec\": %.6f }%s\n",
+			p->name, p->wall_ns / 1e9, p->user_us / 1e6,
+			p->sys_us / 1e6, i == num_phases - 1 ? "" : ",");
+	}
+	fprintf(fp, "  ],\n");
+
+	fprintf(fp, "  \"syscalls\": {");
+	for (i = 0; i < STATS_NUM_SYSCALLS; i++) {
+		fprintf(fp, "%s\n    \"%s\": %llu", i ? "," : "",
+			syscall_names[i],
+			(unsigned long long)stats_counters[i]);
+	}
+	fprintf(fp, "\n  },\n");
+
+	fprintf(fp, "  \"bytes_read\": %llu,\n",
+		(unsigned long long)stats_counters[STATS_BYTES_READ]);
+
+	write_hit_rate(fp, "xattr_cache",
+		       stats_counters[STATS_XATTR_CACHE_HIT],
+		       stats_counters[STATS_XATTR_CACHE_MISS]);
+	write_hit_rate(fp, "hash_cache",
+		       stats_counters[STATS_HASH_CACHE_HIT],
+		       stats_counters[STATS_HASH_CACHE_MISS]);
+
+	fprintf(fp, "  \"latency\": {\n");
+	for (i = 0; i < STATS_NUM_HISTOGRAMS; i++)
+		write_histogram(fp, i, i == STATS_NUM_HISTOGRAMS - 1);
+	fprintf(fp, "  }\n");
+
+	fprintf(fp, "}\n");
+
+	if (fclose(fp) == EOF) {
+		perror("fclose");
+		return 1;
+	}
+
+	return 0;
+}
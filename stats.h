@@ -0,0 +1,73 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+
+enum stats_counter {
+	STATS_SYS_OPEN = 0,
+	STATS_SYS_READ,
+	STATS_SYS_PREAD,
+	STATS_SYS_LSEEK,
+	STATS_SYS_STAT,
+	STATS_SYS_FSTAT,
+	STATS_SYS_FSTATAT,
+	STATS_SYS_READDIR,
+	STATS_SYS_GETXATTR,
+	STATS_SYS_SETXATTR,
+	STATS_SYS_IOCTL,
+	STATS_SYS_LINK,
+	STATS_SYS_RENAME,
+	STATS_SYS_UNLINK,
+	STATS_NUM_SYSCALLS,
+
+	STATS_BYTES_READ = STATS_NUM_SYSCALLS,
+	STATS_XATTR_CACHE_HIT,
+	STATS_XATTR_CACHE_MISS,
+	STATS_HASH_CACHE_HIT,
+	STATS_HASH_CACHE_MISS,
+	STATS_NUM_COUNTERS,
+};
+
+enum stats_histogram {
+	STATS_HIST_FILE_HASH = 0,
+	STATS_HIST_DIR_SCAN,
+	STATS_NUM_HISTOGRAMS,
+};
+
+extern int stats_enabled;
+extern uint64_t stats_counters[STATS_NUM_COUNTERS];
+
+static inline void stats_count(enum stats_counter c, uint64_t n)
+{
+	if (stats_enabled)
+		__atomic_fetch_add(&stats_counters[c], n, __ATOMIC_RELAXED);
+}
+
+void stats_start(void);
+void stats_phase_begin(const char *name);
+void stats_phase_end(void);
+uint64_t stats_time(void);
+void stats_latency(enum stats_histogram h, uint64_t start);
+int stats_write_json(const char *path, const char *program);
+
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sumfile.h"
+
+static struct sumfile_writer *w;
+
+static void emit(void *cookie, const uint8_t *hash, const char *dir,
+		 int dirlen, const char *name, int namelen)
+{
+	int i;
+
+	if (w != NULL) {
+		sumfile_write(w, hash, dir, dirlen, name, namelen);
+		return;
+	}
+
+	for (i = 0; i < 64; i++)
+		printf("%.2x", hash[i]);
+	printf("  %.*s%.*s\n", dirlen, dir, namelen, name);
+}
+
+static int convert_text(char *file)
+{
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		perror("fopen");
+		return 1;
+	}
+
+	while (1) {
+		char line[2048];
+		char *slash;
+		int len;
+		uint8_t hash[64];
+
+		if (fgets(line, sizeof(line), fp) == NULL) {
+			if (!feof(fp)) {
+				perror("fgets");
+				fclose(fp);
+				return 1;
+			}
+			break;
+		}
+
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[--len] = 0;
+
+		if (len < 131 || sumfile_parse_hex(hash, line)) {
+			fprintf(stderr, "error parsing line: %s\n", line);
+			continue;
+		}
+
+		slash = strrchr(line + 130, '/');
+		if (slash == NULL)
+			slash = line + 129;
+
+		emit(NULL, hash, line + 130, slash + 1 - (line + 130),
+		     slash + 1, line + len - (slash + 1));
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static int convert(char *file)
+{
+	struct stat buf;
+	char magic[8];
+	void *map;
+	int fd;
+	int ret;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	if (fstat(fd, &buf) < 0 ||
+	    read(fd, magic, sizeof(magic)) != sizeof(magic) ||
+	    !sumfile_is_binary(magic, sizeof(magic))) {
+		close(fd);
+		return convert_text(file);
+	}
+
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	ret = sumfile_parse(file, map, buf.st_size, NULL, emit);
+
+	munmap(map, buf.st_size);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{ "binary", no_argument, 0, 'b', },
+		{ "text", no_argument, 0, 't', },
+		{ 0, 0, 0, 0, },
+	};
+	int binary;
+	int ret;
+	int i;
+
+	binary = -1;
+
+	while (1) {
+		int c;
+
+		c = getopt_long(argc, argv, "bt", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'b':
+			binary = 1;
+			break;
+
+		case 't':
+			binary = 0;
+			break;
+
+		case '?':
+			return 1;
+
+		default:
+			abort();
+		}
+	}
+
+	if (binary == -1 || argc == optind) {
+		fprintf(stderr, "%s: --binary|--text [sumfile]+\n", argv[0]);
+		return 1;
+	}
+
+	if (binary)
+		w = sumfile_writer_open(stdout);
+
+	ret = 0;
+	for (i = optind; i < argc && !ret; i++)
+		ret = convert(argv[i]);
+
+	if (w != NULL && sumfile_writer_close(w))
+		ret = 1;
+
+	return ret;
+}
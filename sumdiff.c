@@ -0,0 +1,836 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <limits.h>
+#include <obstack.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include "compress.h"
+#include "sumfile.h"
+
+/*
+ * Diffs two sum files in bounded memory.  Both inputs are sorted by
+ * path and merge-joined, which finds the modified files and yields
+ * the removed and added paths.  Those two sets are then sorted by
+ * digest and joined again to pair up removed and added paths with
+ * the same contents as renames.  All results are sorted by path once
+ * more for printing.
+ *
+ * Each sort keeps entries in memory up to its limit and spills
+ * sorted runs to a temporary file beyond that.  At most MAX_FAN_IN
+ * runs are merged at once with a heap, in several passes if needed,
+ * and the read buffers for the runs are sized to fit within the limit.
+ */
+#define MIN_SORT_MEMORY		(16 * 1048576)
+#define MAX_FAN_IN		64
+#define MIN_RUN_BUF_SIZE	4096
+#define RUN_BUF_SIZE		262144
+
+struct entry
+{
+	uint8_t			hash[64];
+	uint8_t			type;
+	uint32_t		len;
+	uint32_t		len2;
+	char			path[0];
+};
+
+static size_t entry_size(int len, int len2)
+{
+	return offsetof(struct entry, path) + len + 1 + len2 + 1;
+}
+
+static char *entry_path2(struct entry *e)
+{
+	return e->path + e->len + 1;
+}
+
+/*
+ * All runs of a sort live in one spill file, so that a sort never
+ * has more than two files open, however many runs it spills.
+ */
+struct run
+{
+	off_t			off;
+	off_t			end;
+	char			*buf;
+	size_t			buf_len;
+	size_t			buf_pos;
+	struct entry		*e;
+	size_t			size;
+};
+
+struct sorter
+{
+	int			(*compare)(const struct entry *a,
+					   const struct entry *b);
+	size_t			limit;
+	size_t			used;
+	struct obstack		pool;
+	struct entry		**entries;
+	size_t			num_entries;
+	size_t			max_entries;
+	size_t			next;
+	FILE			*spill;
+	char			*spill_buf;
+	size_t			run_buf_size;
+	struct run		*runs;
+	int			num_runs;
+	struct run		*heap[MAX_FAN_IN];
+	int			heap_size;
+	int			merging;
+	int			top_taken;
+};
+
+static int compare_path(const struct entry *a, const struct entry *b)
+{
+	int ret;
+
+	ret = memcmp(a->path, b->path, a->len < b->len ? a->len : b->len);
+	if (ret)
+		return ret;
+
+	return (a->len > b->len) - (a->len < b->len);
+}
+
+static int compare_hash(const struct entry *a, const struct entry *b)
+{
+	int ret;
+
+	ret = memcmp(a->hash, b->hash, sizeof(a->hash));
+	if (ret)
+		return ret;
+
+	return compare_path(a, b);
+}
+
+#define obstack_chunk_alloc	malloc
+#define obstack_chunk_free	free
+
+static struct sorter *
+sorter_new(int (*compare)(const struct entry *a, const struct entry *b),
+	   size_t limit)
+{
+	struct sorter *s;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		abort();
+
+	s->compare = compare;
+	s->limit = limit;
+	obstack_init(&s->pool);
+	obstack_chunk_size(&s->pool) = 1048576;
+
+	s->run_buf_size = limit / MAX_FAN_IN;
+	if (s->run_buf_size > RUN_BUF_SIZE)
+		s->run_buf_size = RUN_BUF_SIZE;
+	if (s->run_buf_size < MIN_RUN_BUF_SIZE)
+		s->run_buf_size = MIN_RUN_BUF_SIZE;
+
+	return s;
+}
+
+static int qsort_compare(const void *a, const void *b, void *cookie)
+{
+	struct sorter *s = cookie;
+
+	return s->compare(*(struct entry **)a, *(struct entry **)b);
+}
+
+static FILE *spill_file(char **buf, size_t size)
+{
+	const char *dir;
+	char path[PATH_MAX];
+	FILE *fp;
+	int fd;
+
+	dir = getenv("TMPDIR");
+	if (dir == NULL || !*dir)
+		dir = "/tmp";
+
+	snprintf(path, sizeof(path), "%s/sumdiff.XXXXXX", dir);
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(2);
+	}
+	unlink(path);
+
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		perror("fdopen");
+		exit(2);
+	}
+
+	*buf = malloc(size);
+	if (*buf == NULL)
+		abort();
+	setvbuf(fp, *buf, _IOFBF, size);
+
+	return fp;
+}
+
+static void spill_write(FILE *fp, const struct entry *e)
+{
+	if (fwrite(e, entry_size(e->len, e->len2), 1, fp) != 1) {
+		perror("sumdiff: write");
+		exit(2);
+	}
+}
+
+static off_t spill_offset(FILE *fp)
+{
+	off_t off;
+
+	off = ftello(fp);
+	if (off < 0) {
+		perror("sumdiff: ftello");
+		exit(2);
+	}
+
+	return off;
+}
+
+static void spill_flush(FILE *fp)
+{
+	if (fflush(fp) || ferror(fp)) {
+		perror("sumdiff: write");
+		exit(2);
+	}
+}
+
+static struct run *new_run(struct run **runs, int *num)
+{
+	struct run *r;
+
+	*runs = realloc(*runs, (*num + 1) * sizeof(**runs));
+	if (*runs == NULL)
+		abort();
+
+	r = &(*runs)[(*num)++];
+	memset(r, 0, sizeof(*r));
+
+	return r;
+}
+
+static void sorter_spill(struct sorter *s)
+{
+	struct run *r;
+	size_t i;
+
+	qsort_r(s->entries, s->num_entries, sizeof(*s->entries),
+		qsort_compare, s);
+
+	if (s->spill == NULL)
+		s->spill = spill_file(&s->spill_buf, s->run_buf_size);
+
+	r = new_run(&s->runs, &s->num_runs);
+	r->off = spill_offset(s->spill);
+
+	for (i = 0; i < s->num_entries; i++)
+		spill_write(s->spill, s->entries[i]);
+
+	r->end = spill_offset(s->spill);
+
+	obstack_free(&s->pool, NULL);
+	obstack_init(&s->pool);
+	obstack_chunk_size(&s->pool) = 1048576;
+
+	s->num_entries = 0;
+	s->used = 0;
+}
+
+static struct entry *sorter_add(struct sorter *s, int len, int len2)
+{
+	struct entry *e;
+	size_t size;
+
+	size = entry_size(len, len2);
+	if (s->num_entries &&
+	    s->used + size + sizeof(*s->entries) > s->limit) {
+		sorter_spill(s);
+	}
+
+	e = obstack_alloc(&s->pool, size);
+	if (e == NULL)
+		abort();
+
+	e->len = len;
+	e->len2 = len2;
+
+	if (s->num_entries == s->max_entries) {
+		s->max_entries = s->max_entries ? 2 * s->max_entries : 65536;
+		s->entries = realloc(s->entries,
+				     s->max_entries * sizeof(*s->entries));
+		if (s->entries == NULL)
+			abort();
+	}
+
+	s->entries[s->num_entries++] = e;
+	s->used += size + sizeof(*s->entries);
+
+	return e;
+}
+
+static int run_read(struct sorter *s, struct run *r, void *dst, size_t len)
+{
+	while (len) {
+		size_t n;
+
+		if (r->buf_pos == r->buf_len) {
+			ssize_t ret;
+
+			if (r->off == r->end)
+				return 1;
+
+			n = s->run_buf_size;
+			if (n > r->end - r->off)
+				n = r->end - r->off;
+
+			ret = pread(fileno(s->spill), r->buf, n, r->off);
+			if (ret <= 0) {
+				if (ret < 0)
+					perror("sumdiff: read");
+				else
+					fprintf(stderr, "sumdiff: short read "
+							"from spill file\n");
+				exit(2);
+			}
+
+			r->off += ret;
+			r->buf_len = ret;
+			r->buf_pos = 0;
+		}
+
+		n = r->buf_len - r->buf_pos;
+		if (n > len)
+			n = len;
+
+		memcpy(dst, r->buf + r->buf_pos, n);
+		r->buf_pos += n;
+		dst = (char *)dst + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int run_next(struct sorter *s, struct run *r)
+{
+	struct entry hdr;
+	size_t size;
+
+	if (run_read(s, r, &hdr, offsetof(struct entry, path)))
+		return 1;
+
+	size = entry_size(hdr.len, hdr.len2);
+	if (r->size < size) {
+		r->size = size;
+		free(r->e);
+		r->e = malloc(size);
+		if (r->e == NULL)
+			abort();
+	}
+
+	memcpy(r->e, &hdr, offsetof(struct entry, path));
+	if (run_read(s, r, r->e->path, size - offsetof(struct entry, path))) {
+		fprintf(stderr, "sumdiff: short read from spill file\n");
+		exit(2);
+	}
+
+	return 0;
+}
+
+static int heap_less(struct sorter *s, int a, int b)
+{
+	return s->compare(s->heap[a]->e, s->heap[b]->e) < 0;
+}
+
+static void heap_down(struct sorter *s, int i)
+{
+	while (1) {
+		struct run *r;
+		int min;
+
+		min = i;
+		if (2 * i + 1 < s->heap_size && heap_less(s, 2 * i + 1, min))
+			min = 2 * i + 1;
+		if (2 * i + 2 < s->heap_size && heap_less(s, 2 * i + 2, min))
+			min = 2 * i + 2;
+
+		if (min == i)
+			break;
+
+		r = s->heap[i];
+		s->heap[i] = s->heap[min];
+		s->heap[min] = r;
+		i = min;
+	}
+}
+
+static void merge_start(struct sorter *s, struct run *runs, int num)
+{
+	int i;
+
+	s->heap_size = 0;
+	s->top_taken = 0;
+
+	for (i = 0; i < num; i++) {
+		struct run *r = &runs[i];
+
+		r->buf = malloc(s->run_buf_size);
+		if (r->buf == NULL)
+			abort();
+
+		if (!run_next(s, r))
+			s->heap[s->heap_size++] = r;
+	}
+
+	for (i = s->heap_size / 2 - 1; i >= 0; i--)
+		heap_down(s, i);
+}
+
+static struct entry *merge_next(struct sorter *s)
+{
+	if (s->top_taken) {
+		if (run_next(s, s->heap[0]))
+			s->heap[0] = s->heap[--s->heap_size];
+		heap_down(s, 0);
+	}
+
+	if (!s->heap_size)
+		return NULL;
+
+	s->top_taken = 1;
+
+	return s->heap[0]->e;
+}
+
+static void free_runs(struct run *runs, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		free(runs[i].buf);
+		free(runs[i].e);
+	}
+
+	free(runs);
+}
+
+/*
+ * Merges groups of MAX_FAN_IN runs into single runs in a new spill
+ * file, until few enough runs are left for the final merge.
+ */
+static void merge_pass(struct sorter *s)
+{
+	FILE *spill;
+	char *spill_buf;
+	struct run *runs;
+	int num_runs;
+	int i;
+
+	spill = spill_file(&spill_buf, s->run_buf_size);
+	runs = NULL;
+	num_runs = 0;
+
+	for (i = 0; i < s->num_runs; i += MAX_FAN_IN) {
+		struct run *r;
+		struct entry *e;
+		int num;
+
+		num = s->num_runs - i;
+		if (num > MAX_FAN_IN)
+			num = MAX_FAN_IN;
+
+		r = new_run(&runs, &num_runs);
+		r->off = spill_offset(spill);
+
+		merge_start(s, s->runs + i, num);
+		while ((e = merge_next(s)) != NULL)
+			spill_write(spill, e);
+
+		r->end = spill_offset(spill);
+
+		for (; num; num--) {
+			free(s->runs[i + num - 1].buf);
+			s->runs[i + num - 1].buf = NULL;
+		}
+	}
+
+	spill_flush(spill);
+
+	fclose(s->spill);
+	free(s->spill_buf);
+	free_runs(s->runs, s->num_runs);
+
+	s->spill = spill;
+	s->spill_buf = spill_buf;
+	s->runs = runs;
+	s->num_runs = num_runs;
+}
+
+/*
+ * Inputs that fit within the limit are sorted in memory and never
+ * touch the disk.
+ */
+static void sorter_finish(struct sorter *s)
+{
+	if (!s->num_runs) {
+		qsort_r(s->entries, s->num_entries, sizeof(*s->entries),
+			qsort_compare, s);
+		s->next = 0;
+		return;
+	}
+
+	if (s->num_entries)
+		sorter_spill(s);
+	free(s->entries);
+	s->entries = NULL;
+
+	spill_flush(s->spill);
+	while (s->num_runs > MAX_FAN_IN)
+		merge_pass(s);
+
+	merge_start(s, s->runs, s->num_runs);
+	s->merging = 1;
+}
+
+/*
+ * Returns the next entry in sorted order, which stays valid until
+ * the next call.
+ */
+static struct entry *sorter_next(struct sorter *s)
+{
+	if (!s->merging) {
+		if (s->next == s->num_entries)
+			return NULL;
+		return s->entries[s->next++];
+	}
+
+	return merge_next(s);
+}
+
+static void sorter_free(struct sorter *s)
+{
+	if (s->spill != NULL)
+		fclose(s->spill);
+	free(s->spill_buf);
+	free_runs(s->runs, s->num_runs);
+
+	obstack_free(&s->pool, NULL);
+	free(s->entries);
+	free(s);
+}
+
+static struct sorter *load(const char *file, size_t limit)
+{
+	struct sumfile_reader *r;
+	struct sorter *s;
+	uint8_t head[8];
+	size_t n;
+	FILE *fp;
+
+	if (!strcmp(file, "-")) {
+		fp = stdin;
+	} else {
+		fp = fopen(file, "r");
+		if (fp == NULL) {
+			perror(file);
+			exit(2);
+		}
+	}
+
+	n = fread(head, 1, sizeof(head), fp);
+	if (decompress_is_zstd(head, n)) {
+		fp = decompress_open(fp, file, head, n);
+		if (fp == NULL)
+			exit(2);
+		n = 0;
+	}
+
+	r = sumfile_reader_open(fp, file, head, n);
+	if (r == NULL)
+		exit(2);
+
+	s = sorter_new(compare_path, limit);
+
+	while (1) {
+		uint8_t hash[64];
+		const char *dir;
+		int dirlen;
+		const char *name;
+		int namelen;
+		struct entry *e;
+		int ret;
+
+		ret = sumfile_read(r, hash, &dir, &dirlen, &name, &namelen);
+		if (ret < 0)
+			exit(2);
+		if (ret)
+			break;
+
+		e = sorter_add(s, dirlen + namelen, 0);
+		memcpy(e->hash, hash, sizeof(e->hash));
+		memcpy(e->path, dir, dirlen);
+		memcpy(e->path + dirlen, name, namelen);
+		e->path[dirlen + namelen] = 0;
+		e->path[dirlen + namelen + 1] = 0;
+	}
+
+	sumfile_reader_close(r);
+	if (fp != stdin)
+		fclose(fp);
+
+	sorter_finish(s);
+
+	return s;
+}
+
+static void add_result(struct sorter *out, int type, const uint8_t *hash,
+		       const struct entry *a, const struct entry *b)
+{
+	struct entry *e;
+
+	e = sorter_add(out, a->len, b != NULL ? b->len : 0);
+	memcpy(e->hash, hash, sizeof(e->hash));
+	e->type = type;
+	memcpy(e->path, a->path, a->len + 1);
+	if (b != NULL)
+		memcpy(entry_path2(e), b->path, b->len + 1);
+	else
+		*entry_path2(e) = 0;
+}
+
+static void copy_entry(struct sorter *s, const struct entry *a)
+{
+	struct entry *e;
+
+	e = sorter_add(s, a->len, 0);
+	memcpy(e, a, entry_size(a->len, 0));
+}
+
+static void join_paths(struct sorter *old, struct sorter *new,
+		       struct sorter *removed, struct sorter *added,
+		       struct sorter *out)
+{
+	struct entry *a;
+	struct entry *b;
+
+	a = sorter_next(old);
+	b = sorter_next(new);
+	while (a != NULL || b != NULL) {
+		int ret;
+
+		if (a == NULL)
+			ret = 1;
+		else if (b == NULL)
+			ret = -1;
+		else
+			ret = compare_path(a, b);
+
+		if (ret == 0) {
+			if (memcmp(a->hash, b->hash, sizeof(a->hash)))
+				add_result(out, 'M', b->hash, b, NULL);
+			a = sorter_next(old);
+			b = sorter_next(new);
+		} else if (ret < 0) {
+			copy_entry(removed, a);
+			a = sorter_next(old);
+		} else {
+			copy_entry(added, b);
+			b = sorter_next(new);
+		}
+	}
+}
+
+/*
+ * Removed and added entries come in digest order, and within a
+ * digest in path order, so when several files share a digest, they
+ * are paired up as renames in path order and the rest are reported
+ * as removed or added.
+ */
+static void join_hashes(struct sorter *removed, struct sorter *added,
+			struct sorter *out)
+{
+	struct entry *a;
+	struct entry *b;
+
+	a = sorter_next(removed);
+	b = sorter_next(added);
+	while (a != NULL || b != NULL) {
+		int ret;
+
+		if (a == NULL)
+			ret = 1;
+		else if (b == NULL)
+			ret = -1;
+		else
+			ret = memcmp(a->hash, b->hash, sizeof(a->hash));
+
+		if (ret == 0) {
+			add_result(out, 'R', a->hash, a, b);
+			a = sorter_next(removed);
+			b = sorter_next(added);
+		} else if (ret < 0) {
+			add_result(out, 'D', a->hash, a, NULL);
+			a = sorter_next(removed);
+		} else {
+			add_result(out, 'A', b->hash, b, NULL);
+			b = sorter_next(added);
+		}
+	}
+}
+
+static int parse_size(const char *arg, size_t *val)
+{
+	char *end;
+
+	*val = strtoull(arg, &end, 0);
+	if (*end == 'k' || *end == 'K') {
+		*val <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		*val <<= 20;
+		end++;
+	} else if (*end == 'g' || *end == 'G') {
+		*val <<= 30;
+		end++;
+	}
+
+	return *end != 0 || *val == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{ "memory", required_argument, 0, 'm', },
+		{ 0, 0, 0, 0, },
+	};
+	unsigned long long count[256];
+	struct sorter *old;
+	struct sorter *new;
+	struct sorter *removed;
+	struct sorter *added;
+	struct sorter *out;
+	struct entry *e;
+	size_t memory;
+	size_t limit;
+
+	memory = 1024 * 1048576;
+
+	while (1) {
+		int c;
+
+		c = getopt_long(argc, argv, "m:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'm':
+			if (parse_size(optarg, &memory)) {
+				fprintf(stderr, "%s: invalid memory limit: "
+						"%s\n", argv[0], optarg);
+				return 2;
+			}
+			break;
+
+		case '?':
+			return 2;
+
+		default:
+			abort();
+		}
+	}
+
+	if (argc - optind != 2) {
+		fprintf(stderr, "%s: [--memory=BYTES[K|M|G]] OLD NEW\n",
+			argv[0]);
+		return 2;
+	}
+
+	old = load(argv[optind], memory / 2);
+	new = load(argv[optind + 1], memory / 2);
+
+	/*
+	 * Whatever the inputs didn't need to keep in memory is shared
+	 * among the three sorts of the join phase.
+	 */
+	limit = 0;
+	if (memory > old->used + new->used)
+		limit = (memory - old->used - new->used) / 3;
+	if (limit < MIN_SORT_MEMORY)
+		limit = MIN_SORT_MEMORY;
+
+	removed = sorter_new(compare_hash, limit);
+	added = sorter_new(compare_hash, limit);
+	out = sorter_new(compare_path, limit);
+
+	join_paths(old, new, removed, added, out);
+	sorter_free(old);
+	sorter_free(new);
+
+	sorter_finish(removed);
+	sorter_finish(added);
+	join_hashes(removed, added, out);
+	sorter_free(removed);
+	sorter_free(added);
+
+	sorter_finish(out);
+
+	memset(count, 0, sizeof(count));
+	while ((e = sorter_next(out)) != NULL) {
+		int i;
+
+		count[e->type]++;
+
+		printf("%c ", e->type);
+		if (e->type != 'D') {
+			for (i = 0; i < sizeof(e->hash); i++)
+				printf("%.2x", e->hash[i]);
+			printf(" ");
+		}
+
+		if (e->type == 'R')
+			printf(" %s -> %s\n", e->path, entry_path2(e));
+		else
+			printf(" %s\n", e->path);
+	}
+
+	sorter_free(out);
+
+	if (fflush(stdout) || ferror(stdout)) {
+		perror("sumdiff: write");
+		return 2;
+	}
+
+	fprintf(stderr, "sumdiff: %llu added, %llu removed, %llu modified, "
+			"%llu renamed\n", count['A'], count['D'], count['M'],
+		count['R']);
+
+	return (count['A'] || count['D'] || count['M'] || count['R']) ? 1 : 0;
+}
@@ -0,0 +1,640 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iv_avl.h>
+#include <string.h>
+#include "sumfile.h"
+
+struct sumfile_dir
+{
+	struct iv_avl_node	an;
+	uint32_t		id;
+	int			len;
+	char			name[0];
+};
+
+struct sumfile_writer
+{
+	FILE			*fp;
+	uint64_t		check;
+	uint64_t		num_files;
+	uint32_t		num_dirs;
+	struct iv_avl_tree	dirs;
+	struct sumfile_dir	*last;
+};
+
+static uint64_t fnv1a(uint64_t h, const void *_buf, size_t len)
+{
+	const uint8_t *buf = _buf;
+
+	while (len--) {
+		h ^= *buf++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+#define FNV1A_INIT	0xcbf29ce484222325ULL
+
+static void put_le(uint8_t *dst, uint64_t val, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		dst[i] = val >> (8 * i);
+}
+
+static uint64_t get_le(const uint8_t *src, int bytes)
+{
+	uint64_t val;
+	int i;
+
+	val = 0;
+	for (i = 0; i < bytes; i++)
+		val |= ((uint64_t)src[i]) << (8 * i);
+
+	return val;
+}
+
+static int compare_dirs(const struct iv_avl_node *_a,
+			const struct iv_avl_node *_b)
+{
+	const struct sumfile_dir *a;
+	const struct sumfile_dir *b;
+	int ret;
+
+	a = iv_container_of(_a, struct sumfile_dir, an);
+	b = iv_container_of(_b, struct sumfile_dir, an);
+
+	ret = memcmp(a->name, b->name, a->len < b->len ? a->len : b->len);
+	if (ret)
+		return ret;
+
+	return a->len - b->len;
+}
+
+static struct sumfile_dir *
+find_dir(struct iv_avl_tree *tree, const char *name, int len)
+{
+	struct iv_avl_node *an;
+
+	an = tree->root;
+	while (an != NULL) {
+		struct sumfile_dir *d;
+		int ret;
+
+		d = iv_container_of(an, struct sumfile_dir, an);
+
+		ret = memcmp(name, d->name, len < d->len ? len : d->len);
+		if (ret == 0)
+			ret = len - d->len;
+		if (ret == 0)
+			return d;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static void emit(struct sumfile_writer *w, const void *buf, size_t len)
+{
+	w->check = fnv1a(w->check, buf, len);
+	fwrite(buf, 1, len, w->fp);
+}
+
+struct sumfile_writer *sumfile_writer_open(FILE *fp)
+{
+	struct sumfile_writer *w;
+	uint8_t hdr[SUMFILE_HEADER_SIZE];
+
+	w = malloc(sizeof(*w));
+	if (w == NULL)
+		abort();
+
+	w->fp = fp;
+	w->check = FNV1A_INIT;
+	w->num_files = 0;
+	w->num_dirs = 0;
+	INIT_IV_AVL_TREE(&w->dirs, compare_dirs);
+	w->last = NULL;
+
+	memcpy(hdr, SUMFILE_MAGIC, 8);
+	put_le(hdr + 8, SUMFILE_VERSION, 4);
+	put_le(hdr + 12, 0, 4);
+	emit(w, hdr, sizeof(hdr));
+
+	return w;
+}
+
+void sumfile_write(struct sumfile_writer *w, const uint8_t *hash,
+		   const char *dir, int dirlen, const char *name, int namelen)
+{
+	struct sumfile_dir *d;
+	uint8_t rec[1 + 4 + 64 + 2];
+
+	if (dirlen > 65535 || namelen > 65535) {
+		fprintf(stderr, "sumfile: path too long: %.*s%.*s\n",
+			dirlen, dir, namelen, name);
+		return;
+	}
+
+	/*
+	 * Files from the same directory mostly arrive back to back,
+	 * so check the previous directory before searching the table.
+	 */
+	d = w->last;
+	if (d == NULL || d->len != dirlen || memcmp(d->name, dir, dirlen))
+		d = find_dir(&w->dirs, dir, dirlen);
+
+	if (d == NULL) {
+		d = malloc(sizeof(*d) + dirlen);
+		if (d == NULL)
+			abort();
+
+		d->id = w->num_dirs++;
+		d->len = dirlen;
+		memcpy(d->name, dir, dirlen);
+		iv_avl_tree_insert(&w->dirs, &d->an);
+
+		rec[0] = 'D';
+		put_le(rec + 1, dirlen, 2);
+		emit(w, rec, 3);
+		emit(w, dir, dirlen);
+	}
+
+	w->last = d;
+
+	rec[0] = 'F';
+	put_le(rec + 1, d->id, 4);
+	memcpy(rec + 5, hash, 64);
+	put_le(rec + 69, namelen, 2);
+	emit(w, rec, sizeof(rec));
+	emit(w, name, namelen);
+
+	w->num_files++;
+}
+
+int sumfile_writer_close(struct sumfile_writer *w)
+{
+	struct iv_avl_node *an;
+	struct iv_avl_node *an2;
+	uint8_t rec[1 + 8 + 8];
+	int ret;
+
+	rec[0] = 'E';
+	put_le(rec + 1, w->num_files, 8);
+	w->check = fnv1a(w->check, rec, 9);
+	put_le(rec + 9, w->check, 8);
+	fwrite(rec, 1, sizeof(rec), w->fp);
+
+	ret = 0;
+	if (fflush(w->fp) || ferror(w->fp)) {
+		perror("sumfile: write");
+		ret = 1;
+	}
+
+	iv_avl_tree_for_each_safe (an, an2, &w->dirs) {
+		iv_avl_tree_delete(&w->dirs, an);
+		free(iv_container_of(an, struct sumfile_dir, an));
+	}
+
+	free(w);
+
+	return ret;
+}
+
+int sumfile_is_binary(const void *buf, size_t len)
+{
+	return len >= 8 && !memcmp(buf, SUMFILE_MAGIC, 8);
+}
+
+static int hextoval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+
+	if (c >= 'A' && c <= 'F')
+		return 10 + (c - 'A');
+
+	if (c >= 'a' && c <= 'f')
+		return 10 + (c - 'a');
+
+	return -1;
+}
+
+int sumfile_parse_hex(uint8_t *hash, const char *text)
+{
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		int val;
+		int val2;
+
+		val = hextoval(text[2 * i]);
+		if (val < 0)
+			return 1;
+
+		val2 = hextoval(text[2 * i + 1]);
+		if (val2 < 0)
+			return 1;
+
+		hash[i] = (val << 4) | val2;
+	}
+
+	return 0;
+}
+
+struct dir_ref
+{
+	const char	*name;
+	int		len;
+};
+
+int sumfile_parse(const char *file, const void *_buf, size_t len, void *cookie,
+		  void (*cb)(void *cookie, const uint8_t *hash,
+			     const char *dir, int dirlen,
+			     const char *name, int namelen))
+{
+	const uint8_t *buf = _buf;
+	const uint8_t *p;
+	const uint8_t *end;
+	struct dir_ref *dirs;
+	uint32_t num_dirs;
+	uint32_t max_dirs;
+	uint64_t num_files;
+
+	if (len < SUMFILE_HEADER_SIZE + 17 || !sumfile_is_binary(buf, len)) {
+		fprintf(stderr, "%s: not a binary sum file\n", file);
+		return 1;
+	}
+
+	if (get_le(buf + 8, 4) != SUMFILE_VERSION) {
+		fprintf(stderr, "%s: unsupported binary sum file version "
+				"%d\n", file, (int)get_le(buf + 8, 4));
+		return 1;
+	}
+
+	/*
+	 * Verify the checksum up front, so that nothing acts on the
+	 * contents of a truncated or corrupt file.
+	 */
+	end = buf + len - 17;
+	if (end[0] != 'E' ||
+	    get_le(end + 9, 8) != fnv1a(FNV1A_INIT, buf, len - 8)) {
+		fprintf(stderr, "%s: binary sum file is truncated or "
+				"corrupt\n", file);
+		return 1;
+	}
+
+	dirs = NULL;
+	num_dirs = 0;
+	max_dirs = 0;
+	num_files = 0;
+
+	p = buf + SUMFILE_HEADER_SIZE;
+	while (p < end) {
+		if (p[0] == 'D' && end - p >= 3 &&
+		    end - p - 3 >= get_le(p + 1, 2)) {
+			if (num_dirs == max_dirs) {
+				max_dirs = max_dirs ? 2 * max_dirs : 1024;
+				dirs = realloc(dirs, max_dirs * sizeof(*dirs));
+				if (dirs == NULL)
+					abort();
+			}
+
+			dirs[num_dirs].name = (const char *)p + 3;
+			dirs[num_dirs].len = get_le(p + 1, 2);
+			num_dirs++;
+
+			p += 3 + get_le(p + 1, 2);
+		} else if (p[0] == 'F' && end - p >= 71 &&
+			   get_le(p + 1, 4) < num_dirs &&
+			   end - p - 71 >= get_le(p + 69, 2)) {
+			struct dir_ref *d;
+
+			d = &dirs[get_le(p + 1, 4)];
+			cb(cookie, p + 5, d->name, d->len,
+			   (const char *)p + 71, get_le(p + 69, 2));
+			num_files++;
+
+			p += 71 + get_le(p + 69, 2);
+		} else {
+			break;
+		}
+	}
+
+	free(dirs);
+
+	if (p != end || get_le(end + 1, 8) != num_files) {
+		fprintf(stderr, "%s: malformed binary sum file\n", file);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The reader buffer has to hold at least one complete record, which
+ * for binary files is at most 71 + 65535 bytes.
+ */
+#define READER_BUF_SIZE		1048576
+
+struct reader_dir
+{
+	char		*name;
+	int		len;
+};
+
+struct sumfile_reader
+{
+	FILE			*fp;
+	const char		*file;
+	int			binary;
+	int			done;
+	uint8_t			*buf;
+	size_t			pos;
+	size_t			len;
+	uint64_t		check;
+	uint64_t		num_files;
+	struct reader_dir	*dirs;
+	uint32_t		num_dirs;
+	uint32_t		max_dirs;
+};
+
+/*
+ * Makes sure that at least need bytes are buffered past the read
+ * position, and returns nonzero if the input ends before that.
+ */
+static int reader_fill(struct sumfile_reader *r, size_t need)
+{
+	if (r->len - r->pos >= need)
+		return 0;
+
+	if (r->pos) {
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+	}
+
+	while (r->len < need) {
+		size_t n;
+
+		n = fread(r->buf + r->len, 1, READER_BUF_SIZE - r->len, r->fp);
+		if (n == 0)
+			return 1;
+
+		r->len += n;
+	}
+
+	return 0;
+}
+
+static void reader_consume(struct sumfile_reader *r, size_t len)
+{
+	if (r->binary)
+		r->check = fnv1a(r->check, r->buf + r->pos, len);
+	r->pos += len;
+}
+
+struct sumfile_reader *sumfile_reader_open(FILE *fp, const char *file,
+					   const void *head, size_t head_len)
+{
+	struct sumfile_reader *r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		abort();
+
+	r->buf = malloc(READER_BUF_SIZE);
+	if (r->buf == NULL)
+		abort();
+
+	r->fp = fp;
+	r->file = file;
+	memcpy(r->buf, head, head_len);
+	r->len = head_len;
+	r->check = FNV1A_INIT;
+
+	reader_fill(r, SUMFILE_HEADER_SIZE);
+	if (sumfile_is_binary(r->buf, r->len)) {
+		if (r->len < SUMFILE_HEADER_SIZE ||
+		    get_le(r->buf + 8, 4) != SUMFILE_VERSION) {
+			fprintf(stderr, "%s: unsupported binary sum file\n",
+				file);
+			free(r->buf);
+			free(r);
+			return NULL;
+		}
+
+		r->binary = 1;
+		reader_consume(r, SUMFILE_HEADER_SIZE);
+	}
+
+	return r;
+}
+
+static int read_text(struct sumfile_reader *r, uint8_t *hash,
+		     const char **dir, int *dirlen,
+		     const char **name, int *namelen)
+{
+	while (1) {
+		char *line;
+		char *nl;
+		char *slash;
+		size_t scanned;
+		int len;
+
+		scanned = 0;
+		while (1) {
+			line = (char *)r->buf + r->pos;
+			nl = memchr(line + scanned, '\n',
+				    r->len - r->pos - scanned);
+			if (nl != NULL)
+				break;
+
+			scanned = r->len - r->pos;
+			if (scanned == READER_BUF_SIZE) {
+				fprintf(stderr, "%s: line too long\n",
+					r->file);
+				return -1;
+			}
+
+			if (reader_fill(r, scanned + 1)) {
+				if (ferror(r->fp)) {
+					fprintf(stderr, "%s: read error\n",
+						r->file);
+					return -1;
+				}
+
+				/*
+				 * Take a last line without a newline
+				 * as is.
+				 */
+				if (!scanned)
+					return 1;
+				line = (char *)r->buf + r->pos;
+				nl = line + scanned;
+				break;
+			}
+		}
+
+		len = nl - line;
+		r->pos += (nl < (char *)r->buf + r->len) ? len + 1 : len;
+
+		if (len < 131 || sumfile_parse_hex(hash, line) ||
+		    line[128] != ' ' || line[129] != ' ') {
+			fprintf(stderr, "error parsing line: %.*s\n",
+				len, line);
+			continue;
+		}
+
+		slash = memrchr(line + 130, '/', len - 130);
+		if (slash == NULL)
+			slash = line + 129;
+
+		*dir = line + 130;
+		*dirlen = slash + 1 - (line + 130);
+		*name = slash + 1;
+		*namelen = nl - (slash + 1);
+
+		return 0;
+	}
+}
+
+static int read_binary(struct sumfile_reader *r, uint8_t *hash,
+		       const char **dir, int *dirlen,
+		       const char **name, int *namelen)
+{
+	while (!r->done) {
+		const uint8_t *p;
+
+		if (reader_fill(r, 1))
+			break;
+		p = r->buf + r->pos;
+
+		if (p[0] == 'D') {
+			struct reader_dir *d;
+			int len;
+
+			if (reader_fill(r, 3))
+				break;
+			p = r->buf + r->pos;
+			len = get_le(p + 1, 2);
+			if (reader_fill(r, 3 + len))
+				break;
+			p = r->buf + r->pos;
+
+			if (r->num_dirs == r->max_dirs) {
+				r->max_dirs = r->max_dirs ?
+						2 * r->max_dirs : 1024;
+				r->dirs = realloc(r->dirs, r->max_dirs *
+							   sizeof(*r->dirs));
+				if (r->dirs == NULL)
+					abort();
+			}
+
+			d = &r->dirs[r->num_dirs++];
+			d->name = malloc(len ? len : 1);
+			if (d->name == NULL)
+				abort();
+			memcpy(d->name, p + 3, len);
+			d->len = len;
+
+			reader_consume(r, 3 + len);
+		} else if (p[0] == 'F') {
+			struct reader_dir *d;
+			int len;
+
+			if (reader_fill(r, 71))
+				break;
+			p = r->buf + r->pos;
+			len = get_le(p + 69, 2);
+			if (get_le(p + 1, 4) >= r->num_dirs ||
+			    reader_fill(r, 71 + len)) {
+				break;
+			}
+			p = r->buf + r->pos;
+
+			d = &r->dirs[get_le(p + 1, 4)];
+			memcpy(hash, p + 5, 64);
+			*dir = d->name;
+			*dirlen = d->len;
+			*name = (const char *)p + 71;
+			*namelen = len;
+
+			reader_consume(r, 71 + len);
+			r->num_files++;
+
+			return 0;
+		} else if (p[0] == 'E') {
+			if (reader_fill(r, 17))
+				break;
+			p = r->buf + r->pos;
+
+			if (get_le(p + 1, 8) != r->num_files ||
+			    get_le(p + 9, 8) !=
+			    fnv1a(r->check, p, 9)) {
+				break;
+			}
+
+			r->pos += 17;
+			r->done = 1;
+		} else {
+			break;
+		}
+	}
+
+	if (!r->done || r->pos != r->len || !reader_fill(r, 1)) {
+		fprintf(stderr, "%s: binary sum file is truncated or "
+				"corrupt\n", r->file);
+		return -1;
+	}
+
+	return 1;
+}
+
+int sumfile_read(struct sumfile_reader *r, uint8_t *hash,
+		 const char **dir, int *dirlen,
+		 const char **name, int *namelen)
+{
+	if (r->binary)
+		return read_binary(r, hash, dir, dirlen, name, namelen);
+
+	return read_text(r, hash, dir, dirlen, name, namelen);
+}
+
+void sumfile_reader_close(struct sumfile_reader *r)
+{
+	uint32_t i;
+
+	for (i = 0; i < r->num_dirs; i++)
+		free(r->dirs[i].name);
+	free(r->dirs);
+	free(r->buf);
+	free(r);
+}
@@ -0,0 +1,85 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __SUMFILE_H
+#define __SUMFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Binary sum file format.  All integers are little endian.
+ *
+ * The file starts with a 16 byte header:
+ *
+ *	8	magic, "MKSUMBIN"
+ *	4	format version, SUMFILE_VERSION
+ *	4	reserved, zero
+ *
+ * followed by a sequence of records, each starting with a type byte:
+ *
+ *	'D'	directory prefix: u16 length, bytes.  Prefixes are
+ *		numbered in order of appearance, starting at zero, and
+ *		include the trailing slash.
+ *	'F'	file: u32 directory prefix index, 64 byte SHA-512
+ *		digest, u16 basename length, basename bytes.
+ *	'E'	end: u64 number of 'F' records, u64 FNV-1a hash of all
+ *		preceding bytes in the file, including this record's
+ *		type byte and record count.
+ *
+ * A file's path is its directory prefix followed by its basename.
+ */
+#define SUMFILE_MAGIC		"MKSUMBIN"
+#define SUMFILE_VERSION		1
+#define SUMFILE_HEADER_SIZE	16
+
+struct sumfile_writer;
+
+struct sumfile_writer *sumfile_writer_open(FILE *fp);
+void sumfile_write(struct sumfile_writer *w, const uint8_t *hash,
+		   const char *dir, int dirlen, const char *name, int namelen);
+int sumfile_writer_close(struct sumfile_writer *w);
+
+int sumfile_is_binary(const void *buf, size_t len);
+int sumfile_parse_hex(uint8_t *hash, const char *text);
+int sumfile_parse(const char *file, const void *buf, size_t len, void *cookie,
+		  void (*cb)(void *cookie, const uint8_t *hash,
+			     const char *dir, int dirlen,
+			     const char *name, int namelen));
+
+/*
+ * Streaming reader for text and binary sum files, for inputs that
+ * can't be mapped or are too large to hold in memory.  head/head_len
+ * are bytes that the caller already read from fp to sniff the format.
+ * sumfile_read() returns 0 for an entry, whose dir and name pointers
+ * stay valid until the next call, 1 at the end of the input, and -1
+ * on error.  The binary checksum can only be checked once the 'E'
+ * record is reached.
+ */
+struct sumfile_reader;
+
+struct sumfile_reader *sumfile_reader_open(FILE *fp, const char *file,
+					   const void *head, size_t head_len);
+int sumfile_read(struct sumfile_reader *r, uint8_t *hash,
+		 const char **dir, int *dirlen,
+		 const char **name, int *namelen);
+void sumfile_reader_close(struct sumfile_reader *r);
+
+
+#endif
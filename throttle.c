@@ -0,0 +1,225 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "mksums_common.h"
+
+/*
+ * Read throttling for runs on live systems.  All readers share one
+ * token bucket, implemented as a virtual clock: each read pushes the
+ * clock forward by the time its bytes and its one I/O operation take
+ * at the current rate limits, and a reader that gets ahead of the
+ * wall clock sleeps until the clock catches up.  Up to
+ * THROTTLE_BURST of unused time is credited, to absorb small stalls.
+ *
+ * If a latency target is set, the average read latency is checked
+ * every THROTTLE_WINDOW.  When it's over the target, the current limits
+ * are cut to THROTTLE_BACKOFF of what the last window actually
+ * achieved, and otherwise they grow by THROTTLE_GROWTH per window, up
+ * to the configured maximum (or without bound if none was given).
+ */
+#define THROTTLE_BURST		50000000ULL
+#define THROTTLE_WINDOW		100000000ULL
+#define THROTTLE_BACKOFF	0.7
+#define THROTTLE_GROWTH		1.1
+#define THROTTLE_MIN_BW		65536.0
+#define THROTTLE_MIN_IOPS	1.0
+
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_WHO_PROCESS	1
+
+int throttle_enabled;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double max_bw;
+static double max_iops;
+static uint64_t target_latency;
+
+static double cur_bw;
+static double cur_iops;
+static uint64_t vclock;
+
+static uint64_t win_start;
+static uint64_t win_bytes;
+static uint64_t win_ops;
+static uint64_t win_latency;
+
+static uint64_t backoffs;
+static uint64_t slept;
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int throttle_init(uint64_t bandwidth, uint64_t iops, int latency_ms,
+		  int idle)
+{
+	if (idle && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0) {
+		perror("ioprio_set");
+		return 1;
+	}
+
+	if (!bandwidth && !iops && !latency_ms)
+		return 0;
+
+	max_bw = bandwidth;
+	max_iops = iops;
+	target_latency = latency_ms * 1000000ULL;
+
+	cur_bw = max_bw;
+	cur_iops = max_iops;
+
+	vclock = now();
+	win_start = vclock;
+
+	throttle_enabled = 1;
+
+	return 0;
+}
+
+uint64_t throttle_start(void)
+{
+	return throttle_enabled ? now() : 0;
+}
+
+static void adapt(uint64_t t)
+{
+	double secs;
+	double bw;
+	double iops;
+
+	secs = (t - win_start) / 1e9;
+	bw = win_bytes / secs;
+	iops = win_ops / secs;
+
+	if (win_latency / win_ops > target_latency) {
+		if (!cur_bw || cur_bw > bw)
+			cur_bw = bw;
+		cur_bw *= THROTTLE_BACKOFF;
+		if (cur_bw < THROTTLE_MIN_BW)
+			cur_bw = THROTTLE_MIN_BW;
+
+		if (!cur_iops || cur_iops > iops)
+			cur_iops = iops;
+		cur_iops *= THROTTLE_BACKOFF;
+		if (cur_iops < THROTTLE_MIN_IOPS)
+			cur_iops = THROTTLE_MIN_IOPS;
+
+		backoffs++;
+	} else {
+		if (cur_bw) {
+			cur_bw *= THROTTLE_GROWTH;
+			if (max_bw && cur_bw > max_bw)
+				cur_bw = max_bw;
+		}
+
+		if (cur_iops) {
+			cur_iops *= THROTTLE_GROWTH;
+			if (max_iops && cur_iops > max_iops)
+				cur_iops = max_iops;
+		}
+	}
+
+	win_start = t;
+	win_bytes = 0;
+	win_ops = 0;
+	win_latency = 0;
+}
+
+void throttle_io(uint64_t start, size_t bytes)
+{
+	uint64_t t;
+	uint64_t cost;
+	uint64_t wake;
+
+	if (!throttle_enabled)
+		return;
+
+	t = now();
+
+	pthread_mutex_lock(&lock);
+
+	win_bytes += bytes;
+	win_ops++;
+	win_latency += t - start;
+	if (target_latency && t - win_start >= THROTTLE_WINDOW)
+		adapt(t);
+
+	cost = 0;
+	if (cur_bw && bytes * 1e9 / cur_bw > cost)
+		cost = bytes * 1e9 / cur_bw;
+	if (cur_iops && 1e9 / cur_iops > cost)
+		cost = 1e9 / cur_iops;
+
+	if (vclock + THROTTLE_BURST < t)
+		vclock = t - THROTTLE_BURST;
+	vclock += cost;
+	wake = vclock;
+
+	pthread_mutex_unlock(&lock);
+
+	if (wake > t) {
+		struct timespec ts;
+
+		ts.tv_sec = (wake - t) / 1000000000;
+		ts.tv_nsec = (wake - t) % 1000000000;
+		nanosleep(&ts, NULL);
+
+		__atomic_fetch_add(&slept, wake - t, __ATOMIC_RELAXED);
+	}
+}
+
+void throttle_report(void)
+{
+	if (!throttle_enabled)
+		return;
+
+	fprintf(stderr, "throttle: slept %.1f thread-seconds",
+		slept / 1e9);
+	if (target_latency) {
+		fprintf(stderr, ", backed off %llu times, final limits ",
+			(unsigned long long)backoffs);
+		if (cur_bw)
+			fprintf(stderr, "%.1f MB/s", cur_bw / 1e6);
+		else
+			fprintf(stderr, "unlimited bandwidth");
+		if (cur_iops)
+			fprintf(stderr, " %.0f IOPS", cur_iops);
+		else
+			fprintf(stderr, " unlimited IOPS");
+	}
+	fputc('\n', stderr);
+}
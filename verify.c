@@ -0,0 +1,514 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <obstack.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "compress.h"
+#include "mksums_common.h"
+#include "stats.h"
+#include "sumfile.h"
+
+/*
+ * Checks files against a sum file.  Every sum file entry gets an
+ * index, which is kept in file_to_hash->node of the file that is
+ * being checked against it, so that results coming back from
+ * hash_chain() can be matched up without going through the path.
+ */
+#define VERIFY_PATH_SIZE	65536
+
+struct verify_entry
+{
+	struct iv_avl_node	an;
+	uint8_t			hash[64];
+	int			index;
+	int			seen;
+	int			dirlen;
+	int			len;
+	char			path[0];
+};
+
+struct verify
+{
+	FILE			*out;
+	struct obstack		pool;
+	struct iv_avl_tree	entries;
+	struct verify_entry	**index;
+	int			num_entries;
+	int			max_entries;
+
+	uint64_t		ok;
+	uint64_t		mismatched;
+	uint64_t		failed;
+	uint64_t		missing;
+	uint64_t		extra;
+};
+
+static int
+compare_entries(const struct iv_avl_node *_a, const struct iv_avl_node *_b)
+{
+	const struct verify_entry *a =
+		iv_container_of(_a, struct verify_entry, an);
+	const struct verify_entry *b =
+		iv_container_of(_b, struct verify_entry, an);
+
+	return strcmp(a->path, b->path);
+}
+
+static struct verify_entry *find_entry(struct iv_avl_tree *tree,
+				       const char *path)
+{
+	struct iv_avl_node *an;
+
+	an = tree->root;
+	while (an != NULL) {
+		struct verify_entry *e;
+		int ret;
+
+		e = iv_container_of(an, struct verify_entry, an);
+
+		ret = strcmp(path, e->path);
+		if (ret == 0)
+			return e;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+#define obstack_chunk_alloc	malloc
+#define obstack_chunk_free	free
+
+static void add_entry(void *cookie, const uint8_t *hash,
+		      const char *dir, int dirlen, const char *name, int namelen)
+{
+	struct verify *v = cookie;
+	struct verify_entry *e;
+
+	e = obstack_alloc(&v->pool, sizeof(*e) + dirlen + namelen + 1);
+	if (e == NULL)
+		abort();
+
+	memcpy(e->hash, hash, sizeof(e->hash));
+	e->index = v->num_entries;
+	e->seen = 0;
+	e->dirlen = dirlen;
+	e->len = dirlen + namelen;
+	memcpy(e->path, dir, dirlen);
+	memcpy(e->path + dirlen, name, namelen);
+	e->path[e->len] = 0;
+
+	if (iv_avl_tree_insert(&v->entries, &e->an)) {
+		fprintf(stderr, "duplicate sum file entry: %s\n", e->path);
+		obstack_free(&v->pool, e);
+		return;
+	}
+
+	if (v->num_entries == v->max_entries) {
+		v->max_entries = v->max_entries ? 2 * v->max_entries : 1024;
+		v->index = realloc(v->index,
+				   v->max_entries * sizeof(*v->index));
+		if (v->index == NULL)
+			abort();
+	}
+
+	v->index[v->num_entries++] = e;
+}
+
+static void parse_text(struct verify *v, const char *buf, size_t len)
+{
+	const char *end;
+
+	end = buf + len;
+	while (buf < end) {
+		const char *nl;
+		const char *path;
+		const char *slash;
+		int linelen;
+		int dirlen;
+		uint8_t hash[64];
+
+		nl = memchr(buf, '\n', end - buf);
+		if (nl == NULL)
+			nl = end;
+		linelen = nl - buf;
+
+		if (linelen < 131 || sumfile_parse_hex(hash, buf) ||
+		    buf[128] != ' ' || buf[129] != ' ') {
+			fprintf(stderr, "error parsing line: %.*s\n",
+				linelen, buf);
+			buf = nl + 1;
+			continue;
+		}
+
+		path = buf + 130;
+		slash = memrchr(path, '/', linelen - 130);
+		dirlen = (slash != NULL) ? slash + 1 - path : 0;
+
+		add_entry(v, hash, path, dirlen, path + dirlen,
+			  linelen - 130 - dirlen);
+
+		buf = nl + 1;
+	}
+}
+
+static int load_sum_file(struct verify *v, const char *file)
+{
+	struct stat buf;
+	uint8_t magic[8];
+	void *map;
+	size_t len;
+	int mapped;
+	int fd;
+	int ret;
+
+	stats_count(STATS_SYS_OPEN, 1);
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	stats_count(STATS_SYS_PREAD, 1);
+	ret = pread(fd, magic, sizeof(magic), 0);
+	if (ret > 0 && decompress_is_zstd(magic, ret)) {
+		struct decompress_job *job;
+		FILE *fp;
+
+		job = decompress_start(file, fd, NULL);
+		if (job == NULL || decompress_finish(job, &fp, &map, &len))
+			return 1;
+		mapped = 0;
+	} else {
+		stats_count(STATS_SYS_FSTAT, 1);
+		if (fstat(fd, &buf) < 0) {
+			perror("fstat");
+			close(fd);
+			return 1;
+		}
+
+		map = NULL;
+		len = buf.st_size;
+		if (len) {
+			map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED) {
+				perror("mmap");
+				close(fd);
+				return 1;
+			}
+			madvise(map, len, MADV_SEQUENTIAL);
+		}
+		mapped = 1;
+
+		close(fd);
+	}
+
+	stats_count(STATS_BYTES_READ, len);
+
+	ret = 0;
+	if (sumfile_is_binary(map, len))
+		ret = sumfile_parse(file, map, len, v, add_entry);
+	else
+		parse_text(v, map, len);
+
+	if (mapped && map != NULL)
+		munmap(map, len);
+	else if (!mapped)
+		free(map);
+
+	return ret;
+}
+
+struct verify *verify_open(const char *file, FILE *out)
+{
+	struct verify *v;
+
+	v = calloc(1, sizeof(*v));
+	if (v == NULL)
+		abort();
+
+	v->out = out;
+	obstack_init(&v->pool);
+	obstack_chunk_size(&v->pool) = 131072;
+	INIT_IV_AVL_TREE(&v->entries, compare_entries);
+
+	if (load_sum_file(v, file)) {
+		obstack_free(&v->pool, NULL);
+		free(v->index);
+		free(v);
+		return NULL;
+	}
+
+	return v;
+}
+
+static void report(struct verify *v, const struct verify_entry *e,
+		   const char *what)
+{
+	fprintf(v->out, "%s: %s\n", e->path, what);
+}
+
+static struct dir *open_dir(const struct verify_entry *e)
+{
+	struct dir *dir;
+	struct stat buf;
+	int len;
+
+	/*
+	 * The directory prefix includes its trailing slash, which is
+	 * dropped unless the prefix is the root directory.
+	 */
+	len = (e->dirlen > 1) ? e->dirlen - 1 : e->dirlen;
+
+	dir = malloc(sizeof(*dir) + (len ? len : 1) + 1);
+	if (dir == NULL)
+		abort();
+
+	dir->parent = NULL;
+	if (len) {
+		memcpy(dir->name, e->path, len);
+		dir->name[len] = 0;
+	} else {
+		strcpy(dir->name, ".");
+	}
+
+	dir->dirfd = openat_try_noatime(AT_FDCWD, dir->name, O_DIRECTORY);
+	if (dir->dirfd < 0) {
+		free(dir);
+		return NULL;
+	}
+
+	/*
+	 * The sum file can name paths on any number of filesystems,
+	 * so hard links are matched up by device as well as inode.
+	 */
+	stats_count(STATS_SYS_FSTAT, 1);
+	if (fstat(dir->dirfd, &buf) < 0) {
+		int err = errno;
+
+		close(dir->dirfd);
+		free(dir);
+		errno = err;
+		return NULL;
+	}
+	dir->st_dev = buf.st_dev;
+
+	return dir;
+}
+
+int verify_build(struct verify *v, struct iv_list_head *files)
+{
+	struct verify_entry *last;
+	struct dir *dir;
+	int dir_err;
+	int dir_used;
+	int i;
+
+	last = NULL;
+	dir = NULL;
+	dir_err = 0;
+	dir_used = 0;
+
+	for (i = 0; i < v->num_entries; i++) {
+		struct verify_entry *e = v->index[i];
+		const char *name;
+		struct stat buf;
+		struct file_to_hash *fh;
+
+		/*
+		 * Sum files list files directory by directory, so
+		 * reopening a directory whenever the prefix changes
+		 * opens each directory about once.
+		 */
+		if (last == NULL || e->dirlen != last->dirlen ||
+		    memcmp(e->path, last->path, e->dirlen)) {
+			if (dir != NULL && !dir_used) {
+				close(dir->dirfd);
+				free(dir);
+			}
+
+			dir = open_dir(e);
+			dir_err = (dir == NULL) ? errno : 0;
+			dir_used = 0;
+			last = e;
+		}
+
+		/*
+		 * Files that don't exist are left unseen, and are
+		 * reported as missing by verify_close().
+		 */
+		if (dir == NULL) {
+			if (dir_err != ENOENT) {
+				e->seen = 1;
+				v->failed++;
+				report(v, e, "FAILED open or read");
+			}
+			continue;
+		}
+
+		name = e->path + e->dirlen;
+
+		stats_count(STATS_SYS_FSTATAT, 1);
+		if (fstatat(dir->dirfd, name, &buf, AT_SYMLINK_NOFOLLOW) < 0) {
+			if (errno != ENOENT) {
+				e->seen = 1;
+				v->failed++;
+				report(v, e, "FAILED open or read");
+			}
+			continue;
+		}
+
+		e->seen = 1;
+
+		if (!S_ISREG(buf.st_mode)) {
+			v->failed++;
+			report(v, e, "FAILED not a regular file");
+			continue;
+		}
+
+		fh = malloc(sizeof(*fh) + e->len - e->dirlen + 1);
+		if (fh == NULL)
+			abort();
+
+		fh->dir = dir;
+		fh->d_ino = buf.st_ino;
+		fh->state = STATE_NOTYET;
+		fh->node = e->index;
+		fh->st_size = buf.st_size;
+		strcpy(fh->d_name, name);
+
+		iv_list_add_tail(&fh->list, files);
+		dir_used = 1;
+	}
+
+	if (dir != NULL && !dir_used) {
+		close(dir->dirfd);
+		free(dir);
+	}
+
+	return 0;
+}
+
+void verify_match(struct verify *v, struct iv_list_head *files,
+		  struct iv_list_head *extra)
+{
+	struct iv_list_head *lh;
+	struct iv_list_head *lh2;
+	char *path;
+
+	path = malloc(VERIFY_PATH_SIZE);
+	if (path == NULL)
+		abort();
+
+	iv_list_for_each_safe (lh, lh2, files) {
+		struct file_to_hash *fh;
+		struct verify_entry *e;
+		int len;
+
+		fh = iv_container_of(lh, struct file_to_hash, list);
+
+		len = format_dir_path(path, VERIFY_PATH_SIZE, fh->dir);
+		if (len < VERIFY_PATH_SIZE) {
+			len += snprintf(path + len, VERIFY_PATH_SIZE - len,
+					"/%s", fh->d_name);
+		}
+
+		e = NULL;
+		if (len < VERIFY_PATH_SIZE)
+			e = find_entry(&v->entries, path);
+
+		if (e == NULL) {
+			iv_list_del(&fh->list);
+			iv_list_add_tail(&fh->list, extra);
+
+			v->extra++;
+			fprintf(v->out, "%s: EXTRA\n", path);
+			continue;
+		}
+
+		e->seen = 1;
+		fh->node = e->index;
+	}
+
+	free(path);
+}
+
+void verify_result(void *cookie, struct file_to_hash *fh,
+		   const uint8_t *hash)
+{
+	struct verify *v = cookie;
+	struct verify_entry *e = v->index[fh->node];
+
+	if (hash == NULL) {
+		v->failed++;
+		report(v, e, "FAILED open or read");
+	} else if (memcmp(hash, e->hash, sizeof(e->hash))) {
+		v->mismatched++;
+		report(v, e, "FAILED");
+	} else {
+		v->ok++;
+	}
+}
+
+int verify_close(struct verify *v)
+{
+	int ret;
+	int i;
+
+	for (i = 0; i < v->num_entries; i++) {
+		struct verify_entry *e = v->index[i];
+
+		if (!e->seen) {
+			v->missing++;
+			report(v, e, "MISSING");
+		}
+	}
+
+	fflush(v->out);
+
+	fprintf(stderr, "verify: %llu OK, %llu mismatched, %llu unreadable, "
+			"%llu missing, %llu extra\n",
+		(unsigned long long)v->ok,
+		(unsigned long long)v->mismatched,
+		(unsigned long long)v->failed,
+		(unsigned long long)v->missing,
+		(unsigned long long)v->extra);
+
+	ret = v->mismatched || v->failed || v->missing || v->extra;
+
+	obstack_free(&v->pool, NULL);
+	free(v->index);
+	free(v);
+
+	return ret;
+}
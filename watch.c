@@ -0,0 +1,826 @@
+/*
+ * mksums, a tool for hashing all files in a directory tree
+ * Copyright (C) 2023 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "mksums_common.h"
+
+/*
+ * Watch mode.  Watches are put on every directory before the initial
+ * scan, so that nothing that changes while the initial run is in
+ * progress is missed.  Afterwards, every inotify event just marks the
+ * path it refers to as dirty, and a dirty path is looked at again once
+ * it has been quiet for the debounce interval: a regular file is
+ * rehashed if its size or mtime changed, a directory is rescanned,
+ * and anything that has disappeared is reported as deleted.
+ *
+ * Records are printed as:
+ *
+ *	A <sha512>  <path>	file added
+ *	M <sha512>  <path>	file contents changed
+ *	D <path>		file deleted
+ *
+ * The dirty queue is bounded.  Once it holds WATCH_MAX_PENDING paths,
+ * further events for files queue a rescan of their directory instead,
+ * and if that overflows too, or the kernel's event queue overflows,
+ * all roots are rescanned.  Directories that can't be watched because
+ * the inotify watch limit has been reached are rescanned every
+ * WATCH_POLL_INTERVAL instead.
+ */
+#define WATCH_MASK		(IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+				 IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | \
+				 IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define WATCH_MAX_PENDING	65536
+#define WATCH_POLL_INTERVAL	30000
+
+struct watch_dir
+{
+	struct iv_avl_node	an;
+	int			wd;
+	char			path[0];
+};
+
+struct known_file
+{
+	struct iv_avl_node	an;
+	uint8_t			hash[64];
+	ino_t			st_ino;
+	off_t			st_size;
+	struct timespec		st_mtim;
+	uint32_t		gen;
+	char			path[0];
+};
+
+struct pending
+{
+	struct iv_avl_node	an;
+	uint64_t		due;
+	int			rescan;
+	char			path[0];
+};
+
+struct watch
+{
+	int			fd;
+	int			num_roots;
+	char			**roots;
+	int			debounce;
+	struct iv_avl_tree	dirs;
+	int			num_dirs;
+	pthread_mutex_t		seed_lock;
+	struct iv_avl_tree	known;
+	struct iv_avl_tree	pending;
+	int			num_pending;
+	int			rescan_all;
+	uint32_t		gen;
+	int			warned_nospc;
+	FILE			*out;
+};
+
+static volatile sig_atomic_t stop;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int compare_dirs(const struct iv_avl_node *_a,
+			const struct iv_avl_node *_b)
+{
+	const struct watch_dir *a = iv_container_of(_a, struct watch_dir, an);
+	const struct watch_dir *b = iv_container_of(_b, struct watch_dir, an);
+
+	if (a->wd < b->wd)
+		return -1;
+	if (a->wd > b->wd)
+		return 1;
+
+	return 0;
+}
+
+static int compare_known(const struct iv_avl_node *_a,
+			 const struct iv_avl_node *_b)
+{
+	const struct known_file *a = iv_container_of(_a, struct known_file, an);
+	const struct known_file *b = iv_container_of(_b, struct known_file, an);
+
+	return strcmp(a->path, b->path);
+}
+
+static int compare_pending(const struct iv_avl_node *_a,
+			   const struct iv_avl_node *_b)
+{
+	const struct pending *a = iv_container_of(_a, struct pending, an);
+	const struct pending *b = iv_container_of(_b, struct pending, an);
+
+	return strcmp(a->path, b->path);
+}
+
+static struct watch_dir *find_dir(struct watch *w, int wd)
+{
+	struct iv_avl_node *an;
+
+	an = w->dirs.root;
+	while (an != NULL) {
+		struct watch_dir *d;
+
+		d = iv_container_of(an, struct watch_dir, an);
+		if (wd == d->wd)
+			return d;
+
+		if (wd < d->wd)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the first known file whose path is >= path.
+ */
+static struct known_file *find_known_ge(struct watch *w, const char *path)
+{
+	struct iv_avl_node *an;
+	struct known_file *best;
+
+	best = NULL;
+
+	an = w->known.root;
+	while (an != NULL) {
+		struct known_file *k;
+		int ret;
+
+		k = iv_container_of(an, struct known_file, an);
+
+		ret = strcmp(path, k->path);
+		if (ret == 0)
+			return k;
+
+		if (ret < 0) {
+			best = k;
+			an = an->left;
+		} else {
+			an = an->right;
+		}
+	}
+
+	return best;
+}
+
+static struct known_file *find_known(struct watch *w, const char *path)
+{
+	struct known_file *k;
+
+	k = find_known_ge(w, path);
+	if (k != NULL && !strcmp(k->path, path))
+		return k;
+
+	return NULL;
+}
+
+static struct pending *find_pending(struct watch *w, const char *path)
+{
+	struct iv_avl_node *an;
+
+	an = w->pending.root;
+	while (an != NULL) {
+		struct pending *p;
+		int ret;
+
+		p = iv_container_of(an, struct pending, an);
+
+		ret = strcmp(path, p->path);
+		if (ret == 0)
+			return p;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static char *join(const char *dir, const char *name)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		abort();
+
+	return path;
+}
+
+static void queue(struct watch *w, const char *path, int rescan,
+		  uint64_t due)
+{
+	struct pending *p;
+	char *parent;
+
+	p = find_pending(w, path);
+	if (p != NULL) {
+		p->due = due;
+		p->rescan |= rescan;
+		return;
+	}
+
+	if (w->num_pending >= WATCH_MAX_PENDING) {
+		char *slash;
+
+		if (rescan) {
+			w->rescan_all = 1;
+			return;
+		}
+
+		parent = strdup(path);
+		if (parent == NULL)
+			abort();
+
+		slash = strrchr(parent, '/');
+		if (slash != NULL)
+			*slash = 0;
+
+		p = find_pending(w, parent);
+		if (p == NULL)
+			w->rescan_all = 1;
+		else
+			p->rescan = 1;
+
+		free(parent);
+
+		return;
+	}
+
+	p = malloc(sizeof(*p) + strlen(path) + 1);
+	if (p == NULL)
+		abort();
+
+	p->due = due;
+	p->rescan = rescan;
+	strcpy(p->path, path);
+	iv_avl_tree_insert(&w->pending, &p->an);
+	w->num_pending++;
+}
+
+static int add_watch(struct watch *w, const char *path)
+{
+	struct watch_dir *d;
+	int wd;
+
+	wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+	if (wd < 0) {
+		if (errno == ENOSPC) {
+			if (!w->warned_nospc) {
+				fprintf(stderr, "watch: inotify watch limit "
+						"reached, polling directories "
+						"that can't be watched\n");
+				w->warned_nospc = 1;
+			}
+			queue(w, path, 1, now_ms() + WATCH_POLL_INTERVAL);
+			return 1;
+		}
+
+		if (errno != ENOENT && errno != ENOTDIR) {
+			fprintf(stderr, "inotify_add_watch %s: %s\n", path,
+				strerror(errno));
+		}
+		return 0;
+	}
+
+	/*
+	 * Watching a directory we already watch, for example because it
+	 * was moved, gives back the same watch descriptor.
+	 */
+	d = find_dir(w, wd);
+	if (d != NULL) {
+		iv_avl_tree_delete(&w->dirs, &d->an);
+		free(d);
+		w->num_dirs--;
+	}
+
+	d = malloc(sizeof(*d) + strlen(path) + 1);
+	if (d == NULL)
+		abort();
+
+	d->wd = wd;
+	strcpy(d->path, path);
+	iv_avl_tree_insert(&w->dirs, &d->an);
+	w->num_dirs++;
+
+	return 0;
+}
+
+static void emit(struct watch *w, char type, struct known_file *k)
+{
+	int i;
+
+	fprintf(w->out, "%c ", type);
+	if (type != 'D') {
+		for (i = 0; i < sizeof(k->hash); i++)
+			fprintf(w->out, "%.2x", k->hash[i]);
+		fprintf(w->out, " ");
+	}
+	fprintf(w->out, " %s\n", k->path);
+}
+
+static void forget(struct watch *w, struct known_file *k)
+{
+	emit(w, 'D', k);
+	iv_avl_tree_delete(&w->known, &k->an);
+	free(k);
+}
+
+static void check_file(struct watch *w, const char *path,
+		       const struct hash_options *opts)
+{
+	struct known_file *k;
+	struct stat buf;
+	struct file_to_hash *fh;
+	struct dir *dir;
+	char *slash;
+	int len;
+
+	k = find_known(w, path);
+
+	if (lstat(path, &buf) < 0 || !S_ISREG(buf.st_mode)) {
+		if (k != NULL)
+			forget(w, k);
+		return;
+	}
+
+	if (k != NULL) {
+		k->gen = w->gen;
+		if (k->st_ino == buf.st_ino && k->st_size == buf.st_size &&
+		    k->st_mtim.tv_sec == buf.st_mtim.tv_sec &&
+		    k->st_mtim.tv_nsec == buf.st_mtim.tv_nsec) {
+			return;
+		}
+	}
+
+	slash = strrchr(path, '/');
+	if (slash == NULL)
+		return;
+	len = slash - path;
+
+	dir = malloc(sizeof(*dir) + len + 1);
+	fh = malloc(sizeof(*fh) + strlen(slash + 1) + 1);
+	if (dir == NULL || fh == NULL)
+		abort();
+
+	dir->parent = NULL;
+	memcpy(dir->name, path, len);
+	dir->name[len] = 0;
+	dir->dirfd = open(dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir->st_dev = buf.st_dev;
+
+	fh->dir = dir;
+	fh->d_ino = buf.st_ino;
+	fh->state = STATE_NOTYET;
+	fh->node = 0;
+	fh->st_size = buf.st_size;
+	strcpy(fh->d_name, slash + 1);
+
+	if (dir->dirfd >= 0 && !hash_one_file(fh, opts)) {
+		char type;
+
+		type = 'M';
+		if (k == NULL) {
+			k = malloc(sizeof(*k) + strlen(path) + 1);
+			if (k == NULL)
+				abort();
+
+			strcpy(k->path, path);
+			iv_avl_tree_insert(&w->known, &k->an);
+
+			type = 'A';
+		} else if (!memcmp(k->hash, fh->hash, sizeof(k->hash))) {
+			type = 0;
+		}
+
+		memcpy(k->hash, fh->hash, sizeof(k->hash));
+		k->st_ino = buf.st_ino;
+		k->st_size = buf.st_size;
+		k->st_mtim = buf.st_mtim;
+		k->gen = w->gen;
+
+		if (type)
+			emit(w, type, k);
+	}
+
+	if (dir->dirfd >= 0)
+		close(dir->dirfd);
+	free(dir);
+	free(fh);
+}
+
+/*
+ * Adds watches for the tree under path, and if opts is non-NULL,
+ * checks every regular file in it.  Once a directory can't be watched,
+ * it is polled, and that covers everything below it too.
+ */
+static void walk(struct watch *w, const char *path,
+		 const struct hash_options *opts, int add_watches)
+{
+	DIR *dirp;
+	struct dirent *dent;
+
+	if (add_watches && add_watch(w, path))
+		add_watches = 0;
+
+	dirp = opendir(path);
+	if (dirp == NULL)
+		return;
+
+	while ((dent = readdir(dirp)) != NULL) {
+		char *child;
+		int type;
+
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+			continue;
+
+		child = join(path, dent->d_name);
+
+		type = dent->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat buf;
+
+			type = DT_REG;
+			if (lstat(child, &buf) == 0 && S_ISDIR(buf.st_mode))
+				type = DT_DIR;
+		}
+
+		if (type == DT_DIR)
+			walk(w, child, opts, add_watches);
+		else if (type == DT_REG && opts != NULL)
+			check_file(w, child, opts);
+
+		free(child);
+	}
+
+	closedir(dirp);
+}
+
+static int under(const char *path, const char *prefix, int len)
+{
+	return !strncmp(path, prefix, len) &&
+	       (path[len] == 0 || path[len] == '/');
+}
+
+static void rescan(struct watch *w, const char *path,
+		   const struct hash_options *opts)
+{
+	struct stat buf;
+	struct known_file *k;
+	int len;
+
+	w->gen++;
+
+	if (lstat(path, &buf) == 0 && S_ISDIR(buf.st_mode)) {
+		walk(w, path, opts, 1);
+	} else {
+		struct iv_avl_node *an;
+		struct iv_avl_node *an2;
+
+		len = strlen(path);
+		iv_avl_tree_for_each_safe (an, an2, &w->dirs) {
+			struct watch_dir *d;
+
+			d = iv_container_of(an, struct watch_dir, an);
+			if (under(d->path, path, len)) {
+				inotify_rm_watch(w->fd, d->wd);
+				iv_avl_tree_delete(&w->dirs, &d->an);
+				free(d);
+				w->num_dirs--;
+			}
+		}
+	}
+
+	/*
+	 * Everything below path that the walk didn't see is gone.
+	 */
+	len = strlen(path);
+	k = find_known_ge(w, path);
+	while (k != NULL && !strncmp(k->path, path, len)) {
+		struct iv_avl_node *next;
+
+		next = iv_avl_tree_next(&k->an);
+		if (under(k->path, path, len) && k->gen != w->gen)
+			forget(w, k);
+
+		k = next ? iv_container_of(next, struct known_file, an) : NULL;
+	}
+}
+
+static void clear_pending(struct watch *w)
+{
+	struct iv_avl_node *an;
+	struct iv_avl_node *an2;
+
+	iv_avl_tree_for_each_safe (an, an2, &w->pending) {
+		iv_avl_tree_delete(&w->pending, an);
+		free(iv_container_of(an, struct pending, an));
+	}
+	w->num_pending = 0;
+}
+
+static void read_events(struct watch *w)
+{
+	char buf[65536]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	uint64_t due;
+
+	due = now_ms() + w->debounce;
+
+	while (1) {
+		ssize_t len;
+		char *p;
+
+		len = read(w->fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		for (p = buf; p < buf + len;
+		     p += sizeof(struct inotify_event) +
+			  ((struct inotify_event *)p)->len) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			struct watch_dir *d;
+			char *path;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "watch: event queue overflow, "
+						"rescanning\n");
+				w->rescan_all = 1;
+				continue;
+			}
+
+			d = find_dir(w, ev->wd);
+			if (d == NULL)
+				continue;
+
+			if (ev->mask & IN_IGNORED) {
+				iv_avl_tree_delete(&w->dirs, &d->an);
+				free(d);
+				w->num_dirs--;
+				continue;
+			}
+
+			if (!ev->len)
+				continue;
+
+			/*
+			 * Files made by link() or mknod() never see an
+			 * IN_CLOSE_WRITE, so creation has to be looked at
+			 * too.  Files that are still being written just
+			 * get queued again by their IN_CLOSE_WRITE.
+			 */
+			path = join(d->path, ev->name);
+			if (ev->mask & IN_ISDIR) {
+				queue(w, path, 1, due);
+			} else if (ev->mask & (IN_CLOSE_WRITE | IN_CREATE |
+					       IN_MOVED_TO | IN_MOVED_FROM |
+					       IN_DELETE)) {
+				queue(w, path, 0, due);
+			}
+			free(path);
+		}
+	}
+}
+
+static void run_pending(struct watch *w, const struct hash_options *opts)
+{
+	struct iv_avl_node *an;
+	struct iv_avl_node *an2;
+	uint64_t now;
+
+	if (w->rescan_all) {
+		int i;
+
+		clear_pending(w);
+		w->rescan_all = 0;
+
+		for (i = 0; i < w->num_roots; i++)
+			rescan(w, w->roots[i], opts);
+
+		return;
+	}
+
+	now = now_ms();
+
+	iv_avl_tree_for_each_safe (an, an2, &w->pending) {
+		struct pending *p;
+
+		p = iv_container_of(an, struct pending, an);
+		if (p->due > now)
+			continue;
+
+		iv_avl_tree_delete(&w->pending, &p->an);
+		w->num_pending--;
+
+		if (p->rescan)
+			rescan(w, p->path, opts);
+		else
+			check_file(w, p->path, opts);
+
+		free(p);
+	}
+}
+
+static int next_timeout(struct watch *w)
+{
+	struct iv_avl_node *an;
+	uint64_t now;
+	uint64_t next;
+
+	if (w->rescan_all)
+		return 0;
+
+	if (iv_avl_tree_empty(&w->pending))
+		return -1;
+
+	now = now_ms();
+	next = UINT64_MAX;
+	iv_avl_tree_for_each (an, &w->pending) {
+		struct pending *p;
+
+		p = iv_container_of(an, struct pending, an);
+		if (p->due < next)
+			next = p->due;
+	}
+
+	return next > now ? next - now : 0;
+}
+
+struct watch *watch_open(int num_roots, char *roots[], int debounce)
+{
+	struct watch *w;
+	int i;
+
+	w = malloc(sizeof(*w));
+	if (w == NULL)
+		abort();
+
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd < 0) {
+		perror("inotify_init1");
+		free(w);
+		return NULL;
+	}
+
+	w->num_roots = num_roots;
+	w->roots = roots;
+	w->debounce = debounce;
+	INIT_IV_AVL_TREE(&w->dirs, compare_dirs);
+	w->num_dirs = 0;
+	pthread_mutex_init(&w->seed_lock, NULL);
+	INIT_IV_AVL_TREE(&w->known, compare_known);
+	INIT_IV_AVL_TREE(&w->pending, compare_pending);
+	w->num_pending = 0;
+	w->rescan_all = 0;
+	w->gen = 0;
+	w->warned_nospc = 0;
+	w->out = stdout;
+
+	for (i = 0; i < num_roots; i++)
+		walk(w, roots[i], NULL, 1);
+
+	return w;
+}
+
+/*
+ * Used as the hashed callback of the initial run, so that files are
+ * known along with the metadata that their hash corresponds to, and
+ * only rehashed later on if that changes.  Called from the hash
+ * workers.
+ */
+void watch_seed(void *cookie, struct file_to_hash *fh,
+		const uint8_t *hash, const struct stat *st)
+{
+	struct watch *w = cookie;
+	char path[PATH_MAX];
+	struct known_file *k;
+	int len;
+
+	if (hash == NULL)
+		return;
+
+	len = format_dir_path(path, sizeof(path), fh->dir);
+	len += snprintf(path + (len < sizeof(path) ? len : 0),
+			len < sizeof(path) ? sizeof(path) - len : 0,
+			"/%s", fh->d_name);
+	if (len >= sizeof(path))
+		return;
+
+	k = malloc(sizeof(*k) + len + 1);
+	if (k == NULL)
+		abort();
+
+	memcpy(k->hash, hash, sizeof(k->hash));
+	k->st_ino = st->st_ino;
+	k->st_size = st->st_size;
+	k->st_mtim = st->st_mtim;
+	k->gen = 0;
+	strcpy(k->path, path);
+
+	pthread_mutex_lock(&w->seed_lock);
+	if (iv_avl_tree_insert(&w->known, &k->an))
+		free(k);
+	pthread_mutex_unlock(&w->seed_lock);
+}
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+void watch_run(struct watch *w, const struct hash_options *opts)
+{
+	struct sigaction sa;
+	struct iv_avl_node *an;
+	struct iv_avl_node *an2;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	w->out = opts->out;
+
+	fprintf(stderr, "watch: watching %d directories\n", w->num_dirs);
+
+	while (!stop) {
+		struct pollfd pfd;
+
+		pfd.fd = w->fd;
+		pfd.events = POLLIN;
+
+		if (poll(&pfd, 1, next_timeout(w)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (pfd.revents & POLLIN)
+			read_events(w);
+
+		run_pending(w, opts);
+
+		fflush(w->out);
+	}
+
+	close(w->fd);
+
+	clear_pending(w);
+
+	iv_avl_tree_for_each_safe (an, an2, &w->dirs) {
+		iv_avl_tree_delete(&w->dirs, an);
+		free(iv_container_of(an, struct watch_dir, an));
+	}
+
+	iv_avl_tree_for_each_safe (an, an2, &w->known) {
+		iv_avl_tree_delete(&w->known, an);
+		free(iv_container_of(an, struct known_file, an));
+	}
+
+	pthread_mutex_destroy(&w->seed_lock);
+	free(w);
+}